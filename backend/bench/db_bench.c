@@ -0,0 +1,291 @@
+//db_bench.c
+// Times the storage layer (database.c) on its own, against an in-memory
+// SQLite database (or a temporary file with --file) filled with synthetic
+// users, cars and notifications. Reports ns/op, allocations/op and rows/sec
+// per function.
+// Usage: bench/db_bench [--sizes 10,1000,10000] [--time 0.5] [--file]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include <sodium.h>
+#include "mongoose.h"
+#include "app.h"
+
+#define MAX_SIZES 8
+#define PAGE_LIMIT 50
+#define PASSWORD "bench-password-1"
+
+#ifdef __GLIBC__
+// Counts every allocation in the process, SQLite's and libsodium's
+// included, by interposing the allocator
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    allocations++;
+    return __libc_realloc(p, size);
+}
+#else
+static unsigned long allocations; // Not counted on this platform
+#endif
+
+// sse.o and write_queue.o need this from server.c; nothing here completes
+void complete_on_loop(struct app_context *ctx, struct completion *c) {
+}
+
+static struct app_context ctx;
+static struct mg_iobuf out;
+static double time_budget = 0.5;
+
+// What one benchmark works on
+struct subject {
+    int user_id;
+    int rows;          // Cars and notifications the user has
+    const char *email;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs fn until the time budget is spent (at least 3 times) and prints
+// its cost per call. fn returns the rows it read or wrote, or -1 on error.
+static void bench(const char *name, long (*fn)(const struct subject *), const struct subject *s) {
+    long ops = 0, rows = 0;
+    unsigned long allocs = 0;
+    double elapsed = 0;
+
+    while (elapsed < time_budget || ops < 3) {
+        unsigned long a = allocations;
+        double start = now_sec();
+        long n = fn(s);
+        elapsed += now_sec() - start;
+        allocs += allocations - a;
+        if (n < 0) {
+            printf("%-44s failed\n", name);
+            return;
+        }
+        rows += n;
+        ops++;
+    }
+    printf("%-44s %12.0f ns/op %9.1f allocs/op %12.0f rows/sec\n", name, elapsed * 1e9 / ops,
+           (double)allocs / ops, rows / elapsed);
+}
+
+static long get_cars_first_page(const struct subject *s) {
+    struct json_writer w;
+    struct page page = {0, PAGE_LIMIT, 0};
+    out.len = 0;
+    jw_init(&w, &out);
+    return get_cars(&ctx, s->user_id, &page, &w) ? (s->rows < PAGE_LIMIT ? s->rows : PAGE_LIMIT) : -1;
+}
+
+static long get_cars_all_pages(const struct subject *s) {
+    struct json_writer w;
+    struct page page = {0, PAGE_LIMIT, 0};
+    do {
+        out.len = 0;
+        jw_init(&w, &out);
+        if (!get_cars(&ctx, s->user_id, &page, &w)) {
+            return -1;
+        }
+        page.after = page.next;
+    } while (page.next);
+    return s->rows;
+}
+
+static long get_notifications_first_page(const struct subject *s) {
+    struct json_writer w;
+    struct page page = {0, PAGE_LIMIT, 0};
+    out.len = 0;
+    jw_init(&w, &out);
+    return get_notifications(&ctx, s->user_id, &page, &w) ? (s->rows < PAGE_LIMIT ? s->rows : PAGE_LIMIT) : -1;
+}
+
+static long get_notifications_all_pages(const struct subject *s) {
+    struct json_writer w;
+    struct page page = {0, PAGE_LIMIT, 0};
+    do {
+        out.len = 0;
+        jw_init(&w, &out);
+        if (!get_notifications(&ctx, s->user_id, &page, &w)) {
+            return -1;
+        }
+        page.after = page.next;
+    } while (page.next);
+    return s->rows;
+}
+
+static long profile(const struct subject *s) {
+    struct json_writer w;
+    out.len = 0;
+    jw_init(&w, &out);
+    return get_user_profile(&ctx, s->user_id, &w) ? 1 : -1;
+}
+
+static long unread_count(const struct subject *s) {
+    return get_unread_count(&ctx, s->user_id) >= 0 ? 1 : -1;
+}
+
+static long send_one(const struct subject *s) {
+    return send_notification(&ctx, s->user_id, s->user_id, "Benchmark message", (long long)time(NULL)) ? 1 : -1;
+}
+
+// 100 inserts sharing one transaction, as the writer thread batches them
+static long send_batch(const struct subject *s) {
+    sqlite3_exec(ctx.db, "BEGIN IMMEDIATE;", 0, 0, 0);
+    for (int i = 0; i < 100; i++) {
+        if (!send_notification(&ctx, s->user_id, s->user_id, "Benchmark message", (long long)time(NULL))) {
+            sqlite3_exec(ctx.db, "ROLLBACK;", 0, 0, 0);
+            return -1;
+        }
+    }
+    return sqlite3_exec(ctx.db, "COMMIT;", 0, 0, 0) == SQLITE_OK ? 100 : -1;
+}
+
+static long add_one_car(const struct subject *s) {
+    return add_car(&ctx, s->user_id, "Benchmark car", "2020", "10000", "") ? 1 : -1;
+}
+
+// The two halves of login_user: the lookup, then the hash check
+static long login_select(const struct subject *s) {
+    char hash[crypto_pwhash_STRBYTES];
+    return get_password_hash(&ctx, s->email, hash) > 0 ? 1 : -1;
+}
+
+static char stored_hash[crypto_pwhash_STRBYTES];
+
+static long login_verify(const struct subject *s) {
+    return crypto_pwhash_str_verify(stored_hash, PASSWORD, strlen(PASSWORD)) == 0 ? 1 : -1;
+}
+
+static long login_total(const struct subject *s) {
+    char token[512];
+    return login_user(&ctx, s->email, PASSWORD, token) ? 1 : -1;
+}
+
+// Registers a user with rows cars and rows notifications addressed to them
+static int seed_user(struct subject *s, int rows, char *email, size_t email_size) {
+    snprintf(email, email_size, "bench%d@example.com", rows);
+    if (!register_user(&ctx, "Bench", "User", email, "DriveHub", stored_hash)) {
+        return 0;
+    }
+    s->user_id = (int)sqlite3_last_insert_rowid(ctx.db);
+    s->rows = rows;
+    s->email = email;
+
+    sqlite3_exec(ctx.db, "BEGIN;", 0, 0, 0);
+    for (int i = 0; i < rows; i++) {
+        char name[32], year[8], value[16];
+        snprintf(name, sizeof(name), "Car %d", i);
+        snprintf(year, sizeof(year), "%d", 1990 + i % 35);
+        snprintf(value, sizeof(value), "%d", 5000 + i);
+        if (!add_car(&ctx, s->user_id, name, year, value, "") ||
+            !send_notification(&ctx, s->user_id, s->user_id, "Synthetic notification for the benchmark",
+                               (long long)time(NULL))) {
+            sqlite3_exec(ctx.db, "ROLLBACK;", 0, 0, 0);
+            return 0;
+        }
+    }
+    return sqlite3_exec(ctx.db, "COMMIT;", 0, 0, 0) == SQLITE_OK;
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[MAX_SIZES] = {10, 1000, 10000}, num_sizes = 3, use_file = 0;
+    char path[64] = ":memory:";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            char *p = argv[++i];
+            for (num_sizes = 0; *p && num_sizes < MAX_SIZES; num_sizes++) {
+                sizes[num_sizes] = (int)strtol(p, &p, 10);
+                p += *p == ',';
+            }
+        } else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            time_budget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--file") == 0) {
+            use_file = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--sizes 10,1000,10000] [--time seconds] [--file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // A file database pays for real commits (WAL fsyncs); memory does not
+    if (use_file) {
+        snprintf(path, sizeof(path), "/tmp/drivehub-db-bench-%d.db", (int)getpid());
+    }
+    jwt_hs256_key_init(&ctx.jwt_key, "your-secure-jwt-secret-key-1234567890");
+    ctx.jwt_secret = "your-secure-jwt-secret-key-1234567890";
+    if (!open_db(&ctx, path) || !migrate_db(ctx.db) || !prepare_statements(&ctx)) {
+        fprintf(stderr, "Failed to set up the benchmark database\n");
+        return 1;
+    }
+    hash_password(PASSWORD, stored_hash);
+
+    struct subject subjects[MAX_SIZES];
+    char emails[MAX_SIZES][64];
+    for (int i = 0; i < num_sizes; i++) {
+        double start = now_sec();
+        if (!seed_user(&subjects[i], sizes[i], emails[i], sizeof(emails[i]))) {
+            fprintf(stderr, "Failed to seed %d rows\n", sizes[i]);
+            return 1;
+        }
+        fprintf(stderr, "Seeded a user with %d cars and %d notifications in %.2f s\n", sizes[i], sizes[i],
+                now_sec() - start);
+    }
+
+    printf("Database: %s, pages of %d\n", use_file ? "temporary file" : "in memory", PAGE_LIMIT);
+    for (int i = 0; i < num_sizes; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "get_cars first page (%d cars)", sizes[i]);
+        bench(name, get_cars_first_page, &subjects[i]);
+        snprintf(name, sizeof(name), "get_cars every page (%d cars)", sizes[i]);
+        bench(name, get_cars_all_pages, &subjects[i]);
+    }
+    for (int i = 0; i < num_sizes; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "get_notifications first page (%d)", sizes[i]);
+        bench(name, get_notifications_first_page, &subjects[i]);
+        snprintf(name, sizeof(name), "get_notifications every page (%d)", sizes[i]);
+        bench(name, get_notifications_all_pages, &subjects[i]);
+    }
+    bench("get_user_profile", profile, &subjects[0]);
+    bench("get_unread_count", unread_count, &subjects[0]);
+    bench("add_car (own transaction)", add_one_car, &subjects[0]);
+    bench("send_notification (own transaction)", send_one, &subjects[0]);
+    bench("send_notification (100 per transaction)", send_batch, &subjects[0]);
+    bench("login_user: password lookup", login_select, &subjects[0]);
+    bench("login_user: crypto_pwhash_str_verify", login_verify, &subjects[0]);
+    bench("login_user: total", login_total, &subjects[0]);
+
+    mg_iobuf_free(&out);
+    close_db(&ctx);
+    if (use_file) {
+        char wal[80];
+        unlink(path);
+        snprintf(wal, sizeof(wal), "%s-wal", path);
+        unlink(wal);
+        snprintf(wal, sizeof(wal), "%s-shm", path);
+        unlink(wal);
+    }
+    return 0;
+}
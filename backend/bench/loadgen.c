@@ -0,0 +1,662 @@
+//loadgen.c
+// Drives a DriveHub server with a mix of API requests over keep-alive
+// connections and reports throughput and latency per endpoint as JSON.
+// Starts the server on a scratch database, seeds users, cars and
+// notifications, then runs the mix for a fixed time.
+// Usage: bench/loadgen [--server ./backend] [--port 5599] [--workers 1]
+//                      [--connections 32] [--duration 10] [--users 50]
+//                      [--cars 20] [--notifications 20] [--mix name=weight,...]
+//                      [--no-spawn] [--keep]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <jansson.h>
+
+#define PASSWORD "bench-password-1"
+
+enum endpoint {
+    EP_REGISTER,
+    EP_LOGIN,
+    EP_PROFILE,
+    EP_CARS,
+    EP_ADD_CAR,
+    EP_NOTIFICATIONS,
+    EP_SEND,
+    EP_UNREAD,
+    EP_COUNT
+};
+
+static const struct {
+    const char *name; // Name in --mix
+    const char *label; // Name in the report
+    int weight;        // Default share of the mix
+} endpoints[EP_COUNT] = {
+    [EP_REGISTER] = {"register", "POST /register", 1},
+    [EP_LOGIN] = {"login", "POST /login", 2},
+    [EP_PROFILE] = {"profile", "GET /profile", 25},
+    [EP_CARS] = {"cars", "GET /cars", 25},
+    [EP_ADD_CAR] = {"add_car", "POST /cars", 5},
+    [EP_NOTIFICATIONS] = {"notifications", "GET /notifications", 25},
+    [EP_SEND] = {"send", "POST /notifications", 5},
+    [EP_UNREAD] = {"unread", "GET /notifications/unread_count", 12},
+};
+
+static struct {
+    const char *server;
+    int port, workers, connections, duration, users, cars, notifications;
+    int spawn, keep;
+    int weights[EP_COUNT];
+    int total_weight;
+} opt = {"./backend", 5599, 1, 32, 10, 50, 20, 20, 1, 0, {0}, 0};
+
+// Seeded accounts, shared read-only once seeding is done
+struct user {
+    char email[64];
+    char token[512];
+    int id;
+};
+
+static struct user *users;
+static pid_t server_pid;
+static char scratch[64];
+
+// Latencies of one endpoint, in microseconds
+struct samples {
+    unsigned int *us;
+    size_t count, size;
+    unsigned long errors;
+};
+
+// One client connection and its results
+struct client {
+    pthread_t thread;
+    int index;
+    int fd;
+    char *buf;          // Response bytes read so far
+    size_t len, size;
+    unsigned int seed;  // rand_r state
+    int seeded;         // Seeding succeeded for this client's users
+    struct samples samples[EP_COUNT];
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)opt.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Reads more of the response into c->buf. Returns 0 on EOF or error.
+static int read_more(struct client *c) {
+    if (c->size - c->len < 4096) {
+        size_t size = c->size ? c->size * 2 : 65536;
+        char *buf = realloc(c->buf, size);
+        if (!buf) {
+            return 0;
+        }
+        c->buf = buf;
+        c->size = size;
+    }
+    ssize_t n;
+    do {
+        n = read(c->fd, c->buf + c->len, c->size - c->len - 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return 0;
+    }
+    c->len += (size_t)n;
+    c->buf[c->len] = '\0';
+    return 1;
+}
+
+// Sends one request on c's keep-alive connection and reads the reply.
+// Returns the status, with *body pointing at the response body in c->buf
+// (valid until the next request), or -1 if the connection failed; it is
+// reopened on the next request.
+static int request(struct client *c, const char *method, const char *path, const char *token,
+                   const char *body, const char **resp_body) {
+    char head[1024];
+    size_t body_len = body ? strlen(body) : 0;
+
+    if (c->fd < 0 && (c->fd = connect_server()) < 0) {
+        return -1;
+    }
+    int n = snprintf(head, sizeof(head),
+                     "%s %s HTTP/1.1\r\nHost: localhost\r\n%s%s%sContent-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n\r\n",
+                     method, path, token ? "Authorization: Bearer " : "", token ? token : "", token ? "\r\n" : "",
+                     body_len);
+    if (!write_all(c->fd, head, (size_t)n) || (body_len && !write_all(c->fd, body, body_len))) {
+        goto failed;
+    }
+
+    // Every reply from the server carries a Content-Length
+    char *end;
+    c->len = 0;
+    if (c->buf) {
+        c->buf[0] = '\0';
+    }
+    while (!c->buf || !(end = strstr(c->buf, "\r\n\r\n"))) {
+        if (!read_more(c)) {
+            goto failed;
+        }
+    }
+    size_t head_len = (size_t)(end + 4 - c->buf), length = 0;
+    int status = atoi(c->buf + 9);
+    for (char *line = strstr(c->buf, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            length = strtoul(line + 17, NULL, 10);
+        }
+    }
+    while (c->len < head_len + length) {
+        if (!read_more(c)) {
+            goto failed;
+        }
+    }
+    if (c->len > head_len + length) {
+        goto failed; // The server never sends unasked-for bytes
+    }
+    c->buf[head_len + length] = '\0';
+    *resp_body = c->buf + head_len;
+    return status;
+
+failed:
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+}
+
+static void record(struct client *c, enum endpoint ep, double start, int ok) {
+    struct samples *s = &c->samples[ep];
+    if (!ok) {
+        s->errors++;
+        return;
+    }
+    if (s->count == s->size) {
+        size_t size = s->size ? s->size * 2 : 4096;
+        unsigned int *us = realloc(s->us, size * sizeof(*us));
+        if (!us) {
+            s->errors++;
+            return;
+        }
+        s->us = us;
+        s->size = size;
+    }
+    s->us[s->count++] = (unsigned int)((now_sec() - start) * 1e6);
+}
+
+// Copies the string member key of the JSON object in body into out
+static int json_field(const char *body, const char *key, char *out, size_t size) {
+    json_t *root = json_loads(body, 0, NULL);
+    json_t *value = json_object_get(root, key);
+    int ok = 0;
+    if (json_is_string(value)) {
+        snprintf(out, size, "%s", json_string_value(value));
+        ok = 1;
+    } else if (json_is_integer(value)) {
+        snprintf(out, size, "%lld", (long long)json_integer_value(value));
+        ok = 1;
+    }
+    json_decref(root);
+    return ok;
+}
+
+static int login(struct client *c, struct user *u) {
+    char body[256];
+    const char *resp;
+    snprintf(body, sizeof(body), "{\"email\": \"%s\", \"password\": \"" PASSWORD "\"}", u->email);
+    return request(c, "POST", "/login", NULL, body, &resp) == 200 &&
+           json_field(resp, "token", u->token, sizeof(u->token));
+}
+
+// Registers and logs in user i, and gives them opt.cars cars
+static int seed_user(struct client *c, int i) {
+    struct user *u = &users[i];
+    char body[512], id[32];
+    const char *resp;
+
+    snprintf(u->email, sizeof(u->email), "bench%d@example.com", i);
+    snprintf(body, sizeof(body), "{\"first_name\": \"Bench\", \"last_name\": \"User%d\", \"email\": \"%s\", "
+                                 "\"organization\": \"DriveHub\", \"password\": \"" PASSWORD "\"}", i, u->email);
+    if (request(c, "POST", "/register", NULL, body, &resp) != 201 || !login(c, u) ||
+        request(c, "GET", "/profile", u->token, NULL, &resp) != 200 || !json_field(resp, "id", id, sizeof(id))) {
+        fprintf(stderr, "Failed to seed user %d\n", i);
+        return 0;
+    }
+    u->id = atoi(id);
+
+    if (opt.cars > 0) {
+        size_t size = (size_t)opt.cars * 128 + 16, len = 0;
+        char *cars = malloc(size);
+        if (!cars) {
+            return 0;
+        }
+        len += (size_t)snprintf(cars + len, size - len, "[");
+        for (int k = 0; k < opt.cars; k++) {
+            len += (size_t)snprintf(cars + len, size - len,
+                                    "%s{\"car_name\": \"Car %d\", \"year_of_manufacture\": \"%d\", \"car_value\": \"%d\"}",
+                                    k ? "," : "", k, 1990 + k % 35, 5000 + k * 100);
+        }
+        snprintf(cars + len, size - len, "]");
+        int status = request(c, "POST", "/cars/batch", u->token, cars, &resp);
+        free(cars);
+        if (status != 201) {
+            fprintf(stderr, "Failed to seed cars of user %d (%d)\n", i, status);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Seeds the users whose index is c->index modulo the connection count
+static void *seed_users(void *arg) {
+    struct client *c = arg;
+    c->seeded = 1;
+    for (int i = c->index; i < opt.users && c->seeded; i += opt.connections) {
+        c->seeded = seed_user(c, i);
+    }
+    return NULL;
+}
+
+// Sends opt.notifications notifications from each of this client's users
+// to the next user, once every user has an id
+static void *seed_notifications(void *arg) {
+    struct client *c = arg;
+    char body[256];
+    const char *resp;
+
+    for (int i = c->index; i < opt.users && c->seeded; i += opt.connections) {
+        for (int k = 0; k < opt.notifications && c->seeded; k++) {
+            snprintf(body, sizeof(body), "{\"receiver_id\": %d, \"message\": \"Seed message %d\"}",
+                     users[(i + 1) % opt.users].id, k);
+            c->seeded = request(c, "POST", "/notifications", users[i].token, body, &resp) == 201;
+        }
+    }
+    return NULL;
+}
+
+static enum endpoint pick_endpoint(struct client *c) {
+    int r = rand_r(&c->seed) % opt.total_weight;
+    for (int ep = 0; ep < EP_COUNT; ep++) {
+        if (r < opt.weights[ep]) {
+            return (enum endpoint)ep;
+        }
+        r -= opt.weights[ep];
+    }
+    return EP_PROFILE;
+}
+
+static volatile double run_until;
+
+// Runs the mix until run_until
+static void *run_mix(void *arg) {
+    struct client *c = arg;
+    char body[512];
+    const char *resp;
+    unsigned long registered = 0;
+
+    while (now_sec() < run_until) {
+        enum endpoint ep = pick_endpoint(c);
+        struct user *u = &users[rand_r(&c->seed) % opt.users];
+        double start = now_sec();
+        int status;
+
+        switch (ep) {
+        case EP_REGISTER:
+            snprintf(body, sizeof(body), "{\"first_name\": \"Load\", \"last_name\": \"User\", "
+                                         "\"email\": \"load%d-%lu@example.com\", \"organization\": \"DriveHub\", "
+                                         "\"password\": \"" PASSWORD "\"}", c->index, registered++);
+            status = request(c, "POST", "/register", NULL, body, &resp);
+            record(c, ep, start, status == 201);
+            break;
+        case EP_LOGIN:
+            snprintf(body, sizeof(body), "{\"email\": \"%s\", \"password\": \"" PASSWORD "\"}", u->email);
+            status = request(c, "POST", "/login", NULL, body, &resp);
+            record(c, ep, start, status == 200);
+            break;
+        case EP_PROFILE:
+            status = request(c, "GET", "/profile", u->token, NULL, &resp);
+            record(c, ep, start, status == 200);
+            break;
+        case EP_CARS:
+            status = request(c, "GET", "/cars?limit=50", u->token, NULL, &resp);
+            record(c, ep, start, status == 200);
+            break;
+        case EP_ADD_CAR:
+            status = request(c, "POST", "/cars", u->token,
+                             "{\"car_name\": \"Load car\", \"year_of_manufacture\": \"2020\", \"car_value\": \"9000\"}",
+                             &resp);
+            record(c, ep, start, status == 201);
+            break;
+        case EP_NOTIFICATIONS:
+            status = request(c, "GET", "/notifications?limit=50", u->token, NULL, &resp);
+            record(c, ep, start, status == 200);
+            break;
+        case EP_SEND:
+            snprintf(body, sizeof(body), "{\"receiver_id\": %d, \"message\": \"Load message\"}",
+                     users[rand_r(&c->seed) % opt.users].id);
+            status = request(c, "POST", "/notifications", u->token, body, &resp);
+            record(c, ep, start, status == 201);
+            break;
+        case EP_UNREAD:
+            status = request(c, "GET", "/notifications/unread_count", u->token, NULL, &resp);
+            record(c, ep, start, status == 200);
+            break;
+        default:
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int compare_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned int percentile(const struct samples *s, double p) {
+    size_t i = (size_t)(p * (double)s->count);
+    return s->count ? s->us[i < s->count ? i : s->count - 1] : 0;
+}
+
+// Merges every client's samples per endpoint and prints the JSON report
+static void report(struct client *clients, double elapsed) {
+    unsigned long total = 0, errors = 0;
+    struct samples merged[EP_COUNT] = {{0}};
+
+    for (int ep = 0; ep < EP_COUNT; ep++) {
+        struct samples *m = &merged[ep];
+        for (int i = 0; i < opt.connections; i++) {
+            m->size += clients[i].samples[ep].count;
+            m->errors += clients[i].samples[ep].errors;
+        }
+        m->us = malloc((m->size ? m->size : 1) * sizeof(*m->us));
+        for (int i = 0; i < opt.connections && m->us; i++) {
+            memcpy(m->us + m->count, clients[i].samples[ep].us, clients[i].samples[ep].count * sizeof(*m->us));
+            m->count += clients[i].samples[ep].count;
+        }
+        qsort(m->us, m->count, sizeof(*m->us), compare_uint);
+        total += m->count;
+        errors += m->errors;
+    }
+
+    printf("{\n  \"duration_s\": %.3f,\n  \"connections\": %d,\n  \"server_workers\": %d,\n"
+           "  \"users\": %d,\n  \"requests\": %lu,\n  \"errors\": %lu,\n  \"rps\": %.1f,\n  \"endpoints\": {",
+           elapsed, opt.connections, opt.workers, opt.users, total, errors, total / elapsed);
+    const char *sep = "";
+    for (int ep = 0; ep < EP_COUNT; ep++) {
+        struct samples *m = &merged[ep];
+        if (!opt.weights[ep]) {
+            free(m->us);
+            continue;
+        }
+        unsigned long long sum = 0;
+        for (size_t i = 0; i < m->count; i++) {
+            sum += m->us[i];
+        }
+        printf("%s\n    \"%s\": {\"requests\": %zu, \"errors\": %lu, \"rps\": %.1f, \"mean_us\": %.0f, "
+               "\"p50_us\": %u, \"p99_us\": %u, \"p999_us\": %u, \"max_us\": %u}",
+               sep, endpoints[ep].label, m->count, m->errors, m->count / elapsed,
+               m->count ? (double)sum / m->count : 0.0, percentile(m, 0.5), percentile(m, 0.99),
+               percentile(m, 0.999), m->count ? m->us[m->count - 1] : 0);
+        sep = ",";
+        free(m->us);
+    }
+    printf("\n  }\n}\n");
+}
+
+// Parses --mix name=weight,...; endpoints not named get weight 0
+static int parse_mix(const char *mix) {
+    char copy[512], *save = NULL;
+    snprintf(copy, sizeof(copy), "%s", mix);
+    memset(opt.weights, 0, sizeof(opt.weights));
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int ep;
+        for (ep = 0; ep < EP_COUNT; ep++) {
+            if (eq && strncmp(item, endpoints[ep].name, (size_t)(eq - item)) == 0 &&
+                endpoints[ep].name[eq - item] == '\0') {
+                break;
+            }
+        }
+        if (ep == EP_COUNT || atoi(eq + 1) < 0) {
+            fprintf(stderr, "Unknown --mix entry: %s\n", item);
+            return 0;
+        }
+        opt.weights[ep] = atoi(eq + 1);
+    }
+    return 1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+// Runs the server on a scratch database in a scratch directory (photos go
+// there too) and waits until it accepts connections
+static int start_server(void) {
+    char server[4096], port[16], workers[16];
+
+    if (!realpath(opt.server, server)) {
+        fprintf(stderr, "Cannot find server %s (run make first)\n", opt.server);
+        return 0;
+    }
+    snprintf(scratch, sizeof(scratch), "/tmp/drivehub-bench-XXXXXX");
+    if (!mkdtemp(scratch)) {
+        perror("mkdtemp");
+        return 0;
+    }
+    snprintf(port, sizeof(port), "%d", opt.port);
+    snprintf(workers, sizeof(workers), "%d", opt.workers);
+
+    server_pid = fork();
+    if (server_pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (server_pid == 0) {
+        int log;
+        if (chdir(scratch) != 0 || (log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            _exit(127);
+        }
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        execl(server, server, "--db", "bench.db", "--port", port, "--workers", workers, (char *)NULL);
+        _exit(127);
+    }
+
+    for (double deadline = now_sec() + 10; now_sec() < deadline; usleep(20000)) {
+        int fd = connect_server();
+        if (fd >= 0) {
+            close(fd);
+            return 1;
+        }
+        if (waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+            fprintf(stderr, "Server exited during startup; see %s/server.log\n", scratch);
+            server_pid = 0;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Server did not start listening on port %d\n", opt.port);
+    return 0;
+}
+
+static void stop_server(void) {
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+    }
+    if (scratch[0]) {
+        if (opt.keep) {
+            fprintf(stderr, "Scratch directory kept: %s\n", scratch);
+        } else {
+            nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+}
+
+// Runs fn on every client, one thread each, and waits for them
+static int run_clients(struct client *clients, void *(*fn)(void *)) {
+    for (int i = 0; i < opt.connections; i++) {
+        if (pthread_create(&clients[i].thread, NULL, fn, &clients[i]) != 0) {
+            fprintf(stderr, "Failed to start client thread\n");
+            run_until = 0;
+            for (int j = 0; j < i; j++) {
+                pthread_join(clients[j].thread, NULL);
+            }
+            return 0;
+        }
+    }
+    for (int i = 0; i < opt.connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int status = 1;
+    struct client *clients = NULL;
+
+    for (int ep = 0; ep < EP_COUNT; ep++) {
+        opt.weights[ep] = endpoints[ep].weight;
+    }
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--no-spawn") == 0) {
+            opt.spawn = 0;
+        } else if (strcmp(arg, "--keep") == 0) {
+            opt.keep = 1;
+        } else if (i + 1 == argc) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 1;
+        } else if (strcmp(arg, "--server") == 0) {
+            opt.server = argv[++i];
+        } else if (strcmp(arg, "--port") == 0) {
+            opt.port = atoi(argv[++i]);
+        } else if (strcmp(arg, "--workers") == 0) {
+            opt.workers = atoi(argv[++i]);
+        } else if (strcmp(arg, "--connections") == 0) {
+            opt.connections = atoi(argv[++i]);
+        } else if (strcmp(arg, "--duration") == 0) {
+            opt.duration = atoi(argv[++i]);
+        } else if (strcmp(arg, "--users") == 0) {
+            opt.users = atoi(argv[++i]);
+        } else if (strcmp(arg, "--cars") == 0) {
+            opt.cars = atoi(argv[++i]);
+        } else if (strcmp(arg, "--notifications") == 0) {
+            opt.notifications = atoi(argv[++i]);
+        } else if (strcmp(arg, "--mix") == 0) {
+            if (!parse_mix(argv[++i])) {
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 1;
+        }
+    }
+    for (int ep = 0; ep < EP_COUNT; ep++) {
+        opt.total_weight += opt.weights[ep];
+    }
+    if (opt.connections < 1 || opt.duration < 1 || opt.users < 1 || opt.total_weight <= 0) {
+        fprintf(stderr, "--connections, --duration, --users and the mix must be positive\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    users = calloc((size_t)opt.users, sizeof(*users));
+    clients = calloc((size_t)opt.connections, sizeof(*clients));
+    if (!users || !clients) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+    for (int i = 0; i < opt.connections; i++) {
+        clients[i].index = i;
+        clients[i].fd = -1;
+        clients[i].seed = (unsigned int)i * 2654435761u + 1;
+    }
+    if (opt.spawn && !start_server()) {
+        goto done;
+    }
+
+    double seed_start = now_sec();
+    if (!run_clients(clients, seed_users) || !run_clients(clients, seed_notifications)) {
+        goto done;
+    }
+    for (int i = 0; i < opt.connections; i++) {
+        if (!clients[i].seeded) {
+            fprintf(stderr, "Seeding failed\n");
+            goto done;
+        }
+    }
+    fprintf(stderr, "Seeded %d users with %d cars and %d notifications each in %.1f s\n",
+            opt.users, opt.cars, opt.notifications, now_sec() - seed_start);
+
+    double start = now_sec();
+    run_until = start + opt.duration;
+    if (!run_clients(clients, run_mix)) {
+        goto done;
+    }
+    report(clients, now_sec() - start);
+    status = 0;
+
+done:
+    stop_server();
+    for (int i = 0; clients && i < opt.connections; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+        }
+        free(clients[i].buf);
+        for (int ep = 0; ep < EP_COUNT; ep++) {
+            free(clients[i].samples[ep].us);
+        }
+    }
+    free(clients);
+    free(users);
+    return status;
+}
@@ -0,0 +1,148 @@
+//route_bench.c
+// Compares request dispatch cost of the old mg_match if/else chain and the
+// route trie. Only matching is timed; no handler runs.
+// Usage: bench/route_bench [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mongoose.h"
+#include "app.h"
+
+static void noop(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+}
+
+// Same shape as the table in routes.c
+static const struct route routes[] = {
+    {ROUTE_POST, "/register", noop, 0},
+    {ROUTE_POST, "/login", noop, 0},
+    {ROUTE_GET, "/profile", noop, ROUTE_AUTH},
+    {ROUTE_PUT, "/profile", noop, ROUTE_AUTH},
+    {ROUTE_DELETE, "/profile", noop, ROUTE_AUTH},
+    {ROUTE_PUT, "/password", noop, ROUTE_AUTH},
+    {ROUTE_PUT, "/email", noop, ROUTE_AUTH},
+    {ROUTE_GET, "/cars", noop, ROUTE_AUTH},
+    {ROUTE_POST, "/cars", noop, ROUTE_AUTH},
+    {ROUTE_DELETE, "/cars/{int}", noop, ROUTE_AUTH},
+    {ROUTE_GET, "/notifications", noop, ROUTE_AUTH},
+    {ROUTE_POST, "/notifications", noop, ROUTE_AUTH},
+    {ROUTE_POST, "/notifications/{int}/mark_read", noop, ROUTE_AUTH},
+};
+
+static const char *const requests[][2] = {
+    {"POST", "/login"},
+    {"GET", "/profile"},
+    {"GET", "/cars"},
+    {"DELETE", "/cars/42"},
+    {"GET", "/notifications"},
+    {"POST", "/notifications/123/mark_read"},
+    {"PUT", "/email"},
+    {"GET", "/missing"},
+};
+
+#define NUM_REQUESTS ((int)(sizeof(requests) / sizeof(requests[0])))
+
+// router.o needs this from routes.c; auth is not part of dispatch cost
+int get_user_id_from_token(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
+    return 1;
+}
+
+// Likewise for metrics.c; dispatch is timed elsewhere
+void metrics_request_begin(struct mg_connection *nc, const struct route *route) {
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The matching event_handler and the handle_* functions did before the
+// route table: URI globs first, then method globs, then parameter parsing.
+// Returns a route number, or 0 for 404/405. "*" stops at '/', so the
+// "/cars*" and "/notifications*" globs never let the parameterized routes
+// through; those requests still pay for every glob before the 404.
+static int legacy_dispatch(struct mg_str method, struct mg_str uri) {
+    if (mg_match(uri, mg_str("/profile"), NULL)) {
+        if (mg_match(method, mg_str("GET"), NULL)) return 3;
+        if (mg_match(method, mg_str("PUT"), NULL)) return 4;
+        if (mg_match(method, mg_str("DELETE"), NULL)) return 5;
+    } else if (mg_match(uri, mg_str("/register"), NULL)) {
+        if (mg_match(method, mg_str("POST"), NULL)) return 1;
+    } else if (mg_match(uri, mg_str("/login"), NULL)) {
+        if (mg_match(method, mg_str("POST"), NULL)) return 2;
+    } else if (mg_match(uri, mg_str("/password"), NULL)) {
+        if (mg_match(method, mg_str("PUT"), NULL)) return 6;
+    } else if (mg_match(uri, mg_str("/email"), NULL)) {
+        if (mg_match(method, mg_str("PUT"), NULL)) return 7;
+    } else if (mg_match(uri, mg_str("/cars*"), NULL)) {
+        if (mg_match(method, mg_str("GET"), NULL) && mg_match(uri, mg_str("/cars"), NULL)) return 8;
+        if (mg_match(method, mg_str("POST"), NULL) && mg_match(uri, mg_str("/cars"), NULL)) return 9;
+        if (mg_match(method, mg_str("DELETE"), NULL) && mg_match(uri, mg_str("/cars/#"), NULL)) {
+            int car_id = 0;
+            sscanf(uri.buf + 6, "%d", &car_id);
+            return car_id > 0 ? 10 : 0;
+        }
+    } else if (mg_match(uri, mg_str("/notifications*"), NULL)) {
+        if (mg_match(method, mg_str("OPTIONS"), NULL)) return 0;
+        if (mg_match(method, mg_str("POST"), NULL) && mg_match(uri, mg_str("/notifications"), NULL)) return 12;
+        if (mg_match(method, mg_str("GET"), NULL) && mg_match(uri, mg_str("/notifications"), NULL)) return 11;
+        struct mg_str id_str;
+        if (mg_match(method, mg_str("POST"), NULL) && mg_match(uri, mg_str("/notifications/#id/mark_read"), NULL) &&
+            mg_match(uri, mg_str("/notifications/#id/mark_read"), &id_str)) {
+            char id_buf[32];
+            if (id_str.len > 0 && id_str.len < sizeof(id_buf)) {
+                memcpy(id_buf, id_str.buf, id_str.len);
+                id_buf[id_str.len] = '\0';
+                return atoi(id_buf) > 0 ? 13 : 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int trie_dispatch(struct mg_str method, struct mg_str uri) {
+    struct request req;
+    req.params[0].num = 0;
+    int node = router_lookup(uri, &req);
+    const struct route *route = node < 0 ? NULL : router_route(node, method);
+    return route ? (int)(route - routes) + 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    struct mg_str methods[NUM_REQUESTS], uris[NUM_REQUESTS];
+    double start, elapsed;
+    long legacy_sum = 0, trie_sum = 0;
+
+    if (iterations <= 0 || !router_init(routes, (int)(sizeof(routes) / sizeof(routes[0])))) {
+        return 1;
+    }
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        methods[i] = mg_str(requests[i][0]);
+        uris[i] = mg_str(requests[i][1]);
+        int legacy = legacy_dispatch(methods[i], uris[i]);
+        if (legacy && legacy != trie_dispatch(methods[i], uris[i])) {
+            fprintf(stderr, "Dispatchers disagree on %s %s\n", requests[i][0], requests[i][1]);
+            return 1;
+        }
+    }
+
+    start = now_sec();
+    for (long i = 0; i < iterations; i++) {
+        int r = (int)(i % NUM_REQUESTS);
+        legacy_sum += legacy_dispatch(methods[r], uris[r]);
+    }
+    elapsed = now_sec() - start;
+    printf("%-16s %8.1f ns/request\n", "mg_match chain", elapsed * 1e9 / iterations);
+
+    start = now_sec();
+    for (long i = 0; i < iterations; i++) {
+        int r = (int)(i % NUM_REQUESTS);
+        trie_sum += trie_dispatch(methods[r], uris[r]);
+    }
+    elapsed = now_sec() - start;
+    printf("%-16s %8.1f ns/request\n", "route trie", elapsed * 1e9 / iterations);
+
+    return legacy_sum == 0 || trie_sum == 0;
+}
@@ -2,57 +2,515 @@
 #ifndef APP_H
 #define APP_H
 
+#include <pthread.h>
 #include <sqlite3.h>
 #include <sodium.h>
 #include "mongoose.h"
 
+struct app_context;
+
+// Fixed SQL statements, prepared once per database connection
+enum stmt_id {
+    STMT_REGISTER_USER,
+    STMT_LOGIN_USER,
+    STMT_GET_USER_PROFILE,
+    STMT_UPDATE_USER_PROFILE,
+    STMT_UPDATE_USER_PASSWORD,
+    STMT_REHASH_USER_PASSWORD,
+    STMT_UPDATE_USER_EMAIL,
+    STMT_DELETE_USER,
+    STMT_EMAIL_TAKEN,
+    STMT_GET_USER_EMAIL,
+    STMT_ADD_CAR,
+    STMT_GET_CARS,
+    STMT_DELETE_CAR,
+    STMT_CAR_EXISTS,
+    STMT_SET_CAR_PHOTO,
+    STMT_SEND_NOTIFICATION,
+    STMT_GET_NOTIFICATIONS,
+    STMT_GET_NOTIFICATIONS_SINCE,
+    STMT_MARK_NOTIFICATION_READ,
+    STMT_GET_UNREAD_COUNT,
+    STMT_MARK_NOTIFICATIONS_READ_UP_TO,
+    STMT_MARK_NOTIFICATIONS_READ_IDS,
+    STMT_DELETE_READ_NOTIFICATIONS,
+    STMT_COUNT
+};
+
+// Prepared statement registry, filled after migrate_db and finalized in close_db
+struct stmt_cache {
+    sqlite3_stmt *stmts[STMT_COUNT];
+    unsigned long prepares; // sqlite3_prepare_v2 calls
+    unsigned long hits;     // Statements handed out without re-preparing
+};
+
+// Work finished off the event loop and handed back to it. The loop calls fn
+// with the waiting connection, or with nc == NULL if it has gone away; fn
+// owns the completion and must free it.
+struct completion {
+    struct completion *next;
+    unsigned long conn_id; // Connection waiting for the result, 0 if none
+    void (*fn)(struct mg_connection *nc, struct completion *c, struct app_context *ctx);
+};
+
 // Application context to hold shared state
 struct app_context {
     sqlite3 *db;          // Database handle
     const char *jwt_secret; // JWT secret key
+    crypto_auth_hmacsha256_state jwt_key; // HMAC state keyed with jwt_secret
+    struct stmt_cache stmts; // Prepared statements for db
+    struct mg_mgr *mgr;   // Event loop serving this context
+    pthread_mutex_t done_lock; // Guards the completion queue below
+    struct completion *done_head, *done_tail;
+};
+
+// Streaming JSON writer appending to a Mongoose iobuf
+struct json_writer {
+    struct mg_iobuf *out;
+    unsigned long long nonempty; // Bit per nesting level: a value was written
+    int depth;
+    int after_key;               // Next value follows a key, no comma
+    int failed;                  // Out of memory; output is incomplete
+    size_t body_start;           // Start of the body in out (json_reply_*)
+    size_t length_at;            // Content-Length placeholder (json_reply_*)
+};
+
+// One page of a keyset-paginated list, newest first. after is the id the
+// previous page ended at (0 for the first page); next is set to the id to
+// pass as after for the following page, or 0 if this was the last one.
+struct page {
+    long long after;
+    int limit;
+    long long next;
+};
+
+// One notification row
+struct notification {
+    long long id;
+    int sender_id;
+    int receiver_id;
+    const char *message;
+    long long timestamp;
+    int is_read;
+};
+
+// Password hashing jobs run by the pwhash worker pool
+enum pwhash_op {
+    PWHASH_HASH,   // Hash password into hash
+    PWHASH_VERIFY  // Check password against the stored hash
+};
+
+struct pwhash_job {
+    struct completion base; // Must be first; also links the pool queue
+    enum pwhash_op op;
+    struct app_context *ctx; // Loop the result goes back to
+    const char *password;    // Owned by the submitter until completion
+    char hash[crypto_pwhash_STRBYTES];
+    int result;              // 1 if hashed / password matches
+    int rehash;              // Verified, but hash was made with other limits
+    int user_id;
+    void *data;              // Submitter state, e.g. the parsed request
+    char *replaces;          // Rehash only: the stored hash it replaces (owned)
+};
+
+// Small writes committed in batches by the writer thread
+enum write_op {
+    WRITE_REGISTER_USER,          // args: first_name, last_name, email, organization; text: password hash
+    WRITE_DELETE_USER,
+    WRITE_ADD_CAR,                // args: car_name, year, value, photo; text: photo link, set by the writer
+    WRITE_DELETE_CAR,             // target: car id
+    WRITE_SET_CAR_PHOTO,          // target: car id; text: photo url
+    WRITE_SEND_NOTIFICATION,      // target: receiver; args: message
+    WRITE_MARK_NOTIFICATION_READ, // target: notification id
+    WRITE_UPDATE_PROFILE,         // args: first_name, last_name, organization
+    WRITE_UPDATE_EMAIL,           // args: email
+    WRITE_UPDATE_PASSWORD,        // text: password hash
+    WRITE_REHASH_PASSWORD,        // text: new hash; owned: hash it replaces
+    WRITE_MARK_READ_UP_TO,        // up_to: last notification id
+    WRITE_MARK_READ_IDS,          // owned: JSON array of notification ids
+    WRITE_DELETE_READ_NOTIFICATIONS,
+    WRITE_ADD_CARS                // owned: struct car_batch; photos stored by the writer
+};
+
+struct write_job {
+    struct completion base; // Must be first; also links the writer queue
+    enum write_op op;
+    struct app_context *ctx; // Loop the result goes back to
+    int user_id;
+    int target;
+    const char *args[4];     // Owned by the submitter until completion
+    char text[512];          // Argument copied into the job
+    void *owned;             // Heap argument, freed with the job
+    long long up_to;
+    int result;              // What the database function returned
+    long long count;         // Rows changed, for bulk writes
+    long long rowid;         // Id of the row inserted, if any
+    long long timestamp;     // Time the row inserted was stamped with
+    unsigned long long queued_us; // Set by write_submit
+    void *data;              // Submitter state, e.g. the parsed request
+};
+
+// Valid rows of one POST /cars/batch, inserted by one write job. Strings
+// point into the parsed rows the job keeps in data.
+struct car_batch_row {
+    int index; // Position in the request
+    const char *car_name, *year_of_manufacture, *car_value, *photo;
+    char photo_link[80]; // Link to the photo data the writer stored
+    long long id; // Set once inserted, 0 if the insert failed, -1 if the photo is invalid
+};
+
+struct car_batch {
+    int total; // Rows in the request, valid or not
+    int count;
+    struct car_batch_row rows[];
+};
+
+// Power-of-two histogram: bucket i counts values below 2^i, the last bucket
+// everything larger
+#define HIST_BUCKETS 24
+
+struct histogram {
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+// Operations timed for /metrics besides requests and SQL statements
+enum metric_op {
+    METRIC_PWHASH_HASH,   // crypto_pwhash_str
+    METRIC_PWHASH_VERIFY, // crypto_pwhash_str_verify
+    METRIC_JWT_VERIFY,    // HS256 fast path, on token cache misses
+    METRIC_JWT_DECODE,    // libjwt fallback
+    METRIC_OP_COUNT
+};
+
+// Per-user resources with a version, for ETags on their GET replies
+enum resource {
+    RESOURCE_PROFILE,
+    RESOURCE_CARS,
+    RESOURCE_NOTIFICATIONS,
+    RESOURCE_COUNT
+};
+
+// Content codings a reply body may be sent in
+enum content_encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_COUNT
+};
+
+// Identifies one rendered GET reply: a user's resource, and for paged
+// lists the page (after and limit are 0 otherwise)
+struct response_key {
+    int user_id;
+    enum resource resource;
+    long long after;
+    int limit;
+};
+
+struct response_cache_stats {
+    unsigned long hits, misses, evictions;
+    unsigned long entries;
+    size_t bytes, max_bytes;
 };
 
-// Global application context
-extern struct app_context app_ctx;
+// nc->data holds the photo store's transfer state in its first
+// CONN_DATA_PHOTO bytes and the request timing metrics follow it; the
+// Makefile raises MG_DATA_SIZE to fit both
+#define CONN_DATA_PHOTO 32
+
+// Password hashing pool, for /metrics
+struct pwhash_stats {
+    int threads, queued;
+    size_t mem_budget;
+    size_t mem_in_use; // Memory of the hashes running now
+    size_t mem_peak;   // Most mem_in_use has been since the pool started
+};
+
+struct write_stats {
+    unsigned long commits, failed_commits;
+    struct histogram batch_size;  // Jobs per transaction
+    struct histogram commit_us;   // BEGIN to COMMIT of one batch
+    struct histogram latency_us;  // Submit to commit of one job
+};
 
 // Database initialization
-int init_db(sqlite3 *db);
-void close_db(sqlite3 *db);
+int open_db(struct app_context *ctx, const char *path);
+int migrate_db(sqlite3 *db);
+int rebuild_unread_counts(sqlite3 *db);
+int prepare_statements(struct app_context *ctx);
+sqlite3_stmt *get_statement(struct app_context *ctx, enum stmt_id id);
+const char *statement_name(int id);
+void close_db(struct app_context *ctx);
+
+// JSON output
+void jw_init(struct json_writer *w, struct mg_iobuf *out);
+void jw_begin_object(struct json_writer *w);
+void jw_end_object(struct json_writer *w);
+void jw_begin_array(struct json_writer *w);
+void jw_end_array(struct json_writer *w);
+void jw_key(struct json_writer *w, const char *key);
+void jw_string(struct json_writer *w, const char *s);
+void jw_int(struct json_writer *w, long long v);
+void jw_raw(struct json_writer *w, const char *json, size_t len);
+size_t json_reply_begin(struct mg_connection *nc, int status, const char *headers, struct json_writer *w);
+void json_reply_header(struct mg_connection *nc, struct json_writer *w, const char *header);
+int json_reply_end(struct mg_connection *nc, size_t start, struct json_writer *w);
+void json_reply_cancel(struct mg_connection *nc, size_t start);
+void json_reply_body(struct mg_connection *nc, const char *headers, const char *etag, enum content_encoding enc,
+                     const char *extra, size_t extra_len, const void *body, size_t len);
+
+// Response compression (zlib)
+void compress_init(int level, size_t min_bytes);
+const char *encoding_name(enum content_encoding enc);
+enum content_encoding compress_negotiate(struct mg_http_message *hm);
+int compress_worthwhile(size_t len);
+const void *compress_body(enum content_encoding enc, const void *in, size_t len, size_t *out_len);
+
+// Event loop completions
+void complete_on_loop(struct app_context *ctx, struct completion *c);
+void drain_completions(struct app_context *ctx);
+
+// Password hashing worker pool
+int pwhash_pool_start(int threads, size_t mem_budget);
+void pwhash_pool_stop(void);
+int pwhash_submit(struct pwhash_job *job);
+int pwhash_set_limits(unsigned long long opslimit, size_t memlimit);
+int pwhash_calibrate(unsigned int target_ms, size_t memlimit);
+int pwhash_needs_rehash(const char *hash);
+void pwhash_stats(struct pwhash_stats *out);
+
+// Group-commit writer thread
+int write_queue_start(const char *db_path, int batch_max, int flush_us);
+void write_queue_stop(void);
+int write_submit(struct write_job *job);
+void write_queue_stats(struct write_stats *out);
+
+// Logging: lines are queued per thread and written by a flusher thread.
+// log_debug compiles to nothing unless built with DEBUG_LOG (make DEBUG_LOG=1).
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+int log_start(int level, int json);
+void log_stop(void);
+int log_parse_level(const char *name);
+void log_set_level(int level);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#ifdef DEBUG_LOG
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) do { if (0) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+// Histograms
+void hist_record(struct histogram *h, unsigned long long value);
+unsigned long long hist_percentile(const struct histogram *h, double p);
+void hist_print(const char *name, const struct histogram *h);
+
+// Cache of verified tokens in front of verify_token
+int token_cache_lookup(const char *token, long now);
+void token_cache_insert(const char *token, int user_id, long exp);
+void token_cache_invalidate_user(int user_id);
+void token_cache_stats(unsigned long *hits, unsigned long *misses);
+
+// Which emails may belong to a user, ahead of the UNIQUE index
+int email_index_load(sqlite3 *db);
+void email_index_add(const char *email);
+void email_index_remove(const char *email);
+int email_index_maybe_taken(const char *email);
+
+// Per-user resource versions, bumped when a change commits
+void versions_init(void);
+unsigned long resource_version(int user_id, enum resource r);
+void resource_changed(int user_id, enum resource r);
+void resource_etag(int user_id, enum resource r, unsigned long version, char *etag, size_t size);
+
+// Rendered JSON replies for the per-user GETs, valid while their version is
+void response_cache_init(size_t max_bytes);
+int response_cache_send(struct mg_connection *nc, const struct response_key *key, unsigned long version,
+                        const char *headers, const char *etag, enum content_encoding enc);
+void response_cache_put(const struct response_key *key, unsigned long version, const char *headers,
+                        const char *body, size_t body_len);
+void response_cache_put_encoded(const struct response_key *key, unsigned long version, enum content_encoding enc,
+                                const void *body, size_t len);
+void response_cache_invalidate(int user_id, enum resource r);
+void response_cache_stats(struct response_cache_stats *out);
+
+// Allocation-free HS256 tokens in the shape login_user issues
+void jwt_hs256_key_init(crypto_auth_hmacsha256_state *key, const char *secret);
+int jwt_hs256_sign(const crypto_auth_hmacsha256_state *key, int user_id, long iat, long exp,
+                   char *out, size_t out_size);
+int jwt_hs256_verify(const crypto_auth_hmacsha256_state *key, const char *token,
+                     int *user_id, long *exp);
 
 // Utility functions
 void hash_password(const char *password, char *hashed_output);
 
 // User management functions
-int register_user(const char *first_name, const char *last_name, const char *email,
-                  const char *organization, const char *password);
-int login_user(const char *email, const char *password, char *token);
-int verify_token(const char *token);
-int get_user_profile(int user_id, char *profile);
-int update_user_profile(int user_id, const char *first_name, const char *last_name, const char *organization);
-int update_user_password(int user_id, const char *password);
-int update_user_email(int user_id, const char *email);
-int delete_user(int user_id);
-int get_user_id_from_token(struct mg_connection *nc, struct mg_http_message *hm);
+int register_user(struct app_context *ctx, const char *first_name, const char *last_name, const char *email,
+                  const char *organization, const char *password_hash);
+int login_user(struct app_context *ctx, const char *email, const char *password, char *token);
+int get_password_hash(struct app_context *ctx, const char *email, char *stored_hash);
+int email_taken(struct app_context *ctx, const char *email);
+int generate_token(struct app_context *ctx, int user_id, char *token);
+int verify_token(struct app_context *ctx, const char *token);
+int get_user_profile(struct app_context *ctx, int user_id, struct json_writer *out);
+int update_user_profile(struct app_context *ctx, int user_id, const char *first_name, const char *last_name, const char *organization);
+int update_user_password(struct app_context *ctx, int user_id, const char *password_hash);
+int rehash_user_password(struct app_context *ctx, int user_id, const char *old_hash, const char *new_hash);
+int update_user_email(struct app_context *ctx, int user_id, const char *email);
+int delete_user(struct app_context *ctx, int user_id);
+int get_user_id_from_token(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
 
 // Car management functions
-int add_car(int user_id, const char *car_name, const char *year_of_manufacture,
+int add_car(struct app_context *ctx, int user_id, const char *car_name, const char *year_of_manufacture,
             const char *car_value, const char *photo);
-int get_cars(int user_id, char *cars_json);
-int delete_car(int user_id, int car_id);
+int get_cars(struct app_context *ctx, int user_id, struct page *page, struct json_writer *out);
+int delete_car(struct app_context *ctx, int user_id, int car_id);
+int car_exists(struct app_context *ctx, int user_id, int car_id);
+int set_car_photo(struct app_context *ctx, int user_id, int car_id, const char *photo);
 
 // Notification management functions
-int send_notification(int sender_id, int receiver_id, const char *message);
-int get_notifications(int user_id, char *notifications_json);
-int mark_notification_read(int user_id, int notification_id);
+int send_notification(struct app_context *ctx, int sender_id, int receiver_id, const char *message,
+                      long long timestamp);
+int get_notifications(struct app_context *ctx, int user_id, struct page *page, struct json_writer *out);
+int mark_notification_read(struct app_context *ctx, int user_id, int notification_id);
+long long get_unread_count(struct app_context *ctx, int user_id);
+long long mark_notifications_read_up_to(struct app_context *ctx, int user_id, long long up_to);
+long long mark_notifications_read_ids(struct app_context *ctx, int user_id, const char *ids_json);
+long long delete_read_notifications(struct app_context *ctx, int user_id);
+int get_notifications_since(struct app_context *ctx, int user_id, long long after, int limit,
+                            void (*fn)(const struct notification *n, void *arg), void *arg);
+
+// Server-Sent Events push of new notifications. A stream is opened with
+// a bearer token, or with a single-use ticket where EventSource cannot
+// send one.
+#define SSE_TICKET_TTL_S 30
+#define SSE_TICKET_HEX 32
+int sse_subscribe(struct mg_connection *nc, struct app_context *ctx, int user_id, long long last_id);
+void sse_publish(const struct notification *n);
+void sse_read(struct mg_connection *nc);
+void sse_poll(struct mg_connection *nc);
+void sse_close(struct mg_connection *nc);
+unsigned long sse_subscribers(void);
+void sse_ticket_issue(int user_id, char *out);
+int sse_ticket_redeem(const char *hex);
+
+// Headers sent with every response; the frontend runs on its own origin
+#define CORS_HEADERS "Access-Control-Allow-Origin: http://localhost:5173\r\n"
+#define JSON_HEADERS "Content-Type: application/json\r\n" CORS_HEADERS
+
+// Sent with replies that carry an ETag: the browser revalidates every time,
+// and a 304 costs neither a query nor a body
+#define REVALIDATE_HEADERS "Cache-Control: private, no-cache\r\n"
+
+// Photos: stored once under the hex SHA-256 of their bytes, served forever
+#define PHOTO_HASH_HEX 64
+#define PHOTO_URL_PREFIX "/photos/"
+#define PHOTO_CACHE_HEADERS "Cache-Control: public, max-age=31536000, immutable\r\n" CORS_HEADERS
+
+// Called once an upload is stored, with the photo's hash
+typedef void (*photo_upload_fn)(struct mg_connection *nc, const char *hash, int user_id, int car_id);
+
+int photo_store_init(const char *dir, size_t max_bytes);
+int photo_hash_valid(const char *hash, size_t len);
+int photo_store_put(const void *data, size_t len, char *hash);
+int photo_store_inline(const char *photo, char *url, size_t url_size);
+void photo_serve(struct mg_connection *nc, struct mg_http_message *hm, struct mg_str hash);
+void photo_transfer_continue(struct mg_connection *nc);
+void photo_transfer_close(struct mg_connection *nc);
+int photo_upload_begin(struct mg_connection *nc, struct mg_http_message *hm, int user_id, int car_id,
+                       photo_upload_fn done);
+void photo_upload_continue(struct mg_connection *nc);
+
+// Routing
+#define ROUTE_MAX_PARAMS 4
+
+enum route_method {
+    ROUTE_GET,
+    ROUTE_POST,
+    ROUTE_PUT,
+    ROUTE_DELETE,
+    ROUTE_METHOD_COUNT
+};
+
+// A path parameter: the raw segment, and its value for {int} segments
+struct route_param {
+    struct mg_str str;
+    long long num;
+};
+
+// What a handler gets besides the connection and message
+struct request {
+    struct app_context *ctx;
+    int user_id; // Authenticated user; 0 on routes without auth
+    struct route_param params[ROUTE_MAX_PARAMS]; // In pattern order
+};
+
+typedef void (*route_fn)(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+
+// Route flags
+#define ROUTE_AUTH 1   // Require a valid bearer token; req->user_id is set
+#define ROUTE_STREAM 2 // Run from the headers, before the body is buffered
+
+// One entry of the route table. Path segments are literals, {int} or {str}.
+struct route {
+    enum route_method method;
+    const char *pattern;
+    route_fn fn;
+    int flags; // ROUTE_AUTH, ROUTE_STREAM
+};
+
+int router_init(const struct route *routes, int count);
+int router_lookup(struct mg_str uri, struct request *req);
+const struct route *router_route(int node, struct mg_str method);
+void router_dispatch(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
+void router_dispatch_headers(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
+
+// Metrics, recorded lock-free from any thread and served at /metrics
+int metrics_init(const struct route *routes, int count);
+void metrics_set_token(const char *token);
+unsigned long long metrics_now_us(void);
+void metrics_request_begin(struct mg_connection *nc, const struct route *route);
+void metrics_request_end(struct mg_connection *nc, size_t send_mark);
+void metrics_connection(int opened);
+void metrics_bytes(long in, long out);
+void metrics_op(enum metric_op op, unsigned long long us);
+void metrics_sql(int stmt, unsigned long long us);
+void handle_metrics(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
 
 // Route handlers
-void handle_register(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
-void handle_login(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
-void handle_profile(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
-void handle_password(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
-void handle_email(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
-void handle_options(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
-void handle_cars(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
-void handle_notifications(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx);
+int init_routes(int car_batch_max);
+void handle_register(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_login(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_get_profile(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_update_profile(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_delete_profile(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_update_password(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_update_email(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_get_cars(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_add_car(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_add_cars_batch(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_delete_car(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_upload_car_photo(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_get_photo(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_send_notification(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_get_notifications(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_notification_stream(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_notification_stream_ticket(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_mark_notifications_read(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_delete_read_notifications(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_get_unread_count(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
+void handle_mark_notification_read(struct mg_connection *nc, struct mg_http_message *hm, struct request *req);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,132 @@
+//compress.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "mongoose.h"
+#include "app.h"
+
+static const char *encoding_names[ENCODING_COUNT] = {"identity", "gzip", "deflate"};
+
+static struct {
+    int level;        // zlib level, 0 for no compression
+    size_t min_bytes; // Smaller bodies are sent as they are
+} settings;
+
+// One stream per thread and encoding, reset between bodies, so compressing
+// does not allocate zlib's window and tables every time
+static _Thread_local struct {
+    z_stream zs;
+    int ready;
+} streams[ENCODING_COUNT];
+
+// Sets the zlib level (1-9, 0 to never compress) and the smallest body
+// worth compressing
+void compress_init(int level, size_t min_bytes) {
+    settings.level = level < 0 ? 0 : level > 9 ? 9 : level;
+    settings.min_bytes = min_bytes;
+}
+
+const char *encoding_name(enum content_encoding enc) {
+    return encoding_names[enc];
+}
+
+// Returns 1 if the Accept-Encoding list accepts coding name: listed (or
+// "*" is) without q=0
+static int accepts(struct mg_str list, const char *name) {
+    size_t name_len = strlen(name), i = 0;
+    int star = 0;
+
+    while (i < list.len) {
+        // One item: a coding, then maybe ";q=..."
+        while (i < list.len && (list.buf[i] == ' ' || list.buf[i] == '\t' || list.buf[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < list.len && list.buf[i] != ',' && list.buf[i] != ';' && list.buf[i] != ' ' && list.buf[i] != '\t') {
+            i++;
+        }
+        size_t len = i - start;
+        int refused = 0;
+        while (i < list.len && list.buf[i] != ',') {
+            if ((list.buf[i] == 'q' || list.buf[i] == 'Q') && i + 1 < list.len && list.buf[i + 1] == '=') {
+                char q[8] = "";
+                size_t n = 0;
+                for (i += 2; i < list.len && n + 1 < sizeof(q) && list.buf[i] != ',' && list.buf[i] != ';'; i++) {
+                    q[n++] = list.buf[i];
+                }
+                refused = strtod(q, NULL) <= 0;
+                continue;
+            }
+            i++;
+        }
+
+        if (len == name_len && mg_ncasecmp(list.buf + start, name, len) == 0) {
+            return !refused;
+        }
+        if (len == 1 && list.buf[start] == '*') {
+            star = !refused;
+        }
+    }
+    return star;
+}
+
+// Picks the encoding for replies to hm: gzip if the client accepts it, else
+// deflate, else none. Bodies below the size threshold go out as they are
+// whatever this says; see compress_worthwhile.
+enum content_encoding compress_negotiate(struct mg_http_message *hm) {
+    struct mg_str *accept = hm ? mg_http_get_header(hm, "Accept-Encoding") : NULL;
+
+    if (!accept || settings.level == 0) {
+        return ENCODING_IDENTITY;
+    }
+    if (accepts(*accept, "gzip")) {
+        return ENCODING_GZIP;
+    }
+    if (accepts(*accept, "deflate")) {
+        return ENCODING_DEFLATE;
+    }
+    return ENCODING_IDENTITY;
+}
+
+// Whether a body of len bytes is ever compressed
+int compress_worthwhile(size_t len) {
+    return settings.level > 0 && len >= settings.min_bytes;
+}
+
+// Compresses len bytes at in with enc. Returns the compressed bytes, in a
+// buffer of this thread's that the next call reuses, or NULL on failure.
+const void *compress_body(enum content_encoding enc, const void *in, size_t len, size_t *out_len) {
+    static _Thread_local struct mg_iobuf out;
+    z_stream *zs = &streams[enc].zs;
+
+    if (enc == ENCODING_IDENTITY) {
+        return NULL;
+    }
+    if (!streams[enc].ready) {
+        // windowBits 15 + 16 writes a gzip wrapper, plain 15 a zlib one
+        // (what HTTP calls deflate)
+        if (deflateInit2(zs, settings.level, Z_DEFLATED, enc == ENCODING_GZIP ? 15 + 16 : 15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            log_error("Cannot set up %s compression", encoding_names[enc]);
+            return NULL;
+        }
+        streams[enc].ready = 1;
+    } else if (deflateReset(zs) != Z_OK) {
+        return NULL;
+    }
+
+    uLong bound = deflateBound(zs, (uLong)len);
+    if (out.size < bound && !mg_iobuf_resize(&out, bound)) {
+        return NULL;
+    }
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = (uInt)len;
+    zs->next_out = out.buf;
+    zs->avail_out = (uInt)out.size;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return NULL;
+    }
+    *out_len = zs->total_out;
+    return out.buf;
+}
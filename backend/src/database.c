@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <sqlite3.h>
 #include <time.h>
 #include <jwt.h>
@@ -10,161 +11,251 @@
 __attribute__((constructor))
 void init_sodium() {
     if (sodium_init() < 0) {
-        fprintf(stderr, "Error initializing libsodium\n");
+        log_error("Error initializing libsodium");
         exit(1);
     }
 }
 
-// Basic JSON escaping
-static char *json_escape(const char *str) {
-    if (!str) return strdup("");
-    size_t len = strlen(str);
-    char *out = malloc(len * 2 + 1);
-    if (!out) return strdup("");
-    size_t j = 0;
-    for (size_t i = 0; i < len; i++) {
-        if (str[i] == '"' || str[i] == '\\') {
-            out[j++] = '\\';
+// SQL for every statement in the registry, indexed by enum stmt_id
+static const char *const stmt_sql[STMT_COUNT] = {
+    [STMT_REGISTER_USER] = "INSERT INTO users (first_name, last_name, email, organization, password) VALUES (?, ?, ?, ?, ?);",
+    [STMT_LOGIN_USER] = "SELECT id, password FROM users WHERE email = ?;",
+    [STMT_GET_USER_PROFILE] = "SELECT first_name, last_name, email, organization FROM users WHERE id = ?;",
+    [STMT_UPDATE_USER_PROFILE] = "UPDATE users SET first_name = ?, last_name = ?, organization = ? WHERE id = ?;",
+    [STMT_UPDATE_USER_PASSWORD] = "UPDATE users SET password = ? WHERE id = ?;",
+    [STMT_REHASH_USER_PASSWORD] = "UPDATE users SET password = ? WHERE id = ? AND password = ?;",
+    [STMT_UPDATE_USER_EMAIL] = "UPDATE users SET email = ? WHERE id = ?;",
+    [STMT_DELETE_USER] = "DELETE FROM users WHERE id = ?;",
+    [STMT_EMAIL_TAKEN] = "SELECT 1 FROM users WHERE email = ?;",
+    [STMT_GET_USER_EMAIL] = "SELECT email FROM users WHERE id = ?;",
+    [STMT_ADD_CAR] = "INSERT INTO cars (user_id, car_name, year_of_manufacture, car_value, photo) VALUES (?, ?, ?, ?, ?);",
+    [STMT_GET_CARS] = "SELECT id, car_name, year_of_manufacture, car_value, photo FROM cars WHERE user_id = ? AND id < ? ORDER BY id DESC LIMIT ?;",
+    [STMT_DELETE_CAR] = "DELETE FROM cars WHERE id = ? AND user_id = ?;",
+    [STMT_CAR_EXISTS] = "SELECT 1 FROM cars WHERE id = ? AND user_id = ?;",
+    [STMT_SET_CAR_PHOTO] = "UPDATE cars SET photo = ? WHERE id = ? AND user_id = ?;",
+    [STMT_SEND_NOTIFICATION] = "INSERT INTO notifications (sender_id, receiver_id, message, timestamp, is_read) VALUES (?, ?, ?, ?, 0);",
+    [STMT_GET_NOTIFICATIONS] = "SELECT id, sender_id, receiver_id, message, timestamp, is_read FROM notifications WHERE receiver_id = ? AND id < ? ORDER BY id DESC LIMIT ?;",
+    [STMT_GET_NOTIFICATIONS_SINCE] = "SELECT id, sender_id, receiver_id, message, timestamp, is_read FROM notifications WHERE receiver_id = ? AND id > ? ORDER BY id LIMIT ?;",
+    [STMT_MARK_NOTIFICATION_READ] = "UPDATE notifications SET is_read = 1 WHERE id = ? AND receiver_id = ?;",
+    [STMT_GET_UNREAD_COUNT] = "SELECT count FROM unread_counts WHERE user_id = ?;",
+    [STMT_MARK_NOTIFICATIONS_READ_UP_TO] = "UPDATE notifications SET is_read = 1 WHERE receiver_id = ? AND id <= ? AND is_read = 0;",
+    [STMT_MARK_NOTIFICATIONS_READ_IDS] = "UPDATE notifications SET is_read = 1 WHERE receiver_id = ? AND is_read = 0 AND id IN (SELECT value FROM json_each(?));",
+    [STMT_DELETE_READ_NOTIFICATIONS] = "DELETE FROM notifications WHERE receiver_id = ? AND is_read = 1;",
+};
+
+// Statement names for /metrics, indexed by enum stmt_id
+static const char *const stmt_names[STMT_COUNT] = {
+    [STMT_REGISTER_USER] = "register_user",
+    [STMT_LOGIN_USER] = "login_user",
+    [STMT_GET_USER_PROFILE] = "get_user_profile",
+    [STMT_UPDATE_USER_PROFILE] = "update_user_profile",
+    [STMT_UPDATE_USER_PASSWORD] = "update_user_password",
+    [STMT_REHASH_USER_PASSWORD] = "rehash_user_password",
+    [STMT_UPDATE_USER_EMAIL] = "update_user_email",
+    [STMT_DELETE_USER] = "delete_user",
+    [STMT_EMAIL_TAKEN] = "email_taken",
+    [STMT_GET_USER_EMAIL] = "get_user_email",
+    [STMT_ADD_CAR] = "add_car",
+    [STMT_GET_CARS] = "get_cars",
+    [STMT_DELETE_CAR] = "delete_car",
+    [STMT_CAR_EXISTS] = "car_exists",
+    [STMT_SET_CAR_PHOTO] = "set_car_photo",
+    [STMT_SEND_NOTIFICATION] = "send_notification",
+    [STMT_GET_NOTIFICATIONS] = "get_notifications",
+    [STMT_GET_NOTIFICATIONS_SINCE] = "get_notifications_since",
+    [STMT_MARK_NOTIFICATION_READ] = "mark_notification_read",
+    [STMT_GET_UNREAD_COUNT] = "get_unread_count",
+    [STMT_MARK_NOTIFICATIONS_READ_UP_TO] = "mark_notifications_read_up_to",
+    [STMT_MARK_NOTIFICATIONS_READ_IDS] = "mark_notifications_read_ids",
+    [STMT_DELETE_READ_NOTIFICATIONS] = "delete_read_notifications",
+};
+
+const char *statement_name(int id) {
+    return id >= 0 && id < STMT_COUNT ? stmt_names[id] : "other";
+}
+
+// SQLite reports how long each statement ran, from its first step to its
+// reset, once it is reset; the time goes to /metrics under the statement's
+// registry entry
+static int profile_statement(unsigned type, void *arg, void *stmt, void *elapsed_ns) {
+    struct app_context *ctx = arg;
+    int id = STMT_COUNT;
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (ctx->stmts.stmts[i] == stmt) {
+            id = i;
+            break;
         }
-        out[j++] = str[i];
-    }
-    out[j] = '\0';
-    return out;
-}
-
-// Database initialization
-int init_db(sqlite3 *db) {
-    const char *user_sql = 
-        "CREATE TABLE IF NOT EXISTS users ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "first_name TEXT NOT NULL,"
-        "last_name TEXT NOT NULL,"
-        "email TEXT NOT NULL UNIQUE,"
-        "organization TEXT NOT NULL,"
-        "password TEXT NOT NULL"
-        ");";
-
-    const char *cars_sql = 
-        "CREATE TABLE IF NOT EXISTS cars ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "user_id INTEGER NOT NULL,"
-        "car_name TEXT NOT NULL,"
-        "year_of_manufacture TEXT NOT NULL,"
-        "car_value TEXT NOT NULL,"
-        "photo TEXT,"
-        "FOREIGN KEY (user_id) REFERENCES users(id)"
-        ");";
-
-    const char *notifications_sql = 
-        "CREATE TABLE IF NOT EXISTS notifications ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "sender_id INTEGER NOT NULL,"
-        "receiver_id INTEGER NOT NULL,"
-        "message TEXT NOT NULL,"
-        "timestamp INTEGER NOT NULL,"
-        "is_read INTEGER NOT NULL DEFAULT 0,"
-        "FOREIGN KEY (sender_id) REFERENCES users(id),"
-        "FOREIGN KEY (receiver_id) REFERENCES users(id)"
-        ");";
-
-    if (sqlite3_exec(db, user_sql, 0, 0, 0) != SQLITE_OK ||
-        sqlite3_exec(db, cars_sql, 0, 0, 0) != SQLITE_OK ||
-        sqlite3_exec(db, notifications_sql, 0, 0, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to create tables: %s\n", sqlite3_errmsg(db));
+    }
+    metrics_sql(id, (unsigned long long)*(sqlite3_int64 *)elapsed_ns / 1000);
+    return 0;
+}
+
+// Opens a connection for one event loop. Every loop has its own connection
+// to the same file; WAL lets readers run alongside a writer, and writers
+// wait for each other instead of failing with SQLITE_BUSY.
+int open_db(struct app_context *ctx, const char *path) {
+    if (sqlite3_open_v2(path, &ctx->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        log_error("Cannot open database: %s", sqlite3_errmsg(ctx->db));
         return 0;
     }
+    sqlite3_busy_timeout(ctx->db, 5000);
+    if (sqlite3_exec(ctx->db, "PRAGMA journal_mode=WAL;", 0, 0, 0) != SQLITE_OK) {
+        log_error("Failed to enable WAL: %s", sqlite3_errmsg(ctx->db));
+        return 0;
+    }
+    return 1;
+}
 
+// Prepares every statement in the registry once, after migrate_db, and
+// starts timing them
+int prepare_statements(struct app_context *ctx) {
+    sqlite3_trace_v2(ctx->db, SQLITE_TRACE_PROFILE, profile_statement, ctx);
+    for (int i = 0; i < STMT_COUNT; i++) {
+        ctx->stmts.prepares++;
+        if (sqlite3_prepare_v2(ctx->db, stmt_sql[i], -1, &ctx->stmts.stmts[i], 0) != SQLITE_OK) {
+            log_error("Failed to prepare statement: %s", sqlite3_errmsg(ctx->db));
+            return 0;
+        }
+    }
     return 1;
 }
 
-// Closes the database
-void close_db(sqlite3 *db) {
-    sqlite3_close(db);
+// Hands out a cached statement, reset and with its bindings cleared.
+// Callers must sqlite3_reset() it once done so it releases its locks.
+sqlite3_stmt *get_statement(struct app_context *ctx, enum stmt_id id) {
+    sqlite3_stmt *stmt = ctx->stmts.stmts[id];
+
+    if (!stmt) {
+        // Not prepared yet (or preparing failed at startup); try again now
+        ctx->stmts.prepares++;
+        if (sqlite3_prepare_v2(ctx->db, stmt_sql[id], -1, &stmt, 0) != SQLITE_OK) {
+            log_error("Failed to prepare statement: %s", sqlite3_errmsg(ctx->db));
+            return NULL;
+        }
+        ctx->stmts.stmts[id] = stmt;
+        return stmt;
+    }
+
+    ctx->stmts.hits++;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return stmt;
 }
 
-// Hash password using libsodium
-void hash_password(const char *password, char *hashed_output) {
-    if (crypto_pwhash_str(hashed_output, password, strlen(password),
-                          crypto_pwhash_OPSLIMIT_INTERACTIVE,
-                          crypto_pwhash_MEMLIMIT_INTERACTIVE) != 0) {
-        fprintf(stderr, "Error hashing password\n");
-        strcpy(hashed_output, "");
+// Finalizes the statement registry and closes the database
+void close_db(struct app_context *ctx) {
+    log_info("Statement cache: %lu prepares, %lu hits", ctx->stmts.prepares, ctx->stmts.hits);
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(ctx->stmts.stmts[i]);
+        ctx->stmts.stmts[i] = NULL;
     }
+    sqlite3_close(ctx->db);
 }
 
-// Registers a new user
-int register_user(const char *first_name, const char *last_name, const char *email, const char *organization, const char *password) {
+// Registers a new user; password_hash comes from hash_password
+int register_user(struct app_context *ctx, const char *first_name, const char *last_name, const char *email, const char *organization, const char *password_hash) {
     sqlite3_stmt *stmt;
-    const char *sql = "INSERT INTO users (first_name, last_name, email, organization, password) VALUES (?, ?, ?, ?, ?);";
     int rc;
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_REGISTER_USER);
+    if (!stmt) {
         return 0;
     }
 
-    char hashed_password[crypto_pwhash_STRBYTES];
-    hash_password(password, hashed_password);
-    if (strlen(hashed_password) == 0) {
-        sqlite3_finalize(stmt);
-        return 0;
-    }
     sqlite3_bind_text(stmt, 1, first_name, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, last_name, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 3, email, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 4, organization, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 5, hashed_password, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, password_hash, -1, SQLITE_STATIC);
 
     rc = sqlite3_step(stmt);
+    if (rc == SQLITE_CONSTRAINT) {
+        sqlite3_reset(stmt);
+        return -1; // UNIQUE constraint violation: the email is taken
+    }
     if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
-        return rc == SQLITE_CONSTRAINT ? -1 : 0; // -1 for UNIQUE constraint violation
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
+        return 0;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    email_index_add(email);
     return 1;
 }
 
-// Authenticates a user and generates a JWT
-int login_user(const char *email, const char *password, char *token) {
+// Returns 1 if a user has email, 0 if none does (or the lookup failed; the
+// INSERT is checked regardless)
+int email_taken(struct app_context *ctx, const char *email) {
+    sqlite3_stmt *stmt;
+    int taken;
+
+    if (!email_index_maybe_taken(email)) {
+        return 0;
+    }
+    stmt = get_statement(ctx, STMT_EMAIL_TAKEN);
+    if (!stmt) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, email, -1, SQLITE_STATIC);
+    taken = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_reset(stmt);
+    return taken;
+}
+
+// Copies user_id's email into email (size bytes); returns 0, leaving email
+// empty, if there is none or it does not fit
+static int get_user_email(struct app_context *ctx, int user_id, char *email, size_t size) {
+    sqlite3_stmt *stmt = get_statement(ctx, STMT_GET_USER_EMAIL);
+    int found = 0;
+
+    if (!stmt) {
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, user_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        found = snprintf(email, size, "%s", (const char *)sqlite3_column_text(stmt, 0)) < (int)size;
+    }
+    sqlite3_reset(stmt);
+    if (!found) {
+        email[0] = '\0';
+    }
+    return found;
+}
+
+// Looks up the stored password hash for email; returns the user_id or 0
+int get_password_hash(struct app_context *ctx, const char *email, char *stored_hash) {
     sqlite3_stmt *stmt;
-    const char *sql = "SELECT id, password FROM users WHERE email = ?;";
     int user_id = 0;
-    char stored_password[crypto_pwhash_STRBYTES];
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_LOGIN_USER);
+    if (!stmt) {
         return 0;
     }
 
     sqlite3_bind_text(stmt, 1, email, -1, SQLITE_STATIC);
     if (sqlite3_step(stmt) == SQLITE_ROW) {
         user_id = sqlite3_column_int(stmt, 0);
-        strncpy(stored_password, (const char *)sqlite3_column_text(stmt, 1), sizeof(stored_password) - 1);
-        stored_password[sizeof(stored_password) - 1] = '\0';
+        strncpy(stored_hash, (const char *)sqlite3_column_text(stmt, 1), crypto_pwhash_STRBYTES - 1);
+        stored_hash[crypto_pwhash_STRBYTES - 1] = '\0';
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     if (user_id <= 0) {
-        fprintf(stderr, "User not found for email: %s\n", email);
+        log_debug("No user with the login email");
         return 0; // User not found
     }
+    return user_id;
+}
 
-    // Verify password with libsodium
-    if (crypto_pwhash_str_verify(stored_password, password, strlen(password)) != 0) {
-        fprintf(stderr, "Invalid password for user_id: %d\n", user_id);
-        return 0; // Invalid password
-    }
-
-    // Generate JWT
+// Generates a token with libjwt; only used if the fast path cannot
+static int generate_token_libjwt(struct app_context *ctx, int user_id, time_t now, char *token) {
     jwt_t *jwt = NULL;
     if (jwt_new(&jwt) != 0) {
-        fprintf(stderr, "Error creating JWT\n");
+        log_error("Error creating JWT");
         return 0;
     }
 
-    time_t now = time(NULL);
     char user_id_str[16];
     snprintf(user_id_str, sizeof(user_id_str), "%d", user_id);
 
@@ -172,11 +263,11 @@ int login_user(const char *email, const char *password, char *token) {
     jwt_add_grant_int(jwt, "exp", now + 3600); // 1 hour expiration
     jwt_add_grant(jwt, "sub", user_id_str);
 
-    jwt_set_alg(jwt, JWT_ALG_HS256, (unsigned char *)app_ctx.jwt_secret, strlen(app_ctx.jwt_secret));
+    jwt_set_alg(jwt, JWT_ALG_HS256, (unsigned char *)ctx->jwt_secret, strlen(ctx->jwt_secret));
 
     char *jwt_str = jwt_encode_str(jwt);
     if (!jwt_str) {
-        fprintf(stderr, "Error encoding JWT\n");
+        log_error("Error encoding JWT");
         jwt_free(jwt);
         return 0;
     }
@@ -188,75 +279,133 @@ int login_user(const char *email, const char *password, char *token) {
     return 1;
 }
 
-// Verifies a JWT and returns user_id
-int verify_token(const char *token) {
+// Generates a JWT for user_id into token (512 bytes)
+int generate_token(struct app_context *ctx, int user_id, char *token) {
+    time_t now = time(NULL);
+
+    if (jwt_hs256_sign(&ctx->jwt_key, user_id, now, now + 3600, token, 512)) { // 1 hour expiration
+        return 1;
+    }
+    return generate_token_libjwt(ctx, user_id, now, token);
+}
+
+// Authenticates a user and generates a JWT. This verifies inline; the HTTP
+// handlers run the verify step on the pwhash pool instead.
+int login_user(struct app_context *ctx, const char *email, const char *password, char *token) {
+    char stored_password[crypto_pwhash_STRBYTES];
+
+    int user_id = get_password_hash(ctx, email, stored_password);
+    if (user_id <= 0) {
+        return 0; // User not found
+    }
+
+    // Verify password with libsodium
+    if (crypto_pwhash_str_verify(stored_password, password, strlen(password)) != 0) {
+        log_info("Invalid password for user_id: %d", user_id);
+        return 0; // Invalid password
+    }
+
+    return generate_token(ctx, user_id, token);
+}
+
+// Decodes a token with libjwt, for tokens the fast path does not recognize
+static int decode_token_libjwt(struct app_context *ctx, const char *token, int *user_id, long *exp) {
     jwt_t *jwt = NULL;
 
-    if (jwt_decode(&jwt, token, (unsigned char *)app_ctx.jwt_secret, strlen(app_ctx.jwt_secret)) != 0) {
-        fprintf(stderr, "Error decoding JWT\n");
+    if (jwt_decode(&jwt, token, (unsigned char *)ctx->jwt_secret, strlen(ctx->jwt_secret)) != 0) {
+        log_debug("Error decoding JWT");
         return 0;
     }
 
+    *exp = jwt_get_grant_int(jwt, "exp");
+    const char *sub = jwt_get_grant(jwt, "sub");
+    *user_id = sub ? atoi(sub) : 0;
+
+    jwt_free(jwt);
+    return 1;
+}
+
+// Verifies a JWT and returns user_id. Tokens seen before are answered from
+// the token cache without decoding them again.
+int verify_token(struct app_context *ctx, const char *token) {
+    int user_id = 0;
+    long exp = 0;
+
+    int cached_user_id = token_cache_lookup(token, (long)time(NULL));
+    if (cached_user_id > 0) {
+        return cached_user_id;
+    }
+
+    unsigned long long start = metrics_now_us();
+    int rc = jwt_hs256_verify(&ctx->jwt_key, token, &user_id, &exp);
+    metrics_op(METRIC_JWT_VERIFY, metrics_now_us() - start);
+    if (rc == 0) {
+        log_debug("Invalid JWT signature");
+        return 0;
+    }
+    if (rc < 0) {
+        start = metrics_now_us();
+        int decoded = decode_token_libjwt(ctx, token, &user_id, &exp);
+        metrics_op(METRIC_JWT_DECODE, metrics_now_us() - start);
+        if (!decoded) {
+            return 0;
+        }
+    }
+
     time_t now = time(NULL);
-    long exp = jwt_get_grant_int(jwt, "exp");
     if (exp < now) {
-        fprintf(stderr, "Token expired at %ld, current time: %ld\n", exp, now);
-        jwt_free(jwt);
+        log_debug("Token expired at %ld, current time: %ld", exp, now);
         return 0;
     }
 
-    const char *sub = jwt_get_grant(jwt, "sub");
-    int user_id = sub ? atoi(sub) : 0;
-
-    jwt_free(jwt);
     if (user_id <= 0) {
-        fprintf(stderr, "Invalid user_id in token\n");
+        log_debug("Invalid user_id in token");
         return 0;
     }
-    fprintf(stderr, "Token verified, user_id: %d\n", user_id);
+    token_cache_insert(token, user_id, exp);
+    log_debug("Token verified, user_id: %d", user_id);
     return user_id;
 }
 
 // Retrieves user profile
-int get_user_profile(int user_id, char *profile) {
+int get_user_profile(struct app_context *ctx, int user_id, struct json_writer *out) {
     sqlite3_stmt *stmt;
-    const char *sql = "SELECT first_name, last_name, email, organization FROM users WHERE id = ?;";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_GET_USER_PROFILE);
+    if (!stmt) {
         return 0;
     }
 
     sqlite3_bind_int(stmt, 1, user_id);
     if (sqlite3_step(stmt) == SQLITE_ROW) {
-        char *first_name = json_escape((const char *)sqlite3_column_text(stmt, 0));
-        char *last_name = json_escape((const char *)sqlite3_column_text(stmt, 1));
-        char *email = json_escape((const char *)sqlite3_column_text(stmt, 2));
-        char *organization = json_escape((const char *)sqlite3_column_text(stmt, 3));
-        snprintf(profile, 2048,
-                 "{\"id\": %d, \"first_name\": \"%s\", \"last_name\": \"%s\", \"email\": \"%s\", \"organization\": \"%s\"}",
-                 user_id, first_name, last_name, email, organization);
-        free(first_name);
-        free(last_name);
-        free(email);
-        free(organization);
-        sqlite3_finalize(stmt);
-        fprintf(stderr, "Profile fetched for user_id: %d\n", user_id);
-        return 1;
-    }
-
-    fprintf(stderr, "User not found for user_id: %d\n", user_id);
-    sqlite3_finalize(stmt);
+        jw_begin_object(out);
+        jw_key(out, "id");
+        jw_int(out, user_id);
+        jw_key(out, "first_name");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 0));
+        jw_key(out, "last_name");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 1));
+        jw_key(out, "email");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 2));
+        jw_key(out, "organization");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 3));
+        jw_end_object(out);
+        sqlite3_reset(stmt);
+        log_debug("Profile fetched for user_id: %d", user_id);
+        return !out->failed;
+    }
+
+    log_debug("User not found for user_id: %d", user_id);
+    sqlite3_reset(stmt);
     return 0;
 }
 
 // Updates user profile
-int update_user_profile(int user_id, const char *first_name, const char *last_name, const char *organization) {
+int update_user_profile(struct app_context *ctx, int user_id, const char *first_name, const char *last_name, const char *organization) {
     sqlite3_stmt *stmt;
-    const char *sql = "UPDATE users SET first_name = ?, last_name = ?, organization = ? WHERE id = ?;";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_UPDATE_USER_PROFILE);
+    if (!stmt) {
         return 0;
     }
 
@@ -266,52 +415,74 @@ int update_user_profile(int user_id, const char *first_name, const char *last_na
     sqlite3_bind_int(stmt, 4, user_id);
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
         return 0;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return 1;
 }
 
-// Updates user password
-int update_user_password(int user_id, const char *password) {
+// Updates user password; password_hash comes from hash_password
+int update_user_password(struct app_context *ctx, int user_id, const char *password_hash) {
     sqlite3_stmt *stmt;
-    const char *sql = "UPDATE users SET password = ? WHERE id = ?;";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_UPDATE_USER_PASSWORD);
+    if (!stmt) {
         return 0;
     }
 
-    char hashed_password[crypto_pwhash_STRBYTES];
-    hash_password(password, hashed_password);
-    if (strlen(hashed_password) == 0) {
-        sqlite3_finalize(stmt);
-        return 0;
-    }
-    sqlite3_bind_text(stmt, 1, hashed_password, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 1, password_hash, -1, SQLITE_STATIC);
     sqlite3_bind_int(stmt, 2, user_id);
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
         return 0;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    token_cache_invalidate_user(user_id);
     return 1;
 }
 
+// Swaps user_id's stored hash old_hash for new_hash, a hash of the same
+// password at the current limits. Returns 1 if swapped, 0 if the password
+// changed in the meantime (or the update failed). Tokens stay valid: the
+// password has not changed.
+int rehash_user_password(struct app_context *ctx, int user_id, const char *old_hash, const char *new_hash) {
+    sqlite3_stmt *stmt;
+    int changed;
+
+    stmt = get_statement(ctx, STMT_REHASH_USER_PASSWORD);
+    if (!stmt) {
+        return 0;
+    }
+
+    sqlite3_bind_text(stmt, 1, new_hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, user_id);
+    sqlite3_bind_text(stmt, 3, old_hash, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
+        return 0;
+    }
+    changed = sqlite3_changes(ctx->db) > 0;
+    sqlite3_reset(stmt);
+    return changed;
+}
+
 // Updates user email
-int update_user_email(int user_id, const char *email) {
+int update_user_email(struct app_context *ctx, int user_id, const char *email) {
     sqlite3_stmt *stmt;
-    const char *sql = "UPDATE users SET email = ? WHERE id = ?;";
+    char old_email[256] = "";
     int rc;
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    get_user_email(ctx, user_id, old_email, sizeof(old_email));
+    stmt = get_statement(ctx, STMT_UPDATE_USER_EMAIL);
+    if (!stmt) {
         return 0;
     }
 
@@ -319,45 +490,53 @@ int update_user_email(int user_id, const char *email) {
     sqlite3_bind_int(stmt, 2, user_id);
 
     rc = sqlite3_step(stmt);
+    if (rc == SQLITE_CONSTRAINT) {
+        sqlite3_reset(stmt);
+        return -1; // UNIQUE constraint violation: the email is taken
+    }
     if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
-        return rc == SQLITE_CONSTRAINT ? -1 : 0; // -1 for UNIQUE constraint violation
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
+        return 0;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    email_index_add(email);
+    email_index_remove(old_email[0] ? old_email : NULL);
     return 1;
 }
 
 // Deletes a user
-int delete_user(int user_id) {
+int delete_user(struct app_context *ctx, int user_id) {
     sqlite3_stmt *stmt;
-    const char *sql = "DELETE FROM users WHERE id = ?;";
+    char email[256] = "";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    get_user_email(ctx, user_id, email, sizeof(email));
+    stmt = get_statement(ctx, STMT_DELETE_USER);
+    if (!stmt) {
         return 0;
     }
 
     sqlite3_bind_int(stmt, 1, user_id);
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
         return 0;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    token_cache_invalidate_user(user_id);
+    email_index_remove(email[0] ? email : NULL);
     return 1;
 }
 
 // Adds a car
-int add_car(int user_id, const char *car_name, const char *year_of_manufacture, const char *car_value, const char *photo) {
+int add_car(struct app_context *ctx, int user_id, const char *car_name, const char *year_of_manufacture, const char *car_value, const char *photo) {
     sqlite3_stmt *stmt;
-    const char *sql = "INSERT INTO cars (user_id, car_name, year_of_manufacture, car_value, photo) VALUES (?, ?, ?, ?, ?);";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_ADD_CAR);
+    if (!stmt) {
         return 0;
     }
 
@@ -368,58 +547,72 @@ int add_car(int user_id, const char *car_name, const char *year_of_manufacture,
     sqlite3_bind_text(stmt, 5, photo, -1, SQLITE_STATIC);
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
         return 0;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return 1;
 }
 
+// Binds a page's "id < ?" and "LIMIT ?" parameters, starting at index i.
+// One row more than the limit is fetched to find out whether a next page
+// exists.
+static void bind_page(sqlite3_stmt *stmt, int i, const struct page *page) {
+    sqlite3_bind_int64(stmt, i, page->after > 0 ? page->after : INT64_MAX);
+    sqlite3_bind_int(stmt, i + 1, page->limit + 1);
+}
+
 // Retrieves cars for a user
-int get_cars(int user_id, char *cars_json) {
+int get_cars(struct app_context *ctx, int user_id, struct page *page, struct json_writer *out) {
     sqlite3_stmt *stmt;
-    const char *sql = "SELECT id, car_name, year_of_manufacture, car_value, photo FROM cars WHERE user_id = ?;";
-    char temp[8192] = "[";
-    int first = 1;
+    sqlite3_int64 last_id = 0;
+    int rc, rows = 0;
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_GET_CARS);
+    if (!stmt) {
         return 0;
     }
 
     sqlite3_bind_int(stmt, 1, user_id);
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        char *car_name = json_escape((const char *)sqlite3_column_text(stmt, 1));
-        char *year = json_escape((const char *)sqlite3_column_text(stmt, 2));
-        char *value = json_escape((const char *)sqlite3_column_text(stmt, 3));
-        char *photo = json_escape((const char *)sqlite3_column_text(stmt, 4));
-        char entry[1024];
-        snprintf(entry, sizeof(entry),
-                 "%s{\"id\": %d, \"car_name\": \"%s\", \"year_of_manufacture\": \"%s\", \"car_value\": \"%s\", \"photo\": \"%s\"}",
-                 first ? "" : ",", sqlite3_column_int(stmt, 0), car_name, year, value, photo ? photo : "");
-        free(car_name);
-        free(year);
-        free(value);
-        free(photo);
-        strncat(temp, entry, sizeof(temp) - strlen(temp) - 1);
-        first = 0;
-    }
-
-    sqlite3_finalize(stmt);
-    strncat(temp, "]", sizeof(temp) - strlen(temp) - 1);
-    strncpy(cars_json, temp, 8192);
-    return 1;
+    bind_page(stmt, 2, page);
+    jw_begin_array(out);
+    page->next = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (rows++ == page->limit) {
+            page->next = last_id; // The extra row: there is a next page
+            break;
+        }
+        last_id = sqlite3_column_int64(stmt, 0);
+        jw_begin_object(out);
+        jw_key(out, "id");
+        jw_int(out, sqlite3_column_int(stmt, 0));
+        jw_key(out, "car_name");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 1));
+        jw_key(out, "year_of_manufacture");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 2));
+        jw_key(out, "car_value");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 3));
+        jw_key(out, "photo");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 4));
+        jw_end_object(out);
+    }
+    jw_end_array(out);
+
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+    }
+    sqlite3_reset(stmt);
+    return (rc == SQLITE_DONE || rc == SQLITE_ROW) && !out->failed;
 }
 
 // Deletes a car
-int delete_car(int user_id, int car_id) {
+int delete_car(struct app_context *ctx, int user_id, int car_id) {
     sqlite3_stmt *stmt;
-    const char *sql = "DELETE FROM cars WHERE id = ? AND user_id = ?;";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_DELETE_CAR);
+    if (!stmt) {
         return 0;
     }
 
@@ -427,84 +620,171 @@ int delete_car(int user_id, int car_id) {
     sqlite3_bind_int(stmt, 2, user_id);
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
+        return 0;
+    }
+
+    int changes = sqlite3_changes(ctx->db);
+    sqlite3_reset(stmt);
+    return changes > 0;
+}
+
+// Checks that a car exists and belongs to user_id
+int car_exists(struct app_context *ctx, int user_id, int car_id) {
+    sqlite3_stmt *stmt;
+
+    stmt = get_statement(ctx, STMT_CAR_EXISTS);
+    if (!stmt) {
+        return 0;
+    }
+
+    sqlite3_bind_int(stmt, 1, car_id);
+    sqlite3_bind_int(stmt, 2, user_id);
+
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+    }
+    sqlite3_reset(stmt);
+    return rc == SQLITE_ROW;
+}
+
+// Replaces the photo link of a car
+int set_car_photo(struct app_context *ctx, int user_id, int car_id, const char *photo) {
+    sqlite3_stmt *stmt;
+
+    stmt = get_statement(ctx, STMT_SET_CAR_PHOTO);
+    if (!stmt) {
+        return 0;
+    }
+
+    sqlite3_bind_text(stmt, 1, photo, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, car_id);
+    sqlite3_bind_int(stmt, 3, user_id);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
         return 0;
     }
 
-    int changes = sqlite3_changes(app_ctx.db);
-    sqlite3_finalize(stmt);
+    int changes = sqlite3_changes(ctx->db);
+    sqlite3_reset(stmt);
     return changes > 0;
 }
 
-// Sends a notification
-int send_notification(int sender_id, int receiver_id, const char *message) {
+// Sends a notification stamped with timestamp (seconds since the epoch)
+int send_notification(struct app_context *ctx, int sender_id, int receiver_id, const char *message,
+                      long long timestamp) {
     sqlite3_stmt *stmt;
-    const char *sql = "INSERT INTO notifications (sender_id, receiver_id, message, timestamp, is_read) VALUES (?, ?, ?, ?, 0);";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_SEND_NOTIFICATION);
+    if (!stmt) {
         return 0;
     }
 
     sqlite3_bind_int(stmt, 1, sender_id);
     sqlite3_bind_int(stmt, 2, receiver_id);
     sqlite3_bind_text(stmt, 3, message, -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)time(NULL));
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)timestamp);
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
         return 0;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return 1;
 }
 
 // Retrieves notifications for a user
-int get_notifications(int user_id, char *notifications_json) {
+int get_notifications(struct app_context *ctx, int user_id, struct page *page, struct json_writer *out) {
     sqlite3_stmt *stmt;
-    const char *sql = "SELECT id, sender_id, receiver_id, message, timestamp, is_read FROM notifications WHERE receiver_id = ?;";
-    char temp[8192] = "[";
-    int first = 1;
+    sqlite3_int64 last_id = 0;
+    int rc, rows = 0;
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_GET_NOTIFICATIONS);
+    if (!stmt) {
         return 0;
     }
 
     sqlite3_bind_int(stmt, 1, user_id);
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        char *message = json_escape((const char *)sqlite3_column_text(stmt, 3));
-        char entry[1024];
-        snprintf(entry, sizeof(entry),
-                 "%s{\"id\": %d, \"sender_id\": %d, \"receiver_id\": %d, \"message\": \"%s\", \"timestamp\": %lld, \"is_read\": %d}",
-                 first ? "" : ",",
-                 sqlite3_column_int(stmt, 0),
-                 sqlite3_column_int(stmt, 1),
-                 sqlite3_column_int(stmt, 2),
-                 message,
-                 (long long)sqlite3_column_int64(stmt, 4),
-                 sqlite3_column_int(stmt, 5));
-        free(message);
-        strncat(temp, entry, sizeof(temp) - strlen(temp) - 1);
-        first = 0;
-    }
-
-    sqlite3_finalize(stmt);
-    strncat(temp, "]", sizeof(temp) - strlen(temp) - 1);
-    strncpy(notifications_json, temp, 8192);
-    return 1;
+    bind_page(stmt, 2, page);
+    jw_begin_array(out);
+    page->next = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (rows++ == page->limit) {
+            page->next = last_id; // The extra row: there is a next page
+            break;
+        }
+        last_id = sqlite3_column_int64(stmt, 0);
+        jw_begin_object(out);
+        jw_key(out, "id");
+        jw_int(out, sqlite3_column_int(stmt, 0));
+        jw_key(out, "sender_id");
+        jw_int(out, sqlite3_column_int(stmt, 1));
+        jw_key(out, "receiver_id");
+        jw_int(out, sqlite3_column_int(stmt, 2));
+        jw_key(out, "message");
+        jw_string(out, (const char *)sqlite3_column_text(stmt, 3));
+        jw_key(out, "timestamp");
+        jw_int(out, sqlite3_column_int64(stmt, 4));
+        jw_key(out, "is_read");
+        jw_int(out, sqlite3_column_int(stmt, 5));
+        jw_end_object(out);
+    }
+    jw_end_array(out);
+
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+    }
+    sqlite3_reset(stmt);
+    return (rc == SQLITE_DONE || rc == SQLITE_ROW) && !out->failed;
+}
+
+// Calls fn for up to limit of user_id's notifications after id after,
+// oldest first. Returns the number of rows passed to fn, or -1 on error.
+int get_notifications_since(struct app_context *ctx, int user_id, long long after, int limit,
+                            void (*fn)(const struct notification *n, void *arg), void *arg) {
+    sqlite3_stmt *stmt;
+    struct notification n;
+    int rc, rows = 0;
+
+    stmt = get_statement(ctx, STMT_GET_NOTIFICATIONS_SINCE);
+    if (!stmt) {
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int64(stmt, 2, after);
+    sqlite3_bind_int(stmt, 3, limit);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        n.id = sqlite3_column_int64(stmt, 0);
+        n.sender_id = sqlite3_column_int(stmt, 1);
+        n.receiver_id = sqlite3_column_int(stmt, 2);
+        n.message = (const char *)sqlite3_column_text(stmt, 3);
+        n.timestamp = sqlite3_column_int64(stmt, 4);
+        n.is_read = sqlite3_column_int(stmt, 5);
+        fn(&n, arg);
+        rows++;
+    }
+
+    if (rc != SQLITE_DONE) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        rows = -1;
+    }
+    sqlite3_reset(stmt);
+    return rows;
 }
 
 // Marks a notification as read
-int mark_notification_read(int user_id, int notification_id) {
+int mark_notification_read(struct app_context *ctx, int user_id, int notification_id) {
     sqlite3_stmt *stmt;
-    const char *sql = "UPDATE notifications SET is_read = 1 WHERE id = ? AND receiver_id = ?;";
 
-    if (sqlite3_prepare_v2(app_ctx.db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(app_ctx.db));
+    stmt = get_statement(ctx, STMT_MARK_NOTIFICATION_READ);
+    if (!stmt) {
         return 0;
     }
 
@@ -512,12 +792,81 @@ int mark_notification_read(int user_id, int notification_id) {
     sqlite3_bind_int(stmt, 2, user_id);
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(app_ctx.db));
-        sqlite3_finalize(stmt);
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
         return 0;
     }
 
-    int changes = sqlite3_changes(app_ctx.db);
-    sqlite3_finalize(stmt);
+    int changes = sqlite3_changes(ctx->db);
+    sqlite3_reset(stmt);
     return changes > 0;
-}
\ No newline at end of file
+}
+
+// Reads user_id's unread notification count, kept by triggers in
+// unread_counts. Returns -1 on error.
+long long get_unread_count(struct app_context *ctx, int user_id) {
+    sqlite3_stmt *stmt;
+    long long count = 0;
+
+    stmt = get_statement(ctx, STMT_GET_UNREAD_COUNT);
+    if (!stmt) {
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, user_id);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        count = sqlite3_column_int64(stmt, 0);
+    } else if (rc != SQLITE_DONE) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        count = -1;
+    }
+    sqlite3_reset(stmt);
+    return count;
+}
+
+// Runs a bulk update or delete of user_id's notifications whose other
+// parameters are already bound. Returns the rows changed, or -1 on error.
+static long long step_bulk(struct app_context *ctx, sqlite3_stmt *stmt) {
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        log_error("Failed to execute statement: %s", sqlite3_errmsg(ctx->db));
+        sqlite3_reset(stmt);
+        return -1;
+    }
+    long long changes = sqlite3_changes64(ctx->db);
+    sqlite3_reset(stmt);
+    return changes;
+}
+
+// Marks every unread notification of user_id up to id up_to as read
+long long mark_notifications_read_up_to(struct app_context *ctx, int user_id, long long up_to) {
+    sqlite3_stmt *stmt = get_statement(ctx, STMT_MARK_NOTIFICATIONS_READ_UP_TO);
+    if (!stmt) {
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int64(stmt, 2, up_to);
+    return step_bulk(ctx, stmt);
+}
+
+// Marks the notifications in ids_json (a JSON array of ids) as read; ids
+// that are not user_id's are ignored
+long long mark_notifications_read_ids(struct app_context *ctx, int user_id, const char *ids_json) {
+    sqlite3_stmt *stmt = get_statement(ctx, STMT_MARK_NOTIFICATIONS_READ_IDS);
+    if (!stmt) {
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_text(stmt, 2, ids_json, -1, SQLITE_STATIC);
+    return step_bulk(ctx, stmt);
+}
+
+// Deletes user_id's read notifications
+long long delete_read_notifications(struct app_context *ctx, int user_id) {
+    sqlite3_stmt *stmt = get_statement(ctx, STMT_DELETE_READ_NOTIFICATIONS);
+    if (!stmt) {
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, user_id);
+    return step_bulk(ctx, stmt);
+}
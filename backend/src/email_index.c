@@ -0,0 +1,125 @@
+//email_index.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sodium.h>
+#include "app.h"
+
+// Counters per email at least; 4 hashes over 16 counters per email give
+// about 1 false "maybe" in 400 lookups of a free email
+#define EMAIL_INDEX_COUNTERS_PER_EMAIL 16
+#define EMAIL_INDEX_MIN_COUNTERS (1 << 20)
+#define EMAIL_INDEX_HASHES 4
+
+// Counting Bloom filter over users.email. It answers "maybe taken" or
+// "certainly free" without touching SQLite; a maybe is confirmed with the
+// UNIQUE index. Counters (rather than bits) let an email be removed when
+// its user deletes the account or changes address. Updates follow the
+// database loosely (one applied before a batch rolls back, say) but are
+// only ever a hint: the UNIQUE constraint decides.
+static struct {
+    atomic_ushort *counters; // NULL until loaded: everything is a maybe
+    size_t mask;
+    unsigned char key[crypto_shorthash_KEYBYTES];
+} emails;
+
+// Fills pos with email's counters, from one keyed SipHash split in two
+static void positions(const char *email, size_t pos[EMAIL_INDEX_HASHES]) {
+    unsigned char h[crypto_shorthash_BYTES];
+    uint32_t h1, h2;
+
+    crypto_shorthash(h, (const unsigned char *)email, strlen(email), emails.key);
+    memcpy(&h1, h, 4);
+    memcpy(&h2, h + 4, 4);
+    h2 |= 1; // Odd, so the probes never repeat
+    for (int i = 0; i < EMAIL_INDEX_HASHES; i++) {
+        pos[i] = (h1 + (size_t)i * h2) & emails.mask;
+    }
+}
+
+// Sizes the filter for the users table and adds every email in it. Call
+// once at startup, before any thread looks emails up.
+int email_index_load(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    size_t users = 0, counters = EMAIL_INDEX_MIN_COUNTERS;
+
+    if (sqlite3_prepare_v2(db, "SELECT count(*) FROM users;", -1, &stmt, NULL) != SQLITE_OK) {
+        log_error("Cannot count users: %s", sqlite3_errmsg(db));
+        return 0;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        users = (size_t)sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    while (counters < users * EMAIL_INDEX_COUNTERS_PER_EMAIL) {
+        counters <<= 1;
+    }
+
+    emails.counters = calloc(counters, sizeof(*emails.counters));
+    if (!emails.counters) {
+        log_error("Cannot allocate the email index");
+        return 0;
+    }
+    emails.mask = counters - 1;
+    crypto_shorthash_keygen(emails.key);
+
+    if (sqlite3_prepare_v2(db, "SELECT email FROM users;", -1, &stmt, NULL) != SQLITE_OK) {
+        log_error("Cannot load emails: %s", sqlite3_errmsg(db));
+        free(emails.counters);
+        emails.counters = NULL;
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        email_index_add((const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    log_info("Email index: %zu users in %zu counters", users, counters);
+    return 1;
+}
+
+void email_index_add(const char *email) {
+    size_t pos[EMAIL_INDEX_HASHES];
+
+    if (!emails.counters || !email) {
+        return;
+    }
+    positions(email, pos);
+    for (int i = 0; i < EMAIL_INDEX_HASHES; i++) {
+        atomic_fetch_add_explicit(&emails.counters[pos[i]], 1, memory_order_relaxed);
+    }
+}
+
+// Call with an email that was added. Counters stop at 0, so removing one
+// the index never saw cannot wrap a counter around.
+void email_index_remove(const char *email) {
+    size_t pos[EMAIL_INDEX_HASHES];
+
+    if (!emails.counters || !email) {
+        return;
+    }
+    positions(email, pos);
+    for (int i = 0; i < EMAIL_INDEX_HASHES; i++) {
+        unsigned short n = atomic_load_explicit(&emails.counters[pos[i]], memory_order_relaxed);
+        while (n > 0 && !atomic_compare_exchange_weak_explicit(&emails.counters[pos[i]], &n, n - 1,
+                                                                memory_order_relaxed, memory_order_relaxed)) {
+        }
+    }
+}
+
+// Returns 0 if no user has email, 1 if one may have
+int email_index_maybe_taken(const char *email) {
+    size_t pos[EMAIL_INDEX_HASHES];
+
+    if (!emails.counters) {
+        return 1;
+    }
+    positions(email, pos);
+    for (int i = 0; i < EMAIL_INDEX_HASHES; i++) {
+        if (atomic_load_explicit(&emails.counters[pos[i]], memory_order_relaxed) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,57 @@
+//histogram.c
+#include <stdio.h>
+#include "app.h"
+
+// Counts value in its power-of-two bucket. Not locked; callers serialize.
+void hist_record(struct histogram *h, unsigned long long value) {
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && value >= 1ULL << b) {
+        b++;
+    }
+    h->buckets[b]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+// Upper bound of the bucket holding the p-th fraction of values (0 < p <= 1)
+unsigned long long hist_percentile(const struct histogram *h, double p) {
+    unsigned long seen = 0;
+    unsigned long want = (unsigned long)(p * h->count + 0.5);
+    if (want == 0) {
+        want = 1;
+    }
+    for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= want) {
+            unsigned long long bound = b == 0 ? 0 : (1ULL << b) - 1;
+            return bound < h->max ? bound : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Logs count, mean, percentiles and the non-empty buckets of h
+void hist_print(const char *name, const struct histogram *h) {
+    char buckets[HIST_BUCKETS * 32];
+    size_t len = 0;
+
+    if (h->count == 0) {
+        log_info("%s: no samples", name);
+        return;
+    }
+    log_info("%s: n=%lu mean=%.1f p50<=%llu p99<=%llu max=%llu", name, h->count,
+             (double)h->sum / h->count, hist_percentile(h, 0.5), hist_percentile(h, 0.99), h->max);
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (h->buckets[b]) {
+            if (b == HIST_BUCKETS - 1) {
+                len += snprintf(buckets + len, sizeof(buckets) - len, " >=%llu:%lu", 1ULL << (b - 1), h->buckets[b]);
+            } else {
+                len += snprintf(buckets + len, sizeof(buckets) - len, " <%llu:%lu", 1ULL << b, h->buckets[b]);
+            }
+        }
+    }
+    log_info("%s buckets:%s", name, buckets);
+}
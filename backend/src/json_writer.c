@@ -0,0 +1,221 @@
+//json_writer.c
+#include <stdio.h>
+#include <string.h>
+#include "mongoose.h"
+#include "app.h"
+
+// Smallest allocation the writer makes when its buffer is empty
+#define JW_MIN_CAPACITY 1024
+
+// Width reserved for the Content-Length value in json_reply_begin
+#define JW_LENGTH_DIGITS 10
+
+void jw_init(struct json_writer *w, struct mg_iobuf *out) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+}
+
+// Makes room for n more bytes, doubling the buffer so appends stay linear
+static int jw_reserve(struct json_writer *w, size_t n) {
+    struct mg_iobuf *io = w->out;
+    if (w->failed) {
+        return 0;
+    }
+    if (io->len + n <= io->size) {
+        return 1;
+    }
+    size_t size = io->size < JW_MIN_CAPACITY ? JW_MIN_CAPACITY : io->size;
+    while (size < io->len + n) {
+        size *= 2;
+    }
+    if (!mg_iobuf_resize(io, size)) {
+        w->failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static void jw_append(struct json_writer *w, const char *s, size_t n) {
+    if (jw_reserve(w, n)) {
+        memcpy(w->out->buf + w->out->len, s, n);
+        w->out->len += n;
+    }
+}
+
+// Writes the comma that separates a new value from its previous sibling
+static void jw_separate(struct json_writer *w) {
+    if (w->after_key) {
+        w->after_key = 0;
+    } else if (w->nonempty & (1ULL << w->depth)) {
+        jw_append(w, ",", 1);
+    }
+    w->nonempty |= 1ULL << w->depth;
+}
+
+static void jw_open(struct json_writer *w, char c) {
+    jw_separate(w);
+    jw_append(w, &c, 1);
+    w->depth++;
+    w->nonempty &= ~(1ULL << w->depth);
+}
+
+static void jw_close(struct json_writer *w, char c) {
+    w->depth--;
+    jw_append(w, &c, 1);
+}
+
+void jw_begin_object(struct json_writer *w) {
+    jw_open(w, '{');
+}
+
+void jw_end_object(struct json_writer *w) {
+    jw_close(w, '}');
+}
+
+void jw_begin_array(struct json_writer *w) {
+    jw_open(w, '[');
+}
+
+void jw_end_array(struct json_writer *w) {
+    jw_close(w, ']');
+}
+
+// Appends s as a quoted JSON string, escaping straight into the output.
+// Runs of characters that need no escaping are copied in one go.
+static void jw_quote(struct json_writer *w, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t run = 0;
+
+    jw_append(w, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        jw_append(w, s + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': jw_append(w, "\\\"", 2); break;
+            case '\\': jw_append(w, "\\\\", 2); break;
+            case '\n': jw_append(w, "\\n", 2); break;
+            case '\r': jw_append(w, "\\r", 2); break;
+            case '\t': jw_append(w, "\\t", 2); break;
+            default: {
+                char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                jw_append(w, u, sizeof(u));
+            }
+        }
+    }
+    jw_append(w, s + run, len - run);
+    jw_append(w, "\"", 1);
+}
+
+void jw_key(struct json_writer *w, const char *key) {
+    jw_separate(w);
+    jw_quote(w, key, strlen(key));
+    jw_append(w, ":", 1);
+    w->after_key = 1;
+}
+
+// Writes a string value; NULL is written as an empty string
+void jw_string(struct json_writer *w, const char *s) {
+    jw_separate(w);
+    jw_quote(w, s ? s : "", s ? strlen(s) : 0);
+}
+
+void jw_int(struct json_writer *w, long long v) {
+    char num[24];
+    int n = snprintf(num, sizeof(num), "%lld", v);
+    jw_separate(w);
+    jw_append(w, num, (size_t)n);
+}
+
+// Appends text that is already valid JSON
+void jw_raw(struct json_writer *w, const char *json, size_t len) {
+    jw_separate(w);
+    jw_append(w, json, len);
+}
+
+// Reason phrase for the status codes the routes reply with
+static const char *reason_phrase(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return status < 400 ? "OK" : "Error";
+    }
+}
+
+// Starts a reply whose JSON body is written by w directly into nc->send, so
+// the body is never copied. Returns the offset to pass to json_reply_end or
+// json_reply_cancel. Content-Length is filled in at the end.
+size_t json_reply_begin(struct mg_connection *nc, int status, const char *headers, struct json_writer *w) {
+    size_t start = nc->send.len;
+    mg_printf(nc, "HTTP/1.1 %d %s\r\n%sContent-Length: %*s\r\n\r\n", status,
+              reason_phrase(status), headers, JW_LENGTH_DIGITS, "");
+    jw_init(w, &nc->send);
+    w->body_start = nc->send.len;
+    w->length_at = w->body_start - 4 - JW_LENGTH_DIGITS;
+    return start;
+}
+
+// Adds a header (including its trailing CRLF) to a reply that is already
+// being written, for values only known once the body is done. The body is
+// moved along to make room.
+void json_reply_header(struct mg_connection *nc, struct json_writer *w, const char *header) {
+    size_t len = strlen(header);
+    if (w->failed || mg_iobuf_add(&nc->send, w->body_start - 2, header, len) != len) {
+        w->failed = 1;
+        return;
+    }
+    w->body_start += len;
+}
+
+// Finishes a reply started with json_reply_begin. Returns 0 (and discards
+// the reply) if the body could not be written. Either way the request is
+// over, so Mongoose may go on to parse the next one on the connection, as
+// it does after mg_http_reply.
+int json_reply_end(struct mg_connection *nc, size_t start, struct json_writer *w) {
+    jw_append(w, "\n", 1);
+    nc->is_resp = 0;
+    if (w->failed) {
+        json_reply_cancel(nc, start);
+        return 0;
+    }
+
+    char digits[JW_LENGTH_DIGITS + 1];
+    snprintf(digits, sizeof(digits), "%-*lu", JW_LENGTH_DIGITS, (unsigned long)(nc->send.len - w->body_start));
+    memcpy(nc->send.buf + w->length_at, digits, JW_LENGTH_DIGITS);
+    return 1;
+}
+
+// Drops everything written since json_reply_begin
+void json_reply_cancel(struct mg_connection *nc, size_t start) {
+    nc->send.len = start;
+}
+
+// Sends a whole 200 reply whose JSON body is already rendered, compressed
+// with enc unless that is ENCODING_IDENTITY. headers are sent first, then
+// the ETag and extra (extra_len bytes of further headers). A compressed
+// body carries the weak form of etag, as its bytes differ from the plain
+// reply's.
+void json_reply_body(struct mg_connection *nc, const char *headers, const char *etag, enum content_encoding enc,
+                     const char *extra, size_t extra_len, const void *body, size_t len) {
+    if (enc == ENCODING_IDENTITY) {
+        mg_printf(nc, "HTTP/1.1 200 OK\r\n%sETag: %s\r\n%.*sContent-Length: %lu\r\n\r\n", headers, etag,
+                  (int)extra_len, extra, (unsigned long)len);
+    } else {
+        mg_printf(nc, "HTTP/1.1 200 OK\r\n%sETag: W/%s\r\nContent-Encoding: %s\r\n%.*sContent-Length: %lu\r\n\r\n",
+                  headers, etag, encoding_name(enc), (int)extra_len, extra, (unsigned long)len);
+    }
+    mg_send(nc, body, len);
+    nc->is_resp = 0; // The reply is complete, as after json_reply_end
+}
@@ -0,0 +1,142 @@
+//jwt_hs256.c
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sodium.h>
+#include "app.h"
+
+// The only token shape login_user issues: libjwt's HS256 header
+// {"alg":"HS256","typ":"JWT"} and {"exp":N,"iat":N,"sub":"N"} claims, both
+// serialized with sorted keys. This is the header, base64url encoded.
+#define JWT_HS256_HEADER_B64 "eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9"
+
+#define B64_VARIANT sodium_base64_VARIANT_URLSAFE_NO_PADDING
+
+// Largest claims object we produce or accept on the fast path
+#define CLAIMS_MAX 96
+
+// Prepares the HMAC state keyed with secret, shared by sign and verify
+void jwt_hs256_key_init(crypto_auth_hmacsha256_state *key, const char *secret) {
+    crypto_auth_hmacsha256_init(key, (const unsigned char *)secret, strlen(secret));
+}
+
+// MACs "header.claims" with a copy of the pre-keyed state
+static void hs256_mac(const crypto_auth_hmacsha256_state *key, const char *signing_input,
+                      size_t len, unsigned char *mac) {
+    crypto_auth_hmacsha256_state state = *key;
+    crypto_auth_hmacsha256_update(&state, (const unsigned char *)signing_input, len);
+    crypto_auth_hmacsha256_final(&state, mac);
+    sodium_memzero(&state, sizeof(state));
+}
+
+// Signs a token for user_id into out without heap allocations. Returns 0 if
+// out is too small.
+int jwt_hs256_sign(const crypto_auth_hmacsha256_state *key, int user_id, long iat, long exp,
+                   char *out, size_t out_size) {
+    char claims[CLAIMS_MAX];
+    unsigned char mac[crypto_auth_hmacsha256_BYTES];
+    int claims_len = snprintf(claims, sizeof(claims), "{\"exp\":%ld,\"iat\":%ld,\"sub\":\"%d\"}",
+                              exp, iat, user_id);
+    size_t header_len = sizeof(JWT_HS256_HEADER_B64) - 1;
+    size_t claims_b64 = sodium_base64_ENCODED_LEN(claims_len, B64_VARIANT) - 1;
+    size_t mac_b64 = sodium_base64_ENCODED_LEN(sizeof(mac), B64_VARIANT) - 1;
+
+    if (claims_len < 0 || (size_t)claims_len >= sizeof(claims) ||
+        header_len + 1 + claims_b64 + 1 + mac_b64 + 1 > out_size) {
+        return 0;
+    }
+
+    memcpy(out, JWT_HS256_HEADER_B64 ".", header_len + 1);
+    sodium_bin2base64(out + header_len + 1, claims_b64 + 1, (const unsigned char *)claims,
+                      claims_len, B64_VARIANT);
+    size_t signing_len = header_len + 1 + claims_b64;
+
+    hs256_mac(key, out, signing_len, mac);
+    out[signing_len] = '.';
+    sodium_bin2base64(out + signing_len + 1, mac_b64 + 1, mac, sizeof(mac), B64_VARIANT);
+    return 1;
+}
+
+// Parses a non-negative decimal at *p, advancing past it
+static int parse_digits(const char **p, const char *end, long *value) {
+    const char *s = *p;
+    long n = 0;
+    if (s >= end || *s < '0' || *s > '9') {
+        return 0;
+    }
+    while (s < end && *s >= '0' && *s <= '9' && n <= (LONG_MAX - 9) / 10) {
+        n = n * 10 + (*s++ - '0');
+    }
+    if (s < end && *s >= '0' && *s <= '9') {
+        return 0; // Out of range
+    }
+    *p = s;
+    *value = n;
+    return 1;
+}
+
+static int expect(const char **p, const char *end, const char *lit) {
+    size_t n = strlen(lit);
+    if ((size_t)(end - *p) < n || memcmp(*p, lit, n) != 0) {
+        return 0;
+    }
+    *p += n;
+    return 1;
+}
+
+// Parses exactly {"exp":N,"iat":N,"sub":"N"}
+static int parse_claims(const char *s, size_t len, int *user_id, long *exp) {
+    const char *p = s, *end = s + len;
+    long parsed_exp, iat, sub;
+    if (!expect(&p, end, "{\"exp\":") || !parse_digits(&p, end, &parsed_exp) ||
+        !expect(&p, end, ",\"iat\":") || !parse_digits(&p, end, &iat) ||
+        !expect(&p, end, ",\"sub\":\"") || !parse_digits(&p, end, &sub) ||
+        !expect(&p, end, "\"}") || p != end || sub > INT_MAX) {
+        return 0;
+    }
+    *user_id = (int)sub;
+    *exp = parsed_exp;
+    return 1;
+}
+
+// Verifies a token of the shape jwt_hs256_sign produces, without heap
+// allocations. Returns 1 and fills user_id/exp if the signature is good,
+// 0 if the token is ours but forged or corrupt, and -1 if it has some other
+// shape and must go through libjwt instead. Expiry is left to the caller.
+int jwt_hs256_verify(const crypto_auth_hmacsha256_state *key, const char *token,
+                     int *user_id, long *exp) {
+    size_t header_len = sizeof(JWT_HS256_HEADER_B64) - 1;
+    if (strncmp(token, JWT_HS256_HEADER_B64 ".", header_len + 1) != 0) {
+        return -1;
+    }
+
+    const char *claims_b64 = token + header_len + 1;
+    const char *dot = strchr(claims_b64, '.');
+    if (!dot) {
+        return 0;
+    }
+
+    unsigned char mac[crypto_auth_hmacsha256_BYTES], expected[crypto_auth_hmacsha256_BYTES];
+    size_t mac_len = 0;
+    const char *b64_end = NULL;
+    const char *mac_b64 = dot + 1;
+    if (sodium_base642bin(mac, sizeof(mac), mac_b64, strlen(mac_b64), NULL, &mac_len,
+                          &b64_end, B64_VARIANT) != 0 ||
+        mac_len != sizeof(mac) || *b64_end != '\0') {
+        return 0;
+    }
+
+    hs256_mac(key, token, (size_t)(dot - token), expected);
+    if (crypto_verify_32(mac, expected) != 0) {
+        return 0;
+    }
+
+    char claims[CLAIMS_MAX];
+    size_t claims_len = 0;
+    if (sodium_base642bin((unsigned char *)claims, sizeof(claims), claims_b64,
+                          (size_t)(dot - claims_b64), NULL, &claims_len, &b64_end,
+                          B64_VARIANT) != 0 || b64_end != dot) {
+        return -1; // Correctly signed but larger than anything we issue
+    }
+    return parse_claims(claims, claims_len, user_id, exp) ? 1 : -1;
+}
@@ -0,0 +1,243 @@
+//log.c
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "app.h"
+
+#define LOG_LINE_MAX 512      // Longer lines are cut short
+#define LOG_RING_SLOTS 128    // Lines a thread may have waiting to be written
+#define LOG_FLUSH_MS 20       // How often the flusher collects lines
+#define LOG_FLUSH_BYTES 65536 // Bytes per write(2)
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+// One thread's unwritten lines. Single producer (the thread) and single
+// consumer (the flusher): the thread only moves head, the flusher only
+// moves tail, so neither takes a lock. A thread whose ring is full drops
+// the line rather than wait, unless it is an error.
+struct log_ring {
+    struct log_ring *next; // Every ring created, newest first
+    atomic_ulong head, tail;
+    struct {
+        unsigned short len;
+        char text[LOG_LINE_MAX];
+    } slots[LOG_RING_SLOTS];
+};
+
+static struct {
+    _Atomic(struct log_ring *) rings;
+    atomic_int level;
+    atomic_int running;
+    atomic_int next_thread;
+    atomic_ulong dropped;
+    int json;
+    pthread_t thread;
+} logger = {
+    .level = LOG_LEVEL_INFO,
+};
+
+static _Thread_local struct log_ring *thread_ring;
+static _Thread_local int thread_id;
+
+// The formatted second of the last line this thread logged
+static _Thread_local struct {
+    time_t sec;
+    char text[24];
+} thread_ts;
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+// Appends s to out as the inside of a JSON string, which is also a valid
+// quoted logfmt value. Returns the new length, at most size.
+static size_t append_escaped(char *out, size_t len, size_t size, const char *s) {
+    for (; *s && len < size; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            if (len + 2 > size) {
+                break;
+            }
+            out[len++] = '\\';
+            out[len++] = (char)c;
+        } else if (c < 0x20) {
+            if (len + 6 > size) {
+                break;
+            }
+            len += (size_t)snprintf(out + len, 7, "\\u%04x", c);
+        } else {
+            out[len++] = (char)c;
+        }
+    }
+    return len;
+}
+
+// Formats one line, newline included, into out (LOG_LINE_MAX bytes)
+static size_t format_line(char *out, int level, const char *msg) {
+    struct timespec ts;
+    size_t len;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != thread_ts.sec || !thread_ts.text[0]) {
+        struct tm tm;
+        gmtime_r(&ts.tv_sec, &tm);
+        strftime(thread_ts.text, sizeof(thread_ts.text), "%Y-%m-%dT%H:%M:%S", &tm);
+        thread_ts.sec = ts.tv_sec;
+    }
+    if (!thread_id) {
+        thread_id = atomic_fetch_add_explicit(&logger.next_thread, 1, memory_order_relaxed) + 1;
+    }
+
+    if (logger.json) {
+        len = (size_t)snprintf(out, LOG_LINE_MAX, "{\"ts\":\"%s.%03ldZ\",\"level\":\"%s\",\"thread\":%d,\"msg\":\"",
+                               thread_ts.text, ts.tv_nsec / 1000000, level_names[level], thread_id);
+        len = append_escaped(out, len, LOG_LINE_MAX - 4, msg);
+        memcpy(out + len, "\"}\n", 3);
+        return len + 3;
+    }
+    len = (size_t)snprintf(out, LOG_LINE_MAX, "ts=%s.%03ldZ level=%s thread=%d msg=\"", thread_ts.text,
+                           ts.tv_nsec / 1000000, level_names[level], thread_id);
+    len = append_escaped(out, len, LOG_LINE_MAX - 3, msg);
+    memcpy(out + len, "\"\n", 2);
+    return len + 2;
+}
+
+static struct log_ring *ring_for_thread(void) {
+    if (!thread_ring) {
+        struct log_ring *r = calloc(1, sizeof(*r));
+        if (!r) {
+            return NULL;
+        }
+        r->next = atomic_load(&logger.rings);
+        while (!atomic_compare_exchange_weak(&logger.rings, &r->next, r)) {
+        }
+        thread_ring = r;
+    }
+    return thread_ring;
+}
+
+// Logs a printf-style message at level. Until log_start, and after
+// log_stop, the line is written straight to stderr.
+void log_write(int level, const char *fmt, ...) {
+    char msg[LOG_LINE_MAX];
+    va_list ap;
+
+    if (level > atomic_load_explicit(&logger.level, memory_order_relaxed)) {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    struct log_ring *r = atomic_load_explicit(&logger.running, memory_order_acquire) ? ring_for_thread() : NULL;
+    unsigned long head = r ? atomic_load_explicit(&r->head, memory_order_relaxed) : 0;
+    if (r && head - atomic_load_explicit(&r->tail, memory_order_acquire) >= LOG_RING_SLOTS) {
+        if (level != LOG_LEVEL_ERROR) {
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+            return;
+        }
+        r = NULL; // Errors are never dropped
+    }
+    if (!r) {
+        char line[LOG_LINE_MAX];
+        write_all(line, format_line(line, level, msg));
+        return;
+    }
+
+    r->slots[head % LOG_RING_SLOTS].len = (unsigned short)format_line(r->slots[head % LOG_RING_SLOTS].text, level, msg);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// Writes out every waiting line, a thread's lines in order, in as few
+// write calls as buf allows
+static void flush_rings(char *buf) {
+    size_t len = 0;
+
+    for (struct log_ring *r = atomic_load(&logger.rings); r; r = r->next) {
+        unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            size_t n = r->slots[tail % LOG_RING_SLOTS].len;
+            if (len + n > LOG_FLUSH_BYTES) {
+                write_all(buf, len);
+                len = 0;
+            }
+            memcpy(buf + len, r->slots[tail % LOG_RING_SLOTS].text, n);
+            len += n;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    write_all(buf, len);
+
+    unsigned long dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+    if (dropped) {
+        char line[LOG_LINE_MAX], msg[64];
+        snprintf(msg, sizeof(msg), "Dropped %lu log lines", dropped);
+        write_all(line, format_line(line, LOG_LEVEL_WARN, msg));
+    }
+}
+
+static void *log_flusher(void *arg) {
+    static char buf[LOG_FLUSH_BYTES];
+    struct timespec interval = {0, LOG_FLUSH_MS * 1000000L};
+
+    while (atomic_load(&logger.running)) {
+        flush_rings(buf);
+        nanosleep(&interval, NULL);
+    }
+    flush_rings(buf); // What was logged while stopping
+    return NULL;
+}
+
+// Returns the level called name ("error", "warn", "info" or "debug"), or -1
+int log_parse_level(const char *name) {
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void log_set_level(int level) {
+    atomic_store_explicit(&logger.level, level, memory_order_relaxed);
+}
+
+// Starts the flusher thread; from then on logging threads only copy their
+// line into their ring. json selects JSON lines over key=value ones.
+int log_start(int level, int json) {
+    log_set_level(level);
+    logger.json = json;
+    atomic_store(&logger.running, 1);
+    if (pthread_create(&logger.thread, NULL, log_flusher, NULL) != 0) {
+        atomic_store(&logger.running, 0);
+        log_error("Failed to start the log flusher thread");
+        return 0;
+    }
+    return 1;
+}
+
+// Stops the flusher after it has written everything logged so far. Lines
+// logged afterwards are written directly.
+void log_stop(void) {
+    if (!atomic_exchange(&logger.running, 0)) {
+        return;
+    }
+    pthread_join(logger.thread, NULL);
+}
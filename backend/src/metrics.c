@@ -0,0 +1,347 @@
+//metrics.c
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "mongoose.h"
+#include "app.h"
+
+// Status codes with their own series; anything else is counted as "other"
+static const int status_codes[] = {0, 200, 201, 204, 206, 304, 400, 401, 403, 404, 405,
+                                   409, 411, 413, 415, 416, 500, 503};
+
+#define STATUS_SLOTS ((int)(sizeof(status_codes) / sizeof(status_codes[0])))
+
+// Latency histogram with the buckets of struct histogram, in microseconds.
+// Every field is updated with relaxed atomics, so any thread records into
+// it without a lock; a scrape may see a sample in a bucket before the sum.
+struct metric_hist {
+    atomic_ulong buckets[HIST_BUCKETS];
+    atomic_ullong sum;
+};
+
+// The request a connection is waiting to answer, in nc->data after the
+// photo store's part. Loop thread only.
+struct conn_metrics {
+    unsigned long long start_us;
+    int route;   // Index into routes, or num_routes if no route matched
+    int pending; // Reply not seen yet
+};
+
+_Static_assert(CONN_DATA_PHOTO + sizeof(struct conn_metrics) <= sizeof(((struct mg_connection *)0)->data),
+               "conn_metrics must fit in mg_connection.data after photo_conn");
+
+static struct {
+    const struct route *routes;
+    int num_routes;
+    struct metric_hist *requests; // [route][status slot], num_routes + 1 routes
+    struct metric_hist ops[METRIC_OP_COUNT];
+    struct metric_hist sql[STMT_COUNT + 1]; // Last: statements outside the registry
+    atomic_ullong bytes_in, bytes_out;
+    atomic_ulong connections, open_connections;
+} metrics;
+
+static const char *const method_names[ROUTE_METHOD_COUNT] = {
+    [ROUTE_GET] = "GET",
+    [ROUTE_POST] = "POST",
+    [ROUTE_PUT] = "PUT",
+    [ROUTE_DELETE] = "DELETE",
+};
+
+static const char *const op_names[METRIC_OP_COUNT] = {
+    [METRIC_PWHASH_HASH] = "pwhash_hash",
+    [METRIC_PWHASH_VERIFY] = "pwhash_verify",
+    [METRIC_JWT_VERIFY] = "jwt_verify",
+    [METRIC_JWT_DECODE] = "jwt_decode",
+};
+
+static void hist_add(struct metric_hist *h, unsigned long long value) {
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && value >= 1ULL << b) {
+        b++;
+    }
+    atomic_fetch_add_explicit(&h->buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+static struct conn_metrics *conn_metrics_of(struct mg_connection *nc) {
+    return (struct conn_metrics *)(nc->data + CONN_DATA_PHOTO);
+}
+
+static int status_slot(int status) {
+    for (int i = 1; i < STATUS_SLOTS; i++) {
+        if (status_codes[i] == status) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Allocates the per-route histograms for the route table. Call once, from
+// init_routes, before any loop starts.
+int metrics_init(const struct route *routes, int count) {
+    metrics.requests = calloc((size_t)(count + 1) * STATUS_SLOTS, sizeof(*metrics.requests));
+    if (!metrics.requests) {
+        log_error("Failed to allocate request metrics");
+        return 0;
+    }
+    metrics.routes = routes;
+    metrics.num_routes = count;
+    return 1;
+}
+
+unsigned long long metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Starts timing the request nc is about to handle; route is NULL if none
+// matched. The router calls this once it has looked the route up.
+void metrics_request_begin(struct mg_connection *nc, const struct route *route) {
+    struct conn_metrics *m = conn_metrics_of(nc);
+    m->start_us = metrics_now_us();
+    m->route = route && metrics.routes ? (int)(route - metrics.routes) : metrics.num_routes;
+    m->pending = 1;
+}
+
+// Records the request's latency and status if its reply was written to
+// nc->send since send_mark (nc->send.len before the code that may reply
+// ran). Call after dispatching and after running a completion.
+void metrics_request_end(struct mg_connection *nc, size_t send_mark) {
+    struct conn_metrics *m = conn_metrics_of(nc);
+    const char *reply = (const char *)nc->send.buf + send_mark;
+
+    if (!m->pending || !metrics.requests || nc->send.len < send_mark + 12 ||
+        memcmp(reply, "HTTP/1.", 7) != 0) {
+        return;
+    }
+    int status = atoi(reply + 9);
+    hist_add(&metrics.requests[m->route * STATUS_SLOTS + status_slot(status)], metrics_now_us() - m->start_us);
+    m->pending = 0;
+}
+
+// Counts an accepted connection opening (opened = 1) or closing (0)
+void metrics_connection(int opened) {
+    if (opened) {
+        atomic_fetch_add_explicit(&metrics.connections, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&metrics.open_connections, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_sub_explicit(&metrics.open_connections, 1, memory_order_relaxed);
+    }
+}
+
+// Counts bytes read from and written to client sockets
+void metrics_bytes(long in, long out) {
+    if (in > 0) {
+        atomic_fetch_add_explicit(&metrics.bytes_in, (unsigned long long)in, memory_order_relaxed);
+    }
+    if (out > 0) {
+        atomic_fetch_add_explicit(&metrics.bytes_out, (unsigned long long)out, memory_order_relaxed);
+    }
+}
+
+void metrics_op(enum metric_op op, unsigned long long us) {
+    hist_add(&metrics.ops[op], us);
+}
+
+// Records one run of registry statement stmt, or of any other statement
+// if stmt is STMT_COUNT
+void metrics_sql(int stmt, unsigned long long us) {
+    hist_add(&metrics.sql[stmt < 0 || stmt > STMT_COUNT ? STMT_COUNT : stmt], us);
+}
+
+// Appends a formatted line to the exposition
+static void out(struct mg_iobuf *io, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        mg_iobuf_add(io, io->len, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+    }
+}
+
+// Writes one histogram series. labels is the label list without braces
+// (may be empty); scale converts bucket bounds and the sum to the unit of
+// the metric.
+static void out_hist(struct mg_iobuf *io, const char *name, const char *labels,
+                     const unsigned long *buckets, unsigned long long sum, double scale) {
+    const char *sep = labels[0] ? "," : "";
+    char braced[192] = "";
+    unsigned long count = 0;
+
+    if (labels[0]) {
+        snprintf(braced, sizeof(braced), "{%s}", labels);
+    }
+
+    for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+        count += buckets[b];
+        out(io, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep, (double)(1ULL << b) * scale, count);
+    }
+    count += buckets[HIST_BUCKETS - 1];
+    out(io, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, count);
+    out(io, "%s_sum%s %g\n", name, braced, (double)sum * scale);
+    out(io, "%s_count%s %lu\n", name, braced, count);
+}
+
+// Snapshots h and writes it if it has samples
+static void out_metric_hist(struct mg_iobuf *io, const char *name, const char *labels, struct metric_hist *h) {
+    unsigned long buckets[HIST_BUCKETS], count = 0;
+
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        count += buckets[b];
+    }
+    if (count > 0) {
+        out_hist(io, name, labels, buckets, atomic_load_explicit(&h->sum, memory_order_relaxed), 1e-6);
+    }
+}
+
+static void out_header(struct mg_iobuf *io, const char *name, const char *type, const char *help) {
+    out(io, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Digest of the bearer token a scrape must send; /metrics is off without one
+static unsigned char scrape_digest[crypto_generichash_BYTES];
+static int scrape_enabled;
+
+// Sets the token that GET /metrics requires (METRICS_TOKEN). With none,
+// NULL or empty, the endpoint answers 404. Call once at startup.
+void metrics_set_token(const char *token) {
+    scrape_enabled = token && token[0];
+    if (scrape_enabled) {
+        crypto_generichash(scrape_digest, sizeof(scrape_digest), (const unsigned char *)token, strlen(token),
+                           NULL, 0);
+    } else {
+        log_info("GET /metrics is off; set METRICS_TOKEN to serve it");
+    }
+}
+
+// Checks a scrape's bearer token. Digests are compared, so the time taken
+// depends on neither the token's length nor its contents. Returns 0 (having
+// replied) if the scrape is refused.
+static int scrape_allowed(struct mg_connection *nc, struct mg_http_message *hm) {
+    unsigned char digest[crypto_generichash_BYTES];
+    struct mg_str *auth = mg_http_get_header(hm, "Authorization");
+
+    if (!scrape_enabled) {
+        mg_http_reply(nc, 404, "Content-Type: text/plain\r\n", "Not Found\n");
+        return 0;
+    }
+    if (!auth || auth->len < 7 || strncmp(auth->buf, "Bearer ", 7) != 0) {
+        mg_http_reply(nc, 401, JSON_HEADERS,
+                      "{\"error\": \"Missing or invalid Authorization header\"}\n");
+        return 0;
+    }
+    crypto_generichash(digest, sizeof(digest), (const unsigned char *)auth->buf + 7, auth->len - 7, NULL, 0);
+    if (sodium_memcmp(digest, scrape_digest, sizeof(digest)) != 0) {
+        mg_http_reply(nc, 401, JSON_HEADERS,
+                      "{\"error\": \"Invalid metrics token\"}\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Handles GET /metrics in the Prometheus text format, for scrapers that
+// send METRICS_TOKEN as a bearer token
+void handle_metrics(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct mg_iobuf io = {NULL, 0, 0, 4096};
+    char labels[160];
+
+    if (!scrape_allowed(nc, hm)) {
+        return;
+    }
+
+    out_header(&io, "drivehub_http_request_duration_seconds", "histogram",
+               "Time from dispatching a request to writing its reply");
+    for (int r = 0; r <= metrics.num_routes && metrics.requests; r++) {
+        for (int s = 0; s < STATUS_SLOTS; s++) {
+            char status[8];
+            snprintf(status, sizeof(status), s ? "%d" : "other", status_codes[s]);
+            if (r < metrics.num_routes) {
+                snprintf(labels, sizeof(labels), "route=\"%s %s\",status=\"%s\"",
+                         method_names[metrics.routes[r].method], metrics.routes[r].pattern, status);
+            } else {
+                snprintf(labels, sizeof(labels), "route=\"unmatched\",status=\"%s\"", status);
+            }
+            out_metric_hist(&io, "drivehub_http_request_duration_seconds", labels,
+                            &metrics.requests[r * STATUS_SLOTS + s]);
+        }
+    }
+
+    out_header(&io, "drivehub_http_received_bytes_total", "counter", "Bytes read from client connections");
+    out(&io, "drivehub_http_received_bytes_total %llu\n",
+        atomic_load_explicit(&metrics.bytes_in, memory_order_relaxed));
+    out_header(&io, "drivehub_http_sent_bytes_total", "counter", "Bytes written to client connections");
+    out(&io, "drivehub_http_sent_bytes_total %llu\n",
+        atomic_load_explicit(&metrics.bytes_out, memory_order_relaxed));
+    out_header(&io, "drivehub_http_connections_total", "counter", "Client connections accepted");
+    out(&io, "drivehub_http_connections_total %lu\n",
+        atomic_load_explicit(&metrics.connections, memory_order_relaxed));
+    out_header(&io, "drivehub_http_open_connections", "gauge", "Client connections open now");
+    out(&io, "drivehub_http_open_connections %lu\n",
+        atomic_load_explicit(&metrics.open_connections, memory_order_relaxed));
+    out_header(&io, "drivehub_sse_subscribers", "gauge", "Open notification streams");
+    out(&io, "drivehub_sse_subscribers %lu\n", sse_subscribers());
+
+    out_header(&io, "drivehub_operation_duration_seconds", "histogram", "Time spent in password hashing and token checks");
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        snprintf(labels, sizeof(labels), "op=\"%s\"", op_names[op]);
+        out_metric_hist(&io, "drivehub_operation_duration_seconds", labels, &metrics.ops[op]);
+    }
+
+    out_header(&io, "drivehub_sql_statement_duration_seconds", "histogram", "Time from first step to reset of each SQL statement");
+    for (int i = 0; i <= STMT_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "statement=\"%s\"", i < STMT_COUNT ? statement_name(i) : "other");
+        out_metric_hist(&io, "drivehub_sql_statement_duration_seconds", labels, &metrics.sql[i]);
+    }
+
+    struct pwhash_stats pwhash;
+    pwhash_stats(&pwhash);
+    out_header(&io, "drivehub_pwhash_queued", "gauge", "Password hashes waiting for a worker");
+    out(&io, "drivehub_pwhash_queued %d\n", pwhash.queued);
+    out_header(&io, "drivehub_pwhash_memory_bytes", "gauge", "Memory of the password hashes running now");
+    out(&io, "drivehub_pwhash_memory_bytes %zu\n", pwhash.mem_in_use);
+    out_header(&io, "drivehub_pwhash_memory_max_bytes", "gauge", "Cap on password hashing memory (PWHASH_MEM_BUDGET_MB)");
+    out(&io, "drivehub_pwhash_memory_max_bytes %zu\n", pwhash.mem_budget);
+
+    unsigned long token_hits, token_misses;
+    token_cache_stats(&token_hits, &token_misses);
+    out_header(&io, "drivehub_token_cache_lookups_total", "counter", "Token cache lookups by outcome");
+    out(&io, "drivehub_token_cache_lookups_total{result=\"hit\"} %lu\n", token_hits);
+    out(&io, "drivehub_token_cache_lookups_total{result=\"miss\"} %lu\n", token_misses);
+
+    struct response_cache_stats responses;
+    response_cache_stats(&responses);
+    out_header(&io, "drivehub_response_cache_lookups_total", "counter", "Rendered reply cache lookups by outcome");
+    out(&io, "drivehub_response_cache_lookups_total{result=\"hit\"} %lu\n", responses.hits);
+    out(&io, "drivehub_response_cache_lookups_total{result=\"miss\"} %lu\n", responses.misses);
+    out_header(&io, "drivehub_response_cache_evictions_total", "counter", "Rendered replies evicted to stay under the cap");
+    out(&io, "drivehub_response_cache_evictions_total %lu\n", responses.evictions);
+    out_header(&io, "drivehub_response_cache_entries", "gauge", "Rendered replies cached now");
+    out(&io, "drivehub_response_cache_entries %lu\n", responses.entries);
+    out_header(&io, "drivehub_response_cache_bytes", "gauge", "Bytes held by the rendered reply cache");
+    out(&io, "drivehub_response_cache_bytes %zu\n", responses.bytes);
+    out_header(&io, "drivehub_response_cache_max_bytes", "gauge", "Cap on the rendered reply cache (RESPONSE_CACHE_MB)");
+    out(&io, "drivehub_response_cache_max_bytes %zu\n", responses.max_bytes);
+
+    struct write_stats writes;
+    write_queue_stats(&writes);
+    out_header(&io, "drivehub_write_commits_total", "counter", "Write batches committed by outcome");
+    out(&io, "drivehub_write_commits_total{result=\"ok\"} %lu\n", writes.commits);
+    out(&io, "drivehub_write_commits_total{result=\"failed\"} %lu\n", writes.failed_commits);
+    out_header(&io, "drivehub_write_batch_size", "histogram", "Writes per committed batch");
+    out_hist(&io, "drivehub_write_batch_size", "", writes.batch_size.buckets, writes.batch_size.sum, 1);
+    out_header(&io, "drivehub_write_commit_duration_seconds", "histogram", "BEGIN to COMMIT of one write batch");
+    out_hist(&io, "drivehub_write_commit_duration_seconds", "", writes.commit_us.buckets, writes.commit_us.sum, 1e-6);
+    out_header(&io, "drivehub_write_latency_seconds", "histogram", "Submit to commit of one write");
+    out_hist(&io, "drivehub_write_latency_seconds", "", writes.latency_us.buckets, writes.latency_us.sum, 1e-6);
+
+    mg_http_reply(nc, 200, "Content-Type: text/plain; version=0.0.4\r\n", "%.*s", (int)io.len, (char *)io.buf);
+    mg_iobuf_free(&io);
+}
@@ -0,0 +1,243 @@
+//migrations.c
+#include <stdio.h>
+#include <time.h>
+#include <sqlite3.h>
+#include "app.h"
+
+// Schema changes, applied in order. PRAGMA user_version records how many
+// have run, so each one runs exactly once per database. Never edit or
+// reorder an entry that has shipped; append a new one instead.
+struct migration {
+    const char *name;
+    const char *sql;          // Run first, if set
+    int (*fn)(sqlite3 *db);   // For changes SQL alone cannot make, if set
+};
+
+// Moves photo data stored inline in cars.photo to the photo store, leaving
+// the link in its place
+static int move_inline_photos(sqlite3 *db) {
+    sqlite3_stmt *select, *update;
+    char url[512];
+    int rc, moved = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT id, photo FROM cars WHERE photo != '' AND photo NOT LIKE '" PHOTO_URL_PREFIX "%' "
+                               "AND photo NOT LIKE 'http://%' AND photo NOT LIKE 'https://%';", -1, &select, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(db, "UPDATE cars SET photo = ? WHERE id = ?;", -1, &update, NULL) != SQLITE_OK) {
+        sqlite3_finalize(select);
+        return 0;
+    }
+    while ((rc = sqlite3_step(select)) == SQLITE_ROW) {
+        if (!photo_store_inline((const char *)sqlite3_column_text(select, 1), url, sizeof(url))) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+        sqlite3_bind_text(update, 1, url, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(update, 2, sqlite3_column_int64(select, 0));
+        if (sqlite3_step(update) != SQLITE_DONE) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+        sqlite3_reset(update);
+        moved++;
+    }
+    sqlite3_finalize(select);
+    sqlite3_finalize(update);
+    if (rc == SQLITE_DONE && moved > 0) {
+        log_info("Moved %d inline photos to the photo store", moved);
+    }
+    return rc == SQLITE_DONE;
+}
+
+// Recounts unread_counts from the notifications table. Runs inside the
+// caller's transaction.
+static int recount_unread(sqlite3 *db) {
+    char *err = NULL;
+    if (sqlite3_exec(db, "DELETE FROM unread_counts;"
+                         "INSERT INTO unread_counts (user_id, count) "
+                         "SELECT receiver_id, COUNT(*) FROM notifications WHERE is_read = 0 GROUP BY receiver_id;",
+                     0, 0, &err) != SQLITE_OK) {
+        log_error("Cannot rebuild unread counts: %s", err);
+        sqlite3_free(err);
+        return 0;
+    }
+    return 1;
+}
+
+static const struct migration migrations[] = {
+    {
+        "create tables",
+        // IF NOT EXISTS: databases from before migrations already have these
+        "CREATE TABLE IF NOT EXISTS users ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "first_name TEXT NOT NULL,"
+        "last_name TEXT NOT NULL,"
+        "email TEXT NOT NULL UNIQUE,"
+        "organization TEXT NOT NULL,"
+        "password TEXT NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS cars ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "user_id INTEGER NOT NULL,"
+        "car_name TEXT NOT NULL,"
+        "year_of_manufacture TEXT NOT NULL,"
+        "car_value TEXT NOT NULL,"
+        "photo TEXT,"
+        "FOREIGN KEY (user_id) REFERENCES users(id)"
+        ");"
+        "CREATE TABLE IF NOT EXISTS notifications ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "sender_id INTEGER NOT NULL,"
+        "receiver_id INTEGER NOT NULL,"
+        "message TEXT NOT NULL,"
+        "timestamp INTEGER NOT NULL,"
+        "is_read INTEGER NOT NULL DEFAULT 0,"
+        "FOREIGN KEY (sender_id) REFERENCES users(id),"
+        "FOREIGN KEY (receiver_id) REFERENCES users(id)"
+        ");",
+        NULL,
+    },
+    {
+        "index cars and notifications by owner",
+        // Lists are read newest first per owner; these make each page a
+        // range scan instead of a full table scan
+        "CREATE INDEX IF NOT EXISTS idx_cars_user_id ON cars (user_id, id);"
+        "CREATE INDEX IF NOT EXISTS idx_notifications_receiver_id ON notifications (receiver_id, id);",
+        NULL,
+    },
+    {
+        "move inline photos to the photo store",
+        NULL,
+        move_inline_photos,
+    },
+    {
+        "count unread notifications per user",
+        // Kept current by triggers on every write to notifications, so the
+        // count is one primary key lookup instead of a scan
+        "CREATE TABLE IF NOT EXISTS unread_counts ("
+        "user_id INTEGER PRIMARY KEY,"
+        "count INTEGER NOT NULL DEFAULT 0"
+        ");"
+        "CREATE TRIGGER IF NOT EXISTS unread_on_insert AFTER INSERT ON notifications "
+        "WHEN NEW.is_read = 0 BEGIN "
+        "INSERT INTO unread_counts (user_id, count) VALUES (NEW.receiver_id, 1) "
+        "ON CONFLICT (user_id) DO UPDATE SET count = count + 1; "
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS unread_on_read AFTER UPDATE OF is_read ON notifications "
+        "WHEN OLD.is_read = 0 AND NEW.is_read != 0 BEGIN "
+        "UPDATE unread_counts SET count = count - 1 WHERE user_id = NEW.receiver_id; "
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS unread_on_unread AFTER UPDATE OF is_read ON notifications "
+        "WHEN OLD.is_read != 0 AND NEW.is_read = 0 BEGIN "
+        "INSERT INTO unread_counts (user_id, count) VALUES (NEW.receiver_id, 1) "
+        "ON CONFLICT (user_id) DO UPDATE SET count = count + 1; "
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS unread_on_delete AFTER DELETE ON notifications "
+        "WHEN OLD.is_read = 0 BEGIN "
+        "UPDATE unread_counts SET count = count - 1 WHERE user_id = OLD.receiver_id; "
+        "END;",
+        recount_unread,
+    },
+};
+
+#define NUM_MIGRATIONS ((int)(sizeof(migrations) / sizeof(migrations[0])))
+
+static int get_user_version(sqlite3 *db, int *version) {
+    sqlite3_stmt *stmt;
+    int ok = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        *version = sqlite3_column_int(stmt, 0);
+        ok = 1;
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Runs migration i (0-based) and bumps user_version in one transaction, so
+// a crash or error leaves the database at the previous version
+static int apply_migration(sqlite3 *db, int i) {
+    char sql[64];
+    char *err = NULL;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", i + 1);
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, &err) != SQLITE_OK) {
+        log_error("Migration %d (%s) failed: %s", i + 1, migrations[i].name, err);
+        sqlite3_free(err);
+        return 0;
+    }
+
+    // Another process may have migrated while we waited for the write lock
+    int version;
+    if (get_user_version(db, &version) && version > i) {
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+        return 1;
+    }
+
+    if ((migrations[i].sql && sqlite3_exec(db, migrations[i].sql, 0, 0, &err) != SQLITE_OK) ||
+        (migrations[i].fn && !migrations[i].fn(db)) ||
+        sqlite3_exec(db, sql, 0, 0, &err) != SQLITE_OK ||
+        sqlite3_exec(db, "COMMIT;", 0, 0, &err) != SQLITE_OK) {
+        log_error("Migration %d (%s) failed: %s", i + 1, migrations[i].name, err ? err : sqlite3_errmsg(db));
+        sqlite3_free(err);
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+        return 0;
+    }
+
+    log_info("Migration %d (%s) applied in %.1f ms", i + 1, migrations[i].name, elapsed_ms(&start));
+    return 1;
+}
+
+// Brings the schema up to date. Run once at startup, before any statement
+// is prepared.
+int migrate_db(sqlite3 *db) {
+    int version;
+
+    if (!get_user_version(db, &version)) {
+        log_error("Cannot read schema version: %s", sqlite3_errmsg(db));
+        return 0;
+    }
+    if (version > NUM_MIGRATIONS) {
+        log_error("Database schema version %d is newer than this build (%d)", version, NUM_MIGRATIONS);
+        return 0;
+    }
+
+    for (int i = version; i < NUM_MIGRATIONS; i++) {
+        if (!apply_migration(db, i)) {
+            return 0;
+        }
+    }
+    if (version < NUM_MIGRATIONS) {
+        log_info("Schema migrated from version %d to %d", version, NUM_MIGRATIONS);
+    }
+    return 1;
+}
+
+// Recomputes every user's unread count from the notifications table, for
+// when the counters are suspected to have drifted (--rebuild-counters)
+int rebuild_unread_counts(sqlite3 *db) {
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, NULL) != SQLITE_OK) {
+        log_error("Cannot rebuild unread counts: %s", sqlite3_errmsg(db));
+        return 0;
+    }
+    if (!recount_unread(db) || sqlite3_exec(db, "COMMIT;", 0, 0, NULL) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+        return 0;
+    }
+    log_info("Unread counts rebuilt in %.1f ms", elapsed_ms(&start));
+    return 1;
+}
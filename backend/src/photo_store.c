@@ -0,0 +1,550 @@
+//photo_store.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sodium.h>
+#include "mongoose.h"
+#include "app.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// Largest piece handed to sendfile, or read into the send buffer when the
+// socket is full, per call
+#define PHOTO_CHUNK (256 * 1024)
+
+// Base64 characters decoded at a time during an upload
+#define PHOTO_B64_BLOCK 4096
+
+static char photo_dir[256];
+static size_t photo_max_bytes;
+
+// A connection's photo transfer, kept in nc->data so that sending a file
+// needs no allocation. Uploads keep their larger state in upload.
+struct photo_conn {
+    int fd;          // File being sent or received, or -1
+    int state;       // PHOTO_IDLE, PHOTO_SENDING or PHOTO_RECEIVING
+    off_t offset;    // Sending: next byte to send. Receiving: head bytes to drop
+    off_t remaining; // Body bytes still to send or receive
+    struct photo_upload *upload;
+};
+
+enum {
+    PHOTO_IDLE,
+    PHOTO_SENDING,
+    PHOTO_RECEIVING,
+};
+
+// A streamed upload. Its size does not depend on the photo's.
+struct photo_upload {
+    crypto_hash_sha256_state sha;
+    mg_event_handler_t pfn; // HTTP handler, restored once the body is read
+    photo_upload_fn done;
+    int user_id, car_id;
+    int base64;             // Body is base64 text, decoded as it arrives
+    char carry[4];          // Base64 characters of an incomplete quantum
+    size_t ncarry;
+    size_t written, max;    // Decoded bytes so far, and the limit
+    char tmp[512];
+};
+
+_Static_assert(sizeof(struct photo_conn) <= CONN_DATA_PHOTO,
+               "photo_conn must fit in its part of mg_connection.data");
+
+// Creates the photo directory if needed and sets the largest photo an
+// upload may store. Call once at startup.
+int photo_store_init(const char *dir, size_t max_bytes) {
+    snprintf(photo_dir, sizeof(photo_dir), "%s", dir);
+    photo_max_bytes = max_bytes;
+    if (mkdir(photo_dir, 0755) != 0 && errno != EEXIST) {
+        log_error("Cannot create photo directory %s: %s", photo_dir, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// A photo id is the lowercase hex SHA-256 of its bytes
+int photo_hash_valid(const char *hash, size_t len) {
+    if (len != PHOTO_HASH_HEX) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!((hash[i] >= '0' && hash[i] <= '9') || (hash[i] >= 'a' && hash[i] <= 'f'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void photo_path(const char *hash, char *path, size_t size) {
+    snprintf(path, size, "%s/%.*s", photo_dir, PHOTO_HASH_HEX, hash);
+}
+
+// Opens a new temporary file in the photo directory, its name in tmp
+static int photo_tmp_open(char *tmp, size_t size) {
+    snprintf(tmp, size, "%s/.upload-XXXXXX", photo_dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        log_error("Cannot create photo file: %s", strerror(errno));
+    }
+    return fd;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Closes a fully written temporary file and renames it to its hash, so
+// readers never see a partial photo. If the photo is already stored the
+// copy is dropped. Always consumes fd and tmp.
+static int photo_commit(int fd, const char *tmp, const char *hash) {
+    char path[512];
+    int ok = fchmod(fd, 0644) == 0 && fsync(fd) == 0;
+    if (close(fd) != 0 || !ok) {
+        log_error("Cannot write photo %s: %s", hash, strerror(errno));
+        unlink(tmp);
+        return 0;
+    }
+    photo_path(hash, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        unlink(tmp);
+        return 1;
+    }
+    if (rename(tmp, path) != 0) {
+        log_error("Cannot store photo %s: %s", hash, strerror(errno));
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+// Stores data under its content hash, written to hash (PHOTO_HASH_HEX + 1
+// bytes). Identical photos are stored once: if the file already exists
+// nothing is written.
+int photo_store_put(const void *data, size_t len, char *hash) {
+    unsigned char digest[crypto_hash_sha256_BYTES];
+    char path[512], tmp[512];
+
+    crypto_hash_sha256(digest, data, len);
+    sodium_bin2hex(hash, PHOTO_HASH_HEX + 1, digest, sizeof(digest));
+    photo_path(hash, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        return 1;
+    }
+
+    int fd = photo_tmp_open(tmp, sizeof(tmp));
+    if (fd < 0) {
+        return 0;
+    }
+    if (!write_all(fd, data, len)) {
+        log_error("Cannot write photo %s: %s", hash, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return 0;
+    }
+    return photo_commit(fd, tmp, hash);
+}
+
+// Turns the photo field of a car into what cars.photo stores. Links (to the
+// store or elsewhere) are kept as they are. Anything else is photo data:
+// a data: URL is base64-decoded, any other string is taken as the bytes
+// themselves. The data is stored and url gets its /photos/<hash> link.
+int photo_store_inline(const char *photo, char *url, size_t url_size) {
+    char hash[PHOTO_HASH_HEX + 1];
+    size_t len = strlen(photo);
+
+    if (len == 0 || strncmp(photo, PHOTO_URL_PREFIX, strlen(PHOTO_URL_PREFIX)) == 0 ||
+        strncmp(photo, "http://", 7) == 0 || strncmp(photo, "https://", 8) == 0) {
+        if (len >= url_size) {
+            return 0;
+        }
+        memcpy(url, photo, len + 1);
+        return 1;
+    }
+
+    const char *comma = strchr(photo, ',');
+    if (strncmp(photo, "data:", 5) == 0 && comma && comma - photo >= 7 &&
+        strncmp(comma - 7, ";base64", 7) == 0) {
+        const char *b64 = comma + 1;
+        size_t b64_len = strlen(b64), bin_len = 0;
+        unsigned char *bin = malloc(b64_len / 4 * 3 + 3);
+        if (!bin) {
+            return 0;
+        }
+        int ok = sodium_base642bin(bin, b64_len / 4 * 3 + 3, b64, b64_len, " \r\n", &bin_len, NULL,
+                                   sodium_base64_VARIANT_ORIGINAL) == 0 &&
+                 photo_store_put(bin, bin_len, hash);
+        free(bin);
+        if (!ok) {
+            return 0;
+        }
+    } else if (!photo_store_put(photo, len, hash)) {
+        return 0;
+    }
+
+    snprintf(url, url_size, PHOTO_URL_PREFIX "%s", hash);
+    return 1;
+}
+
+// Guesses the image type from its first bytes; photos are stored without
+// an extension
+static const char *photo_content_type(int fd) {
+    unsigned char magic[12];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n >= 3 && memcmp(magic, "\xff\xd8\xff", 3) == 0) {
+        return "image/jpeg";
+    }
+    if (n >= 8 && memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        return "image/png";
+    }
+    if (n >= 6 && (memcmp(magic, "GIF87a", 6) == 0 || memcmp(magic, "GIF89a", 6) == 0)) {
+        return "image/gif";
+    }
+    if (n >= 12 && memcmp(magic, "RIFF", 4) == 0 && memcmp(magic + 8, "WEBP", 4) == 0) {
+        return "image/webp";
+    }
+    return "application/octet-stream";
+}
+
+static void photo_transfer_finish(struct mg_connection *nc, struct photo_conn *t) {
+    if (t->fd >= 0) {
+        close(t->fd);
+    }
+    t->fd = -1;
+    t->state = PHOTO_IDLE;
+    nc->is_resp = 0; // Let Mongoose parse the next pipelined request
+}
+
+// Sends as much of the photo as the socket takes. Once the headers (or a
+// previous fallback chunk) have left the send buffer, the file goes to the
+// socket with sendfile, without passing through user space. If the socket
+// is full, one chunk is read into the send buffer instead, so that Mongoose
+// waits for the socket to drain and we get called again. Call on every
+// MG_EV_POLL and MG_EV_WRITE.
+void photo_transfer_continue(struct mg_connection *nc) {
+    struct photo_conn *t = (struct photo_conn *)nc->data;
+    if (t->state != PHOTO_SENDING || nc->send.len > 0) {
+        return;
+    }
+
+    while (t->remaining > 0) {
+        size_t want = t->remaining < PHOTO_CHUNK ? (size_t)t->remaining : PHOTO_CHUNK;
+#ifdef __linux__
+        ssize_t sent = sendfile((int)(size_t)nc->fd, t->fd, &t->offset, want);
+        if (sent > 0) {
+            t->remaining -= sent;
+            metrics_bytes(0, (long)sent); // Bypasses the send buffer and MG_EV_WRITE
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            nc->is_closing = 1; // Truncated file or dead socket
+            break;
+        }
+#endif
+        if (!mg_iobuf_resize(&nc->send, want)) {
+            nc->is_closing = 1;
+            break;
+        }
+        ssize_t n = pread(t->fd, nc->send.buf, want, t->offset);
+        if (n <= 0) {
+            nc->is_closing = 1;
+            break;
+        }
+        nc->send.len = (size_t)n;
+        t->offset += n;
+        t->remaining -= n;
+        return;
+    }
+    photo_transfer_finish(nc, t);
+}
+
+// Replies with photo hash: 200 with the file, 304 if the client already
+// has it, or 404. The content never changes for a given hash, so the ETag
+// is the hash itself and the response may be cached forever.
+void photo_serve(struct mg_connection *nc, struct mg_http_message *hm, struct mg_str hash) {
+    char path[512];
+    struct stat st;
+
+    if (!photo_hash_valid(hash.buf, hash.len)) {
+        mg_http_reply(nc, 404, JSON_HEADERS, "{\"error\": \"Photo not found\"}\n");
+        return;
+    }
+
+    struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+    if (inm && inm->len == PHOTO_HASH_HEX + 2 && inm->buf[0] == '"' &&
+        memcmp(inm->buf + 1, hash.buf, PHOTO_HASH_HEX) == 0) {
+        mg_printf(nc, "HTTP/1.1 304 Not Modified\r\nETag: \"%.*s\"\r\n" PHOTO_CACHE_HEADERS "\r\n",
+                  PHOTO_HASH_HEX, hash.buf);
+        nc->is_resp = 0; // Let Mongoose parse the next pipelined request
+        return;
+    }
+
+    photo_path(hash.buf, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        mg_http_reply(nc, 404, JSON_HEADERS, "{\"error\": \"Photo not found\"}\n");
+        return;
+    }
+
+    mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\nETag: \"%.*s\"\r\n"
+              PHOTO_CACHE_HEADERS "\r\n",
+              photo_content_type(fd), (long long)st.st_size, PHOTO_HASH_HEX, hash.buf);
+
+    struct photo_conn *t = (struct photo_conn *)nc->data;
+    t->fd = fd;
+    t->state = PHOTO_SENDING;
+    t->offset = 0;
+    t->remaining = st.st_size;
+    nc->is_resp = 1; // Hold pipelined requests until the file is sent
+}
+
+// Replies to an upload that cannot continue. The rest of the body is never
+// read, so the connection closes once the reply is out.
+static void upload_reply_error(struct mg_connection *nc, int status, const char *error) {
+    mg_http_reply(nc, status, JSON_HEADERS, "{\"error\": \"%s\"}\n", error);
+    nc->is_draining = 1;
+}
+
+// Drops an unfinished upload and its partial file
+static void photo_upload_abort(struct photo_conn *t) {
+    close(t->fd);
+    unlink(t->upload->tmp);
+    sodium_memzero(t->upload, sizeof(*t->upload));
+    free(t->upload);
+    t->upload = NULL;
+    t->fd = -1;
+    t->state = PHOTO_IDLE;
+}
+
+// Releases whatever a connection's transfer holds when it closes early.
+// Call on MG_EV_CLOSE.
+void photo_transfer_close(struct mg_connection *nc) {
+    struct photo_conn *t = (struct photo_conn *)nc->data;
+    if (t->state == PHOTO_SENDING) {
+        photo_transfer_finish(nc, t);
+    } else if (t->state == PHOTO_RECEIVING) {
+        photo_upload_abort(t);
+    }
+}
+
+// Hashes and writes decoded photo bytes. Returns 0 (having replied) on
+// error.
+static int upload_write(struct mg_connection *nc, struct photo_conn *t, const void *data, size_t len) {
+    struct photo_upload *u = t->upload;
+    if (len > u->max - u->written) {
+        upload_reply_error(nc, 413, "Photo too large");
+        return 0;
+    }
+    crypto_hash_sha256_update(&u->sha, data, len);
+    if (!write_all(t->fd, data, len)) {
+        log_error("Cannot write photo upload: %s", strerror(errno));
+        upload_reply_error(nc, 500, "Failed to store photo");
+        return 0;
+    }
+    u->written += len;
+    return 1;
+}
+
+// Decodes whole base64 quanta from chars (len a multiple of 4)
+static int upload_decode(struct mg_connection *nc, struct photo_conn *t, const char *chars, size_t len) {
+    unsigned char bin[PHOTO_B64_BLOCK / 4 * 3];
+    size_t bin_len = 0;
+    if (sodium_base642bin(bin, sizeof(bin), chars, len, NULL, &bin_len, NULL,
+                          sodium_base64_VARIANT_ORIGINAL) != 0) {
+        upload_reply_error(nc, 400, "Invalid base64");
+        return 0;
+    }
+    return upload_write(nc, t, bin, bin_len);
+}
+
+// Feeds base64 text, which may split a quantum anywhere, through the
+// decoder a block at a time. Whitespace is skipped; an incomplete quantum
+// is carried over to the next call.
+static int upload_feed_base64(struct mg_connection *nc, struct photo_conn *t, const char *p, size_t len) {
+    struct photo_upload *u = t->upload;
+    char block[PHOTO_B64_BLOCK];
+    size_t n = u->ncarry;
+
+    memcpy(block, u->carry, u->ncarry);
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == ' ' || p[i] == '\t' || p[i] == '\r' || p[i] == '\n') {
+            continue;
+        }
+        block[n++] = p[i];
+        if (n == sizeof(block)) {
+            if (!upload_decode(nc, t, block, n)) {
+                return 0;
+            }
+            n = 0;
+        }
+    }
+    u->ncarry = n % 4;
+    if (n - u->ncarry > 0 && !upload_decode(nc, t, block, n - u->ncarry)) {
+        return 0;
+    }
+    memcpy(u->carry, block + n - u->ncarry, u->ncarry);
+    return 1;
+}
+
+// Finishes a fully received upload: names the file after its hash, gives
+// the connection back to the HTTP handler and calls the upload's done
+static void photo_upload_finish(struct mg_connection *nc, struct photo_conn *t) {
+    struct photo_upload *u = t->upload;
+    unsigned char digest[crypto_hash_sha256_BYTES];
+    char hash[PHOTO_HASH_HEX + 1];
+
+    if (u->ncarry > 0 || u->written == 0) {
+        upload_reply_error(nc, 400, u->written == 0 ? "Empty photo" : "Invalid base64");
+        photo_upload_abort(t);
+        return;
+    }
+    crypto_hash_sha256_final(&u->sha, digest);
+    sodium_bin2hex(hash, sizeof(hash), digest, sizeof(digest));
+    int ok = photo_commit(t->fd, u->tmp, hash);
+
+    photo_upload_fn done = u->done;
+    int user_id = u->user_id, car_id = u->car_id;
+    nc->pfn = u->pfn;
+    free(u);
+    t->upload = NULL;
+    t->fd = -1;
+    t->state = PHOTO_IDLE;
+
+    if (!ok) {
+        upload_reply_error(nc, 500, "Failed to store photo");
+        return;
+    }
+    done(nc, hash, user_id, car_id);
+}
+
+// Feeds body bytes to an upload. Returns 0 (having replied) on error.
+static int upload_feed(struct mg_connection *nc, struct photo_conn *t, const void *data, size_t len) {
+    return t->upload->base64 ? upload_feed_base64(nc, t, data, len) : upload_write(nc, t, data, len);
+}
+
+// Consumes the body bytes of an upload that have arrived so far. The
+// receive buffer is emptied every time, so an upload holds no more than
+// one read's worth of the body in memory. Call on MG_EV_READ.
+void photo_upload_continue(struct mg_connection *nc) {
+    struct photo_conn *t = (struct photo_conn *)nc->data;
+    if (t->state != PHOTO_RECEIVING) {
+        return;
+    }
+
+    // The request head is still at the front on the first read
+    size_t skip = nc->recv.len < (size_t)t->offset ? nc->recv.len : (size_t)t->offset;
+    mg_iobuf_del(&nc->recv, 0, skip);
+    t->offset -= (off_t)skip;
+    if (nc->recv.len == 0) {
+        return;
+    }
+
+    size_t n = nc->recv.len < (size_t)t->remaining ? nc->recv.len : (size_t)t->remaining;
+    int ok = upload_feed(nc, t, nc->recv.buf, n);
+    mg_iobuf_del(&nc->recv, 0, n); // Anything left is the next request
+    t->remaining -= (off_t)n;
+    if (!ok) {
+        photo_upload_abort(t);
+    } else if (t->remaining == 0) {
+        photo_upload_finish(nc, t);
+    }
+}
+
+// Stores the body of a photo upload request. Called on MG_EV_HTTP_HDRS
+// while the body is still arriving, it takes the body over from Mongoose,
+// which would otherwise buffer it whole: from then on it is hashed and
+// written to a temporary file as it arrives. Called on MG_EV_HTTP_MSG, the
+// already buffered body is stored at once. The body is the image itself,
+// or base64 text of it with ?encoding=base64. Once the photo is stored,
+// done is called with its hash. Returns 0 if the upload was refused (and
+// replied to).
+int photo_upload_begin(struct mg_connection *nc, struct mg_http_message *hm, int user_id, int car_id,
+                       photo_upload_fn done) {
+    struct photo_conn *t = (struct photo_conn *)nc->data;
+    struct mg_str *type = mg_http_get_header(hm, "Content-Type");
+    struct mg_str *length = mg_http_get_header(hm, "Content-Length");
+    struct mg_str *expect = mg_http_get_header(hm, "Expect");
+    char encoding[16] = "";
+
+    if (type && type->len >= 10 && strncmp(type->buf, "multipart/", 10) == 0) {
+        upload_reply_error(nc, 415, "Send the image itself as the body; multipart is not supported");
+        return 0;
+    }
+    if (!length || mg_http_get_header(hm, "Transfer-Encoding")) {
+        upload_reply_error(nc, 411, "Content-Length required");
+        return 0;
+    }
+
+    // Refuse an oversized photo before reading any of it
+    unsigned long long body_len = strtoull(length->buf, NULL, 10);
+    mg_http_get_var(&hm->query, "encoding", encoding, sizeof(encoding));
+    int base64 = strcmp(encoding, "base64") == 0;
+    if ((base64 ? body_len / 4 * 3 : body_len) > photo_max_bytes) {
+        upload_reply_error(nc, 413, "Photo too large");
+        return 0;
+    }
+
+    struct photo_upload *u = calloc(1, sizeof(*u));
+    int fd = u ? photo_tmp_open(u->tmp, sizeof(u->tmp)) : -1;
+    if (fd < 0) {
+        free(u);
+        upload_reply_error(nc, 500, "Failed to store photo");
+        return 0;
+    }
+    crypto_hash_sha256_init(&u->sha);
+    u->pfn = nc->pfn;
+    u->done = done;
+    u->user_id = user_id;
+    u->car_id = car_id;
+    u->base64 = base64;
+    u->max = photo_max_bytes;
+
+    t->fd = fd;
+    t->state = PHOTO_RECEIVING;
+    t->upload = u;
+
+    // Small bodies arrive with their headers; store them from the buffer
+    size_t head_at = (size_t)(hm->head.buf - (const char *)nc->recv.buf);
+    if (hm->message.len <= nc->recv.len - head_at) {
+        if (!upload_feed(nc, t, hm->body.buf, hm->body.len)) {
+            photo_upload_abort(t);
+            return 0;
+        }
+        photo_upload_finish(nc, t);
+        return 1;
+    }
+
+    // Detach the HTTP handler so the rest of the body arrives as
+    // MG_EV_READ. Mongoose drops the requests before this one from the
+    // receive buffer once this event returns, leaving this head in front.
+    nc->pfn = NULL;
+    t->offset = (off_t)hm->head.len;
+    t->remaining = (off_t)body_len;
+    if (expect && expect->len == 12 && strncasecmp(expect->buf, "100-continue", 12) == 0) {
+        mg_printf(nc, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    return 1;
+}
@@ -0,0 +1,311 @@
+//pwhash.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sodium.h>
+#include "app.h"
+
+// Jobs allowed to wait for a worker before submitters are turned away
+#define PWHASH_QUEUE_MAX 1024
+
+// Maximum worker threads, whatever the configuration asks for
+#define PWHASH_THREADS_MAX 64
+
+// Calibration never picks less memory than this per hash
+#define PWHASH_CALIBRATE_MEM_MIN (8u << 20)
+
+// Argon2id cost of new hashes. A stored hash made with other limits is
+// made again, with these, the next time its password is verified.
+static struct {
+    unsigned long long opslimit;
+    size_t memlimit;
+} limits = {
+    .opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE,
+    .memlimit = crypto_pwhash_MEMLIMIT_INTERACTIVE,
+};
+
+// Worker pool running crypto_pwhash off the event loops. A verification
+// runs at the memlimit stored in its hash, which can be more than new
+// hashes get, so the thread count alone does not bound hashing memory: a
+// worker only starts the job at the head of the queue once its memory fits
+// in what the running jobs leave of the budget.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct completion *head, *tail; // Pending jobs, linked through base.next
+    int queued;
+    int running;
+    int nthreads;
+    size_t mem_budget;
+    size_t mem_in_use;              // Memory of the jobs being hashed now
+    size_t mem_peak;
+    pthread_t threads[PWHASH_THREADS_MAX];
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Bytes of memory job hashes with: the memlimit of new hashes, or for a
+// verification the m= (KiB) field of the stored "$argon2id$v=19$m=...,t=...,p=...$" string
+static size_t job_memory(const struct pwhash_job *job) {
+    if (job->op == PWHASH_VERIFY) {
+        const char *m = strstr(job->hash, "$m=");
+        unsigned long long kib = m ? strtoull(m + 3, NULL, 10) : 0;
+        if (kib > 0) {
+            return (size_t)kib << 10;
+        }
+    }
+    return limits.memlimit;
+}
+
+// Takes the head job once its memory fits in the budget, in queue order so
+// a large job is not passed over for good. Returns NULL once stopped.
+// Called with the lock held.
+static struct pwhash_job *take_job(size_t *memory) {
+    for (;;) {
+        while (pool.running && !pool.head) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+        if (!pool.running) {
+            return NULL;
+        }
+        struct pwhash_job *job = (struct pwhash_job *)pool.head;
+        *memory = job_memory(job);
+        if (*memory <= pool.mem_budget && pool.mem_in_use + *memory > pool.mem_budget) {
+            pthread_cond_wait(&pool.cond, &pool.lock); // Until a running job frees its memory
+            continue;
+        }
+        pool.head = job->base.next;
+        if (!pool.head) {
+            pool.tail = NULL;
+        }
+        pool.queued--;
+        if (*memory > pool.mem_budget) {
+            *memory = 0; // Never run: failed by the worker instead
+        }
+        pool.mem_in_use += *memory;
+        if (pool.mem_in_use > pool.mem_peak) {
+            pool.mem_peak = pool.mem_in_use;
+        }
+        return job;
+    }
+}
+
+static void *pwhash_worker(void *arg) {
+    for (;;) {
+        size_t memory;
+        pthread_mutex_lock(&pool.lock);
+        struct pwhash_job *job = take_job(&memory);
+        pthread_mutex_unlock(&pool.lock);
+        if (!job) {
+            break;
+        }
+
+        job->base.next = NULL;
+        unsigned long long start = metrics_now_us();
+        if (memory == 0) {
+            // A stored hash made with more memory than the whole budget
+            log_error("Cannot verify a hash that needs %zu MB within PWHASH_MEM_BUDGET_MB (%zu MB)",
+                      job_memory(job) >> 20, pool.mem_budget >> 20);
+            job->result = 0;
+            job->rehash = 0;
+        } else if (job->op == PWHASH_HASH) {
+            hash_password(job->password, job->hash);
+            job->result = job->hash[0] != '\0';
+            metrics_op(METRIC_PWHASH_HASH, metrics_now_us() - start);
+        } else {
+            job->result = crypto_pwhash_str_verify(job->hash, job->password, strlen(job->password)) == 0;
+            job->rehash = job->result && pwhash_needs_rehash(job->hash);
+            metrics_op(METRIC_PWHASH_VERIFY, metrics_now_us() - start);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.mem_in_use -= memory;
+        pthread_cond_broadcast(&pool.cond); // Workers may be waiting for that memory
+        pthread_mutex_unlock(&pool.lock);
+        complete_on_loop(job->ctx, &job->base);
+    }
+    return NULL;
+}
+
+// Hash password using libsodium, at the current limits
+void hash_password(const char *password, char *hashed_output) {
+    if (crypto_pwhash_str(hashed_output, password, strlen(password), limits.opslimit, limits.memlimit) != 0) {
+        log_error("Error hashing password");
+        strcpy(hashed_output, "");
+    }
+}
+
+// Whether hash was made with other limits than new hashes get
+int pwhash_needs_rehash(const char *hash) {
+    return crypto_pwhash_str_needs_rehash(hash, limits.opslimit, limits.memlimit) != 0;
+}
+
+// Sets the limits of new hashes. Returns 0, keeping the old ones, if
+// libsodium does not accept them. Call before pwhash_pool_start.
+int pwhash_set_limits(unsigned long long opslimit, size_t memlimit) {
+    if (opslimit < crypto_pwhash_opslimit_min() || opslimit > crypto_pwhash_opslimit_max() ||
+        memlimit < crypto_pwhash_memlimit_min() || memlimit > crypto_pwhash_memlimit_max()) {
+        log_error("pwhash limits out of range: opslimit %llu, memlimit %zu bytes", opslimit, memlimit);
+        return 0;
+    }
+    limits.opslimit = opslimit;
+    limits.memlimit = memlimit;
+    return 1;
+}
+
+// Milliseconds one hash takes at opslimit and memlimit, the best of two runs
+static double time_hash(unsigned long long opslimit, size_t memlimit) {
+    char out[crypto_pwhash_STRBYTES];
+    char password[16];
+    double best = 0;
+
+    randombytes_buf(password, sizeof(password));
+    for (int i = 0; i < 2; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (crypto_pwhash_str(out, password, sizeof(password), opslimit, memlimit) != 0) {
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (i == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// Picks limits for this machine that hash in about target_ms: memlimit as
+// given if one pass over it fits (halved until it does otherwise), then as
+// many passes as fit in the target. Argon2 time grows linearly with both.
+int pwhash_calibrate(unsigned int target_ms, size_t memlimit) {
+    unsigned long long opslimit = crypto_pwhash_opslimit_min();
+    double ms = time_hash(opslimit, memlimit);
+
+    while (ms > target_ms && memlimit / 2 >= PWHASH_CALIBRATE_MEM_MIN) {
+        memlimit /= 2;
+        ms = time_hash(opslimit, memlimit);
+    }
+    if (ms < 0) {
+        log_error("pwhash calibration failed at %zu MB", memlimit >> 20);
+        return 0;
+    }
+    if (ms > 0 && ms < target_ms) {
+        opslimit = (unsigned long long)(target_ms / ms);
+        ms = time_hash(opslimit, memlimit);
+        while (opslimit > crypto_pwhash_opslimit_min() && ms > target_ms) {
+            // Scale down by the overshoot, at least one pass, and time again
+            unsigned long long fewer = (unsigned long long)(opslimit * (target_ms / ms));
+            opslimit = fewer < opslimit ? fewer : opslimit - 1;
+            if (opslimit < crypto_pwhash_opslimit_min()) {
+                opslimit = crypto_pwhash_opslimit_min();
+            }
+            ms = time_hash(opslimit, memlimit);
+        }
+    }
+    if (opslimit > crypto_pwhash_opslimit_max()) {
+        opslimit = crypto_pwhash_opslimit_max();
+    }
+    if (!pwhash_set_limits(opslimit, memlimit)) {
+        return 0;
+    }
+    log_info("pwhash calibrated to %.0f ms: opslimit %llu, memlimit %zu MB "
+             "(set PWHASH_OPSLIMIT and PWHASH_MEMLIMIT_MB to keep them)", ms, opslimit, memlimit >> 20);
+    if (opslimit < crypto_pwhash_OPSLIMIT_INTERACTIVE || memlimit < crypto_pwhash_MEMLIMIT_INTERACTIVE) {
+        log_warn("pwhash limits are below libsodium's interactive minimum");
+    }
+    return 1;
+}
+
+// Starts the pool. Hashes running at once never use more than mem_budget
+// bytes between them, whatever limits their stored hashes were made with;
+// the thread count is capped at the hashes of the current memlimit that
+// fit. Returns 0 if the budget does not cover even one hash.
+int pwhash_pool_start(int threads, size_t mem_budget) {
+    size_t max_by_memory = mem_budget / limits.memlimit;
+
+    if (max_by_memory == 0) {
+        log_error("PWHASH_MEM_BUDGET_MB (%zu MB) is below the memory of one hash (%zu MB)",
+                  mem_budget >> 20, limits.memlimit >> 20);
+        return 0;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > PWHASH_THREADS_MAX) {
+        threads = PWHASH_THREADS_MAX;
+    }
+    if ((size_t)threads > max_by_memory) {
+        threads = (int)max_by_memory;
+        log_warn("pwhash pool limited to %d threads by a %zu MB memory budget",
+                threads, mem_budget >> 20);
+    }
+
+    if (mem_budget < crypto_pwhash_MEMLIMIT_INTERACTIVE) {
+        log_warn("PWHASH_MEM_BUDGET_MB (%zu MB) is below libsodium's interactive memlimit: "
+                 "stored hashes made with it cannot be verified", mem_budget >> 20);
+    }
+
+    pool.mem_budget = mem_budget;
+    pool.mem_in_use = 0;
+    pool.mem_peak = 0;
+    pool.running = 1;
+    for (pool.nthreads = 0; pool.nthreads < threads; pool.nthreads++) {
+        if (pthread_create(&pool.threads[pool.nthreads], NULL, pwhash_worker, NULL) != 0) {
+            log_error("Failed to start pwhash worker");
+            pwhash_pool_stop();
+            return 0;
+        }
+    }
+
+    log_info("pwhash pool: %d threads, up to %zu MB hashing memory (opslimit %llu, memlimit %zu MB)",
+            threads, mem_budget >> 20, limits.opslimit, limits.memlimit >> 20);
+    return 1;
+}
+
+void pwhash_stats(struct pwhash_stats *out) {
+    pthread_mutex_lock(&pool.lock);
+    out->threads = pool.nthreads;
+    out->queued = pool.queued;
+    out->mem_budget = pool.mem_budget;
+    out->mem_in_use = pool.mem_in_use;
+    out->mem_peak = pool.mem_peak;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Stops the workers. Jobs still queued are never completed.
+void pwhash_pool_stop(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.running = 0;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.nthreads = 0;
+}
+
+// Queues a job; its completion runs on job->ctx's event loop. Returns 0 if
+// the pool is stopped or its queue is full.
+int pwhash_submit(struct pwhash_job *job) {
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.running || pool.queued >= PWHASH_QUEUE_MAX) {
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+    job->base.next = NULL;
+    if (pool.tail) {
+        pool.tail->next = &job->base;
+    } else {
+        pool.head = &job->base;
+    }
+    pool.tail = &job->base;
+    pool.queued++;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    return 1;
+}
@@ -0,0 +1,266 @@
+//response_cache.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mongoose.h"
+#include "app.h"
+
+// Hash buckets, a power of two. Every page of one user's resource lands in
+// the same bucket, so invalidating it walks one chain.
+#define RESPONSE_CACHE_BUCKETS 16384
+
+// One rendered 200 reply: the headers that vary with it (the next-page
+// cursor) and the JSON body, stored in the same allocation after the entry,
+// plus the body compressed in each encoding a client has asked for
+struct cached_response {
+    struct response_key key;
+    unsigned long version;   // resource_version when the body was rendered
+    size_t size;             // Bytes charged against the cap
+    size_t headers_len, body_len;
+    void *encoded[ENCODING_COUNT]; // NULL until compressed; never set for identity
+    size_t encoded_len[ENCODING_COUNT];
+    struct cached_response *hnext;
+    struct cached_response *prev, *next; // LRU list, most recently used first
+    char data[];             // Headers, then body
+};
+
+// Rendered replies shared by every event loop, bounded by max_bytes
+static struct {
+    pthread_mutex_t lock;
+    struct cached_response *buckets[RESPONSE_CACHE_BUCKETS];
+    struct cached_response *lru_head, *lru_tail;
+    size_t max_bytes;
+    struct response_cache_stats stats;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int bucket_of(int user_id, enum resource r) {
+    unsigned int h = ((unsigned int)user_id * RESOURCE_COUNT + r) * 2654435761u;
+    return (h ^ (h >> 16)) & (RESPONSE_CACHE_BUCKETS - 1);
+}
+
+static int same_key(const struct response_key *a, const struct response_key *b) {
+    return a->user_id == b->user_id && a->resource == b->resource && a->after == b->after && a->limit == b->limit;
+}
+
+static void lru_unlink(struct cached_response *e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        cache.lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        cache.lru_tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct cached_response *e) {
+    e->prev = NULL;
+    e->next = cache.lru_head;
+    if (cache.lru_head) {
+        cache.lru_head->prev = e;
+    } else {
+        cache.lru_tail = e;
+    }
+    cache.lru_head = e;
+}
+
+// Unlinks e from its bucket and the LRU list and frees it
+static void remove_entry(struct cached_response *e) {
+    struct cached_response **link = &cache.buckets[bucket_of(e->key.user_id, e->key.resource)];
+    while (*link && *link != e) {
+        link = &(*link)->hnext;
+    }
+    if (*link) {
+        *link = e->hnext;
+    }
+    lru_unlink(e);
+    cache.stats.bytes -= e->size;
+    cache.stats.entries--;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        free(e->encoded[i]);
+    }
+    free(e);
+}
+
+static struct cached_response *find_entry(const struct response_key *key) {
+    struct cached_response *e = cache.buckets[bucket_of(key->user_id, key->resource)];
+    while (e && !same_key(&e->key, key)) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+// Sets the memory cap; 0 turns the cache off
+void response_cache_init(size_t max_bytes) {
+    pthread_mutex_lock(&cache.lock);
+    cache.max_bytes = max_bytes;
+    cache.stats.max_bytes = max_bytes;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Writes the cached reply for key into nc's send buffer if one was rendered
+// at the current version, in encoding enc if the body is worth compressing
+// (see json_reply_body for headers and etag). A body not yet compressed in
+// enc is compressed outside the lock and kept for the next request.
+// Returns 1 if it sent a reply, 0 if the caller has to render it.
+int response_cache_send(struct mg_connection *nc, const struct response_key *key, unsigned long version,
+                        const char *headers, const char *etag, enum content_encoding enc) {
+    int hit = 0;
+    char *copy = NULL;
+    size_t headers_len = 0, body_len = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.max_bytes) {
+        pthread_mutex_unlock(&cache.lock);
+        return 0;
+    }
+    struct cached_response *e = find_entry(key);
+    if (e && e->version != version) {
+        remove_entry(e); // Rendered before a change committed
+        e = NULL;
+    }
+    if (e && enc != ENCODING_IDENTITY && compress_worthwhile(e->body_len) && !e->encoded[enc]) {
+        // Compressing takes far longer than a lookup; do it on a copy
+        copy = malloc(e->headers_len + e->body_len);
+        if (copy) {
+            headers_len = e->headers_len;
+            body_len = e->body_len;
+            memcpy(copy, e->data, headers_len + body_len);
+        }
+    }
+    if (e) {
+        if (copy) {
+            // Sent once compressed, below
+        } else if (e->encoded[enc]) {
+            json_reply_body(nc, headers, etag, enc, e->data, e->headers_len, e->encoded[enc], e->encoded_len[enc]);
+        } else {
+            json_reply_body(nc, headers, etag, ENCODING_IDENTITY, e->data, e->headers_len, e->data + e->headers_len,
+                            e->body_len);
+        }
+        lru_unlink(e);
+        lru_push_front(e);
+        cache.stats.hits++;
+        hit = 1;
+    } else {
+        cache.stats.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (copy) {
+        size_t len;
+        const void *z = compress_body(enc, copy + headers_len, body_len, &len);
+        if (z) {
+            json_reply_body(nc, headers, etag, enc, copy, headers_len, z, len);
+            response_cache_put_encoded(key, version, enc, z, len);
+        } else {
+            json_reply_body(nc, headers, etag, ENCODING_IDENTITY, copy, headers_len, copy + headers_len, body_len);
+        }
+        free(copy);
+    }
+    return hit;
+}
+
+// Keeps a rendered reply for key, tagged with the version read before its
+// query ran. Evicts the least recently used replies to stay under the cap.
+void response_cache_put(const struct response_key *key, unsigned long version, const char *headers,
+                        const char *body, size_t body_len) {
+    size_t headers_len = strlen(headers);
+    size_t size = sizeof(struct cached_response) + headers_len + body_len;
+
+    // One reply may not take more than a quarter of the cache
+    if (size > cache.max_bytes / 4) {
+        return;
+    }
+    struct cached_response *n = malloc(size);
+    if (!n) {
+        return;
+    }
+    n->key = *key;
+    n->version = version;
+    n->size = size;
+    n->headers_len = headers_len;
+    n->body_len = body_len;
+    memset(n->encoded, 0, sizeof(n->encoded));
+    memset(n->encoded_len, 0, sizeof(n->encoded_len));
+    memcpy(n->data, headers, headers_len);
+    memcpy(n->data + headers_len, body, body_len);
+
+    pthread_mutex_lock(&cache.lock);
+    struct cached_response *old = find_entry(key);
+    if (old && old->version > version) {
+        pthread_mutex_unlock(&cache.lock); // A newer rendering got here first
+        free(n);
+        return;
+    }
+    if (old) {
+        remove_entry(old);
+    }
+    while (cache.lru_tail && cache.stats.bytes + size > cache.max_bytes) {
+        remove_entry(cache.lru_tail);
+        cache.stats.evictions++;
+    }
+    unsigned int b = bucket_of(key->user_id, key->resource);
+    n->hnext = cache.buckets[b];
+    cache.buckets[b] = n;
+    lru_push_front(n);
+    cache.stats.bytes += size;
+    cache.stats.entries++;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Keeps the body of key's reply compressed in enc, if the reply rendered at
+// version is still cached
+void response_cache_put_encoded(const struct response_key *key, unsigned long version, enum content_encoding enc,
+                                const void *body, size_t len) {
+    if (enc == ENCODING_IDENTITY || len > cache.max_bytes / 4) {
+        return;
+    }
+    void *copy = malloc(len);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, body, len);
+
+    pthread_mutex_lock(&cache.lock);
+    struct cached_response *e = find_entry(key);
+    if (!e || e->version != version || e->encoded[enc]) {
+        pthread_mutex_unlock(&cache.lock);
+        free(copy);
+        return;
+    }
+    e->encoded[enc] = copy;
+    e->encoded_len[enc] = len;
+    e->size += len;
+    cache.stats.bytes += len;
+    while (cache.lru_tail != e && cache.stats.bytes > cache.max_bytes) {
+        remove_entry(cache.lru_tail);
+        cache.stats.evictions++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Drops every cached page of user_id's resource r
+void response_cache_invalidate(int user_id, enum resource r) {
+    pthread_mutex_lock(&cache.lock);
+    struct cached_response *e = cache.buckets[bucket_of(user_id, r)];
+    while (e) {
+        struct cached_response *next = e->hnext;
+        if (e->key.user_id == user_id && e->key.resource == r) {
+            remove_entry(e);
+        }
+        e = next;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void response_cache_stats(struct response_cache_stats *out) {
+    pthread_mutex_lock(&cache.lock);
+    *out = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
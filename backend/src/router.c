@@ -0,0 +1,284 @@
+//router.c
+#include <stdio.h>
+#include <string.h>
+#include "mongoose.h"
+#include "app.h"
+
+// Upper bound on trie nodes; one per distinct path segment in the table
+#define ROUTER_MAX_NODES 128
+
+// Longest integer parameter accepted, so it always fits a long long
+#define ROUTE_INT_DIGITS 18
+
+enum segment_type {
+    SEGMENT_LITERAL,
+    SEGMENT_INT, // {int}: decimal digits
+    SEGMENT_STR, // {str}: any non-empty segment
+};
+
+// One path segment. Children of a node are a sibling list; routes ending
+// at the node are indexed by method.
+struct route_node {
+    enum segment_type type;
+    struct mg_str literal;
+    int child, sibling; // Node indexes, 0 for none (0 is the root)
+    const struct route *routes[ROUTE_METHOD_COUNT];
+};
+
+// Built once by router_init, then only read, so every loop shares it
+static struct route_node nodes[ROUTER_MAX_NODES];
+static int num_nodes = 1;
+
+static const char *const method_names[ROUTE_METHOD_COUNT] = {
+    [ROUTE_GET] = "GET",
+    [ROUTE_POST] = "POST",
+    [ROUTE_PUT] = "PUT",
+    [ROUTE_DELETE] = "DELETE",
+};
+
+// Splits the next segment off *path (which starts after a '/')
+static struct mg_str next_segment(struct mg_str *path) {
+    struct mg_str seg = *path;
+    const char *slash = memchr(path->buf, '/', path->len);
+    if (slash) {
+        seg.len = (size_t)(slash - path->buf);
+        path->buf += seg.len + 1;
+        path->len -= seg.len + 1;
+    } else {
+        path->buf += path->len;
+        path->len = 0;
+    }
+    return seg;
+}
+
+static enum segment_type segment_type_of(struct mg_str seg) {
+    if (mg_strcmp(seg, mg_str("{int}")) == 0) {
+        return SEGMENT_INT;
+    }
+    if (mg_strcmp(seg, mg_str("{str}")) == 0) {
+        return SEGMENT_STR;
+    }
+    return SEGMENT_LITERAL;
+}
+
+// Finds or adds the child of parent for pattern segment seg
+static int add_child(int parent, struct mg_str seg) {
+    enum segment_type type = segment_type_of(seg);
+    int *link = &nodes[parent].child;
+    for (; *link; link = &nodes[*link].sibling) {
+        struct route_node *n = &nodes[*link];
+        if (n->type == type && (type != SEGMENT_LITERAL || mg_strcmp(n->literal, seg) == 0)) {
+            return *link;
+        }
+    }
+    if (num_nodes == ROUTER_MAX_NODES) {
+        return -1;
+    }
+    *link = num_nodes;
+    nodes[num_nodes].type = type;
+    nodes[num_nodes].literal = seg;
+    return num_nodes++;
+}
+
+// Compiles the route table into the trie. Patterns are absolute paths whose
+// segments are literals, {int} or {str}. Returns 0 on an invalid or
+// duplicate route.
+int router_init(const struct route *routes, int count) {
+    for (int i = 0; i < count; i++) {
+        const struct route *r = &routes[i];
+        struct mg_str path = mg_str(r->pattern);
+        int node = 0;
+
+        if (path.len < 2 || path.buf[0] != '/' || r->method >= ROUTE_METHOD_COUNT) {
+            log_error("Invalid route pattern: %s", r->pattern);
+            return 0;
+        }
+        path.buf++;
+        path.len--;
+        while (node >= 0 && path.len > 0) {
+            node = add_child(node, next_segment(&path));
+        }
+        if (node < 0) {
+            log_error("Too many routes, raise ROUTER_MAX_NODES");
+            return 0;
+        }
+        if (nodes[node].routes[r->method]) {
+            log_error("Duplicate route: %s %s", method_names[r->method], r->pattern);
+            return 0;
+        }
+        nodes[node].routes[r->method] = r;
+    }
+    return 1;
+}
+
+static int parse_int_segment(struct mg_str seg, long long *value) {
+    long long n = 0;
+    if (seg.len == 0 || seg.len > ROUTE_INT_DIGITS) {
+        return 0;
+    }
+    for (size_t i = 0; i < seg.len; i++) {
+        if (seg.buf[i] < '0' || seg.buf[i] > '9') {
+            return 0;
+        }
+        n = n * 10 + (seg.buf[i] - '0');
+    }
+    *value = n;
+    return 1;
+}
+
+// Walks uri down the trie in one pass, filling req->params with the
+// parameters it passes. A literal segment takes precedence over {int},
+// and {int} over {str}. Returns the node reached, or -1 if no route ends
+// there.
+int router_lookup(struct mg_str uri, struct request *req) {
+    int node = 0, nparams = 0;
+
+    if (uri.len < 2 || uri.buf[0] != '/' || uri.buf[uri.len - 1] == '/') {
+        return -1;
+    }
+    uri.buf++;
+    uri.len--;
+    do {
+        struct mg_str seg = next_segment(&uri);
+        int literal = 0, number = 0, string = 0;
+        long long value = 0;
+
+        for (int c = nodes[node].child; c; c = nodes[c].sibling) {
+            if (nodes[c].type == SEGMENT_LITERAL && !literal && nodes[c].literal.len == seg.len &&
+                memcmp(nodes[c].literal.buf, seg.buf, seg.len) == 0) {
+                literal = c;
+            } else if (nodes[c].type == SEGMENT_INT && !number) {
+                number = c;
+            } else if (nodes[c].type == SEGMENT_STR && !string && seg.len > 0) {
+                string = c;
+            }
+        }
+        if (!literal && number && !parse_int_segment(seg, &value)) {
+            number = 0;
+        }
+        if (literal) {
+            node = literal;
+        } else if ((number || string) && nparams < ROUTE_MAX_PARAMS) {
+            node = number ? number : string;
+            req->params[nparams].str = seg;
+            req->params[nparams].num = value;
+            nparams++;
+        } else {
+            return -1;
+        }
+    } while (uri.len > 0);
+
+    for (int m = 0; m < ROUTE_METHOD_COUNT; m++) {
+        if (nodes[node].routes[m]) {
+            return node;
+        }
+    }
+    return -1; // Only a prefix of some route
+}
+
+// Maps a request method to its index, or -1 if no route can have it
+static int method_index(struct mg_str method) {
+    for (int m = 0; m < ROUTE_METHOD_COUNT; m++) {
+        size_t len = strlen(method_names[m]);
+        if (method.len == len && memcmp(method.buf, method_names[m], len) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+// Returns the route at node for method, or NULL
+const struct route *router_route(int node, struct mg_str method) {
+    int m = method_index(method);
+    return m < 0 ? NULL : nodes[node].routes[m];
+}
+
+// Writes the methods node answers to, e.g. "GET, POST, OPTIONS"
+static void allowed_methods(int node, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int m = 0; m < ROUTE_METHOD_COUNT; m++) {
+        if (nodes[node].routes[m]) {
+            len += snprintf(buf + len, size - len, "%s, ", method_names[m]);
+        }
+    }
+    snprintf(buf + len, size - len, "OPTIONS");
+}
+
+// Authenticates req if the route asks for it and runs the handler
+static void run_route(struct mg_connection *nc, struct mg_http_message *hm, const struct route *route,
+                      struct request *req) {
+    if (route->flags & ROUTE_AUTH) {
+        req->user_id = get_user_id_from_token(nc, hm, req->ctx);
+        if (req->user_id <= 0) {
+            return; // Response already sent in get_user_id_from_token
+        }
+    }
+    route->fn(nc, hm, req);
+}
+
+// Routes one HTTP request: CORS preflight, 404 and 405 are answered here
+// for every path; matched requests are authenticated if the route asks for
+// it and handed to the route's handler.
+void router_dispatch(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
+    struct request req;
+    char allow[64], headers[384];
+
+    if (nc->is_draining) {
+        return; // Refused from its headers; see router_dispatch_headers
+    }
+    memset(&req, 0, sizeof(req));
+    req.ctx = ctx;
+    int node = router_lookup(hm->uri, &req);
+    const struct route *route = node < 0 ? NULL : router_route(node, hm->method);
+    metrics_request_begin(nc, route);
+    if (node < 0) {
+        mg_http_reply(nc, 404, "Content-Type: text/plain\r\n", "Not Found\n");
+        return;
+    }
+    if (!route) {
+        allowed_methods(node, allow, sizeof(allow));
+        if (mg_strcmp(hm->method, mg_str("OPTIONS")) == 0) {
+            snprintf(headers, sizeof(headers),
+                     "Content-Type: text/plain\r\n" CORS_HEADERS
+                     "Access-Control-Allow-Methods: %s\r\n"
+                     "Access-Control-Allow-Headers: Content-Type, Authorization, If-None-Match\r\n"
+                     "Access-Control-Expose-Headers: ETag, X-Next-Cursor, Link\r\n", allow);
+            mg_http_reply(nc, 200, headers, "");
+        } else {
+            snprintf(headers, sizeof(headers), "Content-Type: text/plain\r\n" CORS_HEADERS "Allow: %s\r\n", allow);
+            mg_http_reply(nc, 405, headers, "Method Not Allowed\n");
+        }
+        return;
+    }
+    run_route(nc, hm, route, &req);
+}
+
+// Runs ROUTE_STREAM routes as soon as their headers are in
+// (MG_EV_HTTP_HDRS), while the body is still arriving, so the handler can
+// take the body over instead of Mongoose buffering it whole. Everything
+// else, and any request whose body is already buffered, is left to
+// router_dispatch. A handler that does not take the body over has replied;
+// the connection is then closed, as the unread body cannot be skipped.
+void router_dispatch_headers(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
+    struct request req;
+
+    size_t head_at = (size_t)(hm->head.buf - (const char *)nc->recv.buf);
+    if (nc->is_draining || hm->message.len <= nc->recv.len - head_at) {
+        return;
+    }
+    memset(&req, 0, sizeof(req));
+    req.ctx = ctx;
+    int node = router_lookup(hm->uri, &req);
+    const struct route *route = node < 0 ? NULL : router_route(node, hm->method);
+    if (!route || !(route->flags & ROUTE_STREAM)) {
+        return;
+    }
+
+    mg_event_handler_t pfn = nc->pfn;
+    metrics_request_begin(nc, route);
+    run_route(nc, hm, route, &req);
+    if (nc->pfn == pfn) {
+        nc->is_draining = 1;
+    }
+}
@@ -1,446 +1,1383 @@
-//Routes.c
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <jansson.h>
-#include "mongoose.h"
-#include "app.h"
-
-// Helper function to extract JWT from Authorization header
-static char *extract_jwt(struct mg_http_message *hm) {
-    struct mg_str *auth_hdr = mg_http_get_header(hm, "Authorization");
-    if (!auth_hdr) {
-        fprintf(stderr, "No Authorization header found\n");
-        return NULL;
-    }
-    if (strncmp(auth_hdr->buf, "Bearer ", 7) != 0) {
-        fprintf(stderr, "Authorization header does not start with Bearer: %.*s\n",
-                (int)auth_hdr->len, auth_hdr->buf);
-        return NULL;
-    }
-    char *token = malloc(auth_hdr->len - 6);
-    if (!token) {
-        fprintf(stderr, "Memory allocation for token failed\n");
-        return NULL;
-    }
-    strncpy(token, auth_hdr->buf + 7, auth_hdr->len - 7);
-    token[auth_hdr->len - 7] = '\0';
-    fprintf(stderr, "Extracted token: %s\n", token);
-    return token;
-}
-
-// Get user ID from JWT token
-int get_user_id_from_token(struct mg_connection *nc, struct mg_http_message *hm) {
-    char *token = extract_jwt(hm);
-    if (!token) {
-        mg_http_reply(nc, 401, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Missing or invalid Authorization header\"}\n");
-        return 0;
-    }
-
-    int user_id = verify_token(token);
-    free(token);
-
-    if (user_id <= 0) {
-        mg_http_reply(nc, 401, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Invalid or expired token\"}\n");
-        return 0;
-    }
-
-    return user_id;
-}
-
-// Handles user registration (POST /register)
-void handle_register(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    json_t *root;
-    json_error_t error;
-
-    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
-    if (!root) {
-        mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Invalid JSON\"}\n");
-        return;
-    }
-
-    const char *first_name = json_string_value(json_object_get(root, "first_name"));
-    const char *last_name = json_string_value(json_object_get(root, "last_name"));
-    const char *email = json_string_value(json_object_get(root, "email"));
-    const char *organization = json_string_value(json_object_get(root, "organization"));
-    const char *password = json_string_value(json_object_get(root, "password"));
-
-    if (!first_name || !last_name || !email || !organization || !password) {
-        mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Missing fields\"}\n");
-        json_decref(root);
-        return;
-    }
-
-    int result = register_user(first_name, last_name, email, organization, password);
-    if (result == 1) {
-        mg_http_reply(nc, 201, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"message\": \"User registered\"}\n");
-    } else if (result == -1) {
-        mg_http_reply(nc, 409, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Email already in use\"}\n");
-    } else {
-        mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Registration failed\"}\n");
-    }
-
-    json_decref(root);
-}
-
-// Handles user login (POST /login)
-void handle_login(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    json_t *root;
-    json_error_t error;
-    char token[512];
-
-    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
-    if (!root) {
-        mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Invalid JSON\"}\n");
-        return;
-    }
-
-    const char *email = json_string_value(json_object_get(root, "email"));
-    const char *password = json_string_value(json_object_get(root, "password"));
-
-    if (!email || !password) {
-        mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Missing fields\"}\n");
-        json_decref(root);
-        return;
-    }
-
-    if (login_user(email, password, token)) {
-        mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"token\": \"%s\"}\n", token);
-    } else {
-        mg_http_reply(nc, 401, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "{\"error\": \"Invalid credentials\"}\n");
-    }
-
-    json_decref(root);
-}
-
-// Handles CORS preflight requests (OPTIONS)
-void handle_options(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    mg_http_reply(nc, 200,
-                  "Content-Type: text/plain\r\n"
-                  "Access-Control-Allow-Origin: http://localhost:5173\r\n"
-                  "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
-                  "Access-Control-Allow-Headers: Content-Type, Authorization\r\n",
-                  "");
-}
-
-// Handles user profile operations (GET/PUT/DELETE /profile)
-void handle_profile(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    int user_id = get_user_id_from_token(nc, hm);
-    if (user_id <= 0) {
-        return; // Response already sent in get_user_id_from_token
-    }
-
-    if (mg_match(hm->method, mg_str("GET"), NULL)) {
-        char profile[2048];
-        if (get_user_profile(user_id, profile)) {
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "%s\n", profile);
-        } else {
-            mg_http_reply(nc, 404, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"User not found\"}\n");
-        }
-    } else if (mg_match(hm->method, mg_str("PUT"), NULL)) {
-        json_t *root;
-        json_error_t error;
-
-        root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
-        if (!root) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Invalid JSON\"}\n");
-            return;
-        }
-
-        const char *first_name = json_string_value(json_object_get(root, "first_name"));
-        const char *last_name = json_string_value(json_object_get(root, "last_name"));
-        const char *organization = json_string_value(json_object_get(root, "organization"));
-
-        if (!first_name || !last_name) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Missing required fields\"}\n");
-            json_decref(root);
-            return;
-        }
-
-        if (update_user_profile(user_id, first_name, last_name, organization ? organization : "")) {
-            char updated_profile[2048];
-            get_user_profile(user_id, updated_profile);
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "%s\n", updated_profile);
-        } else {
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to update profile\"}\n");
-        }
-
-        json_decref(root);
-    } else if (mg_match(hm->method, mg_str("DELETE"), NULL)) {
-        if (delete_user(user_id)) {
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"message\": \"Account deleted\"}\n");
-        } else {
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to delete account\"}\n");
-        }
-    } else if (mg_match(hm->method, mg_str("OPTIONS"), NULL)) {
-        handle_options(nc, hm, ctx);
-    } else {
-        mg_http_reply(nc, 405, "Content-Type: text/plain\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "Method Not Allowed\n");
-    }
-}
-
-// Handles password update (PUT /password)
-void handle_password(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    int user_id = get_user_id_from_token(nc, hm);
-    if (user_id <= 0) {
-        return; // Response already sent
-    }
-
-    if (mg_match(hm->method, mg_str("PUT"), NULL)) {
-        json_t *root;
-        json_error_t error;
-
-        root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
-        if (!root) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Invalid JSON\"}\n");
-            return;
-        }
-
-        const char *password = json_string_value(json_object_get(root, "password"));
-        if (!password) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Missing password\"}\n");
-            json_decref(root);
-            return;
-        }
-
-        if (update_user_password(user_id, password)) {
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"message\": \"Password updated\"}\n");
-        } else {
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to update password\"}\n");
-        }
-
-        json_decref(root);
-    } else if (mg_match(hm->method, mg_str("OPTIONS"), NULL)) {
-        handle_options(nc, hm, ctx);
-    } else {
-        mg_http_reply(nc, 405, "Content-Type: text/plain\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "Method Not Allowed\n");
-    }
-}
-
-// Handles email update (PUT /email)
-void handle_email(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    int user_id = get_user_id_from_token(nc, hm);
-    if (user_id <= 0) {
-        return; // Response already sent
-    }
-
-    if (mg_match(hm->method, mg_str("PUT"), NULL)) {
-        json_t *root;
-        json_error_t error;
-
-        root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
-        if (!root) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Invalid JSON\"}\n");
-            return;
-        }
-
-        const char *email = json_string_value(json_object_get(root, "email"));
-        if (!email) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Missing email\"}\n");
-            json_decref(root);
-            return;
-        }
-
-        int result = update_user_email(user_id, email);
-        if (result == 1) {
-            char updated_profile[2048];
-            get_user_profile(user_id, updated_profile);
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "%s\n", updated_profile);
-        } else if (result == -1) {
-            mg_http_reply(nc, 409, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Email already in use\"}\n");
-        } else {
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to update email\"}\n");
-        }
-
-        json_decref(root);
-    } else if (mg_match(hm->method, mg_str("OPTIONS"), NULL)) {
-        handle_options(nc, hm, ctx);
-    } else {
-        mg_http_reply(nc, 405, "Content-Type: text/plain\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "Method Not Allowed\n");
-    }
-}
-
-// Handles car operations (GET/POST /cars, DELETE /cars/:id)
-void handle_cars(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    int user_id = get_user_id_from_token(nc, hm);
-    if (user_id <= 0) {
-        return; // Response already sent
-    }
-
-    if (mg_match(hm->method, mg_str("GET"), NULL) && mg_match(hm->uri, mg_str("/cars"), NULL)) {
-        char cars_json[8192];
-        if (get_cars(user_id, cars_json)) {
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "%s\n", cars_json);
-        } else {
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to fetch cars\"}\n");
-        }
-    } else if (mg_match(hm->method, mg_str("POST"), NULL) && mg_match(hm->uri, mg_str("/cars"), NULL)) {
-        json_t *root;
-        json_error_t error;
-
-        root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
-        if (!root) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Invalid JSON\"}\n");
-            return;
-        }
-
-        const char *car_name = json_string_value(json_object_get(root, "car_name"));
-        const char *year_of_manufacture = json_string_value(json_object_get(root, "year_of_manufacture"));
-        const char *car_value = json_string_value(json_object_get(root, "car_value"));
-        const char *photo = json_string_value(json_object_get(root, "photo"));
-
-        if (!car_name || !year_of_manufacture || !car_value) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Missing fields\"}\n");
-            json_decref(root);
-            return;
-        }
-
-        if (add_car(user_id, car_name, year_of_manufacture, car_value, photo ? photo : "")) {
-            char response[1024];
-            snprintf(response, sizeof(response),
-                     "{\"id\": %lld, \"car_name\": \"%s\", \"year_of_manufacture\": \"%s\", \"car_value\": \"%s\", \"photo\": \"%s\"}",
-                     sqlite3_last_insert_rowid(ctx->db), car_name, year_of_manufacture, car_value, photo ? photo : "");
-            mg_http_reply(nc, 201, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "%s\n", response);
-        } else {
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to add car\"}\n");
-        }
-
-        json_decref(root);
-    } else if (mg_match(hm->method, mg_str("DELETE"), NULL) && mg_match(hm->uri, mg_str("/cars/#"), NULL)) {
-        int car_id;
-        sscanf(hm->uri.buf + 6, "%d", &car_id);
-        if (delete_car(user_id, car_id)) {
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"message\": \"Car deleted\"}\n");
-        } else {
-            mg_http_reply(nc, 404, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Car not found or unauthorized\"}\n");
-        }
-    } else if (mg_match(hm->method, mg_str("OPTIONS"), NULL)) {
-        handle_options(nc, hm, ctx);
-    } else {
-        mg_http_reply(nc, 405, "Content-Type: text/plain\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "Method Not Allowed\n");
-    }
-}
-
-// Handles notification operations (GET/POST /notifications, POST /notifications/:id/mark_read)
-void handle_notifications(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
-    if (mg_match(hm->method, mg_str("OPTIONS"), NULL)) {
-        handle_options(nc, hm, ctx);
-        return;
-    }
-
-    int user_id = get_user_id_from_token(nc, hm);
-    if (user_id <= 0) {
-        return; // Response already sent
-    }
-
-    if (mg_match(hm->method, mg_str("POST"), NULL) && mg_match(hm->uri, mg_str("/notifications"), NULL)) {
-        json_t *root;
-        json_error_t error;
-        root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
-        if (!root) {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Invalid JSON\"}\n");
-            return;
-        }
-
-        const char *message = json_string_value(json_object_get(root, "message"));
-        json_t *receiver_id_json = json_object_get(root, "receiver_id");
-        if (!message || !json_is_integer(receiver_id_json)) {
-            json_decref(root);
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Missing or invalid message or receiver_id\"}\n");
-            return;
-        }
-
-        int receiver_id = json_integer_value(receiver_id_json);
-        if (send_notification(user_id, receiver_id, message)) {
-            json_decref(root);
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"message\": \"Notification sent\"}\n");
-        } else {
-            json_decref(root);
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to send notification\"}\n");
-        }
-    } else if (mg_match(hm->method, mg_str("GET"), NULL) && mg_match(hm->uri, mg_str("/notifications"), NULL)) {
-        char notifications_json[8192];
-        if (get_notifications(user_id, notifications_json)) {
-            mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "%s\n", notifications_json);
-        } else {
-            mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Failed to retrieve notifications\"}\n");
-        }
-    } else if (mg_match(hm->method, mg_str("POST"), NULL) && mg_match(hm->uri, mg_str("/notifications/#id/mark_read"), NULL)) {
-        struct mg_str id_str;
-        if (mg_match(hm->uri, mg_str("/notifications/#id/mark_read"), &id_str)) {
-            char id_buf[32];
-            if (id_str.len > 0 && id_str.len < sizeof(id_buf)) {
-                strncpy(id_buf, id_str.buf, id_str.len);
-                id_buf[id_str.len] = '\0';
-                int notification_id = atoi(id_buf);
-                if (notification_id > 0) {
-                    if (mark_notification_read(user_id, notification_id)) {
-                        mg_http_reply(nc, 200, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                                      "{\"message\": \"Notification marked as read\"}\n");
-                    } else {
-                        mg_http_reply(nc, 500, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                                      "{\"error\": \"Failed to mark notification as read\"}\n");
-                    }
-                } else {
-                    mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                                  "{\"error\": \"Invalid notification ID\"}\n");
-                }
-            } else {
-                mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                              "{\"error\": \"Notification ID too long or empty\"}\n");
-            }
-        } else {
-            mg_http_reply(nc, 400, "Content-Type: application/json\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                          "{\"error\": \"Invalid URI format\"}\n");
-        }
-    } else {
-        mg_http_reply(nc, 405, "Content-Type: text/plain\r\nAccess-Control-Allow-Origin: http://localhost:5173\r\n",
-                      "Method Not Allowed\n");
-    }
-}
\ No newline at end of file
+//Routes.c
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <jansson.h>
+#include "mongoose.h"
+#include "app.h"
+
+// Helper function to extract JWT from Authorization header
+static char *extract_jwt(struct mg_http_message *hm) {
+    struct mg_str *auth_hdr = mg_http_get_header(hm, "Authorization");
+    if (!auth_hdr) {
+        log_debug("No Authorization header found");
+        return NULL;
+    }
+    if (strncmp(auth_hdr->buf, "Bearer ", 7) != 0) {
+        log_debug("Authorization header is not a Bearer token");
+        return NULL;
+    }
+    char *token = malloc(auth_hdr->len - 6);
+    if (!token) {
+        log_error("Memory allocation for token failed");
+        return NULL;
+    }
+    strncpy(token, auth_hdr->buf + 7, auth_hdr->len - 7);
+    token[auth_hdr->len - 7] = '\0';
+    return token;
+}
+
+// Get user ID from JWT token
+int get_user_id_from_token(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx) {
+    char *token = extract_jwt(hm);
+    if (!token) {
+        mg_http_reply(nc, 401, JSON_HEADERS,
+                      "{\"error\": \"Missing or invalid Authorization header\"}\n");
+        return 0;
+    }
+
+    int user_id = verify_token(ctx, token);
+    free(token);
+
+    if (user_id <= 0) {
+        mg_http_reply(nc, 401, JSON_HEADERS,
+                      "{\"error\": \"Invalid or expired token\"}\n");
+        return 0;
+    }
+
+    return user_id;
+}
+
+// Queues a password job for nc; the reply is sent from job->base.fn once
+// the pool is done. Replies 503 and returns 0 if the pool is saturated.
+static int submit_pwhash(struct mg_connection *nc, struct pwhash_job *job, struct app_context *ctx) {
+    job->ctx = ctx;
+    job->base.conn_id = nc->id;
+    if (!pwhash_submit(job)) {
+        mg_http_reply(nc, 503, JSON_HEADERS,
+                      "{\"error\": \"Server busy, try again\"}\n");
+        return 0;
+    }
+    nc->is_resp = 1; // Hold pipelined requests until this reply is sent
+    return 1;
+}
+
+// Frees a finished password job and the request body it kept alive
+static void free_pwhash_job(struct pwhash_job *job) {
+    json_decref((json_t *)job->data);
+    sodium_memzero(job->hash, sizeof(job->hash));
+    free(job->replaces);
+    free(job);
+}
+
+// Allocates a write job for req's user that finishes with fn on this loop.
+// root, if set, is the parsed request the job's args point into.
+static struct write_job *new_write_job(enum write_op op, struct request *req, json_t *root,
+                                       void (*fn)(struct mg_connection *, struct completion *, struct app_context *)) {
+    struct write_job *job = calloc(1, sizeof(*job));
+    if (job) {
+        job->op = op;
+        job->ctx = req->ctx;
+        job->user_id = req->user_id;
+        job->data = root;
+        job->base.fn = fn;
+    }
+    return job;
+}
+
+// Frees a finished write job and the request body it kept alive
+static void free_write_job(struct write_job *job) {
+    json_decref((json_t *)job->data);
+    sodium_memzero(job->text, sizeof(job->text));
+    free(job->owned);
+    free(job);
+}
+
+// Queues a write for nc; the reply is sent from job->base.fn once its batch
+// has committed. Replies 503 and frees the job if the writer is saturated.
+static int submit_write(struct mg_connection *nc, struct write_job *job) {
+    job->base.conn_id = nc->id;
+    if (!write_submit(job)) {
+        mg_http_reply(nc, 503, JSON_HEADERS,
+                      "{\"error\": \"Server busy, try again\"}\n");
+        free_write_job(job);
+        return 0;
+    }
+    nc->is_resp = 1; // Hold pipelined requests until this reply is sent
+    return 1;
+}
+
+// Finishes POST /register once the user is committed
+static void register_written(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result == 1) {
+        mg_http_reply(nc, 201, JSON_HEADERS,
+                      "{\"message\": \"User registered\"}\n");
+    } else if (nc && job->result == -1) {
+        mg_http_reply(nc, 409, JSON_HEADERS,
+                      "{\"error\": \"Email already in use\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Registration failed\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Continues POST /register once the password is hashed: the INSERT goes
+// to the writer thread, with the parsed request
+static void register_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct pwhash_job *job = (struct pwhash_job *)c;
+    json_t *root = job->data;
+
+    if (nc && !job->result) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Registration failed\"}\n");
+    } else if (nc) {
+        struct request req = {.ctx = ctx};
+        struct write_job *write = new_write_job(WRITE_REGISTER_USER, &req, root, register_written);
+        if (!write) {
+            mg_http_reply(nc, 500, JSON_HEADERS,
+                          "{\"error\": \"Registration failed\"}\n");
+        } else {
+            job->data = NULL; // The write job keeps the request now
+            write->args[0] = json_string_value(json_object_get(root, "first_name"));
+            write->args[1] = json_string_value(json_object_get(root, "last_name"));
+            write->args[2] = json_string_value(json_object_get(root, "email"));
+            write->args[3] = json_string_value(json_object_get(root, "organization"));
+            snprintf(write->text, sizeof(write->text), "%s", job->hash);
+            submit_write(nc, write);
+        }
+    }
+
+    free_pwhash_job(job);
+}
+
+// Handles user registration (POST /register)
+void handle_register(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct app_context *ctx = req->ctx;
+    json_t *root;
+    json_error_t error;
+
+    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+    if (!root) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        return;
+    }
+
+    const char *first_name = json_string_value(json_object_get(root, "first_name"));
+    const char *last_name = json_string_value(json_object_get(root, "last_name"));
+    const char *email = json_string_value(json_object_get(root, "email"));
+    const char *organization = json_string_value(json_object_get(root, "organization"));
+    const char *password = json_string_value(json_object_get(root, "password"));
+
+    if (!first_name || !last_name || !email || !organization || !password) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Missing fields\"}\n");
+        json_decref(root);
+        return;
+    }
+    // A taken email is refused before paying for a password hash. This is
+    // only a pre-check: the INSERT in register_done still catches races.
+    if (email_taken(ctx, email)) {
+        mg_http_reply(nc, 409, JSON_HEADERS,
+                      "{\"error\": \"Email already in use\"}\n");
+        json_decref(root);
+        return;
+    }
+
+    struct pwhash_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Registration failed\"}\n");
+        json_decref(root);
+        return;
+    }
+    job->op = PWHASH_HASH;
+    job->password = password;
+    job->data = root;
+    job->base.fn = register_done;
+    if (!submit_pwhash(nc, job, ctx)) {
+        free_pwhash_job(job);
+    }
+}
+
+// Logs the outcome of a rehash; nobody is waiting for it
+static void rehash_written(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (job->result) {
+        log_debug("Password hash of user_id %d moved to the current limits", job->user_id);
+    }
+    free_write_job(job);
+}
+
+// Hands a rehashed password to the writer, to replace the stored hash if
+// that is still the one the password was verified against
+static void rehash_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct pwhash_job *job = (struct pwhash_job *)c;
+
+    if (job->result) {
+        struct request req = {.ctx = ctx, .user_id = job->user_id};
+        struct write_job *write = new_write_job(WRITE_REHASH_PASSWORD, &req, NULL, rehash_written);
+        if (write) {
+            snprintf(write->text, sizeof(write->text), "%s", job->hash);
+            write->owned = job->replaces;
+            job->replaces = NULL;
+            if (!write_submit(write)) {
+                free_write_job(write); // Busy: the next login tries again
+            }
+        }
+    }
+
+    free_pwhash_job(job);
+}
+
+// Hashes a password that login has just verified again, at the current
+// limits, after the login reply is on its way. Takes over login's request
+// body, which holds the password.
+static void start_rehash(struct app_context *ctx, struct pwhash_job *login) {
+    struct pwhash_job *job = calloc(1, sizeof(*job));
+    if (!job || !(job->replaces = strdup(login->hash))) {
+        free(job);
+        return;
+    }
+    job->op = PWHASH_HASH;
+    job->ctx = ctx;
+    job->user_id = login->user_id;
+    job->password = login->password;
+    job->data = login->data;
+    job->base.fn = rehash_done;
+    login->data = NULL;
+    if (!pwhash_submit(job)) {
+        login->data = job->data; // Freed with login; the next login tries again
+        job->data = NULL;
+        free_pwhash_job(job);
+    }
+}
+
+// Finishes POST /login once the password has been checked
+static void login_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct pwhash_job *job = (struct pwhash_job *)c;
+    char token[512];
+
+    if (nc && job->result && generate_token(ctx, job->user_id, token)) {
+        mg_http_reply(nc, 200, JSON_HEADERS,
+                      "{\"token\": \"%s\"}\n", token);
+    } else if (nc) {
+        mg_http_reply(nc, 401, JSON_HEADERS,
+                      "{\"error\": \"Invalid credentials\"}\n");
+    }
+    if (job->rehash) {
+        start_rehash(ctx, job);
+    }
+
+    free_pwhash_job(job);
+}
+
+// Handles user login (POST /login)
+void handle_login(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct app_context *ctx = req->ctx;
+    json_t *root;
+    json_error_t error;
+
+    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+    if (!root) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        return;
+    }
+
+    const char *email = json_string_value(json_object_get(root, "email"));
+    const char *password = json_string_value(json_object_get(root, "password"));
+
+    if (!email || !password) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Missing fields\"}\n");
+        json_decref(root);
+        return;
+    }
+
+    struct pwhash_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Login failed\"}\n");
+        json_decref(root);
+        return;
+    }
+    job->data = root;
+
+    // The lookup stays on the loop; only the verify goes to the pool
+    job->user_id = get_password_hash(ctx, email, job->hash);
+    if (job->user_id <= 0) {
+        mg_http_reply(nc, 401, JSON_HEADERS,
+                      "{\"error\": \"Invalid credentials\"}\n");
+        free_pwhash_job(job);
+        return;
+    }
+
+    job->op = PWHASH_VERIFY;
+    job->password = password;
+    job->base.fn = login_done;
+    if (!submit_pwhash(nc, job, ctx)) {
+        free_pwhash_job(job);
+    }
+}
+
+// Page size used when a list request has no ?limit=, and the largest allowed
+#define PAGE_LIMIT_DEFAULT 50
+#define PAGE_LIMIT_MAX 500
+
+// Reads ?limit= and ?after= into page. Replies 400 and returns 0 if either
+// is not a positive number; limits above PAGE_LIMIT_MAX are clamped.
+static int parse_page(struct mg_connection *nc, struct mg_http_message *hm, struct page *page) {
+    char buf[32], *end;
+
+    page->limit = PAGE_LIMIT_DEFAULT;
+    page->after = 0;
+    page->next = 0;
+
+    if (mg_http_get_var(&hm->query, "limit", buf, sizeof(buf)) > 0) {
+        long limit = strtol(buf, &end, 10);
+        if (*end != '\0' || limit <= 0) {
+            mg_http_reply(nc, 400, JSON_HEADERS,
+                          "{\"error\": \"Invalid limit\"}\n");
+            return 0;
+        }
+        page->limit = limit > PAGE_LIMIT_MAX ? PAGE_LIMIT_MAX : (int)limit;
+    }
+    if (mg_http_get_var(&hm->query, "after", buf, sizeof(buf)) > 0) {
+        page->after = strtoll(buf, &end, 10);
+        if (*end != '\0' || page->after <= 0) {
+            mg_http_reply(nc, 400, JSON_HEADERS,
+                          "{\"error\": \"Invalid cursor\"}\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Writes the headers that tell the client where the next page of path
+// starts, or "" if there is none. The body stays a plain array; the cursor
+// goes in X-Next-Cursor and Link.
+static void next_page_headers(char *header, size_t size, const char *path, const struct page *page) {
+    header[0] = '\0';
+    if (page->next) {
+        snprintf(header, size, "X-Next-Cursor: %lld\r\nLink: <%s?limit=%d&after=%lld>; rel=\"next\"\r\n",
+                 page->next, path, page->limit, page->next);
+    }
+}
+
+#define EXPOSE_HEADERS "Access-Control-Expose-Headers: ETag, X-Next-Cursor, Link\r\n"
+#define VARY_HEADERS "Vary: Accept-Encoding\r\n"
+
+// Headers of every 200 reply_resource sends, ahead of its ETag
+#define RESOURCE_HEADERS JSON_HEADERS EXPOSE_HEADERS REVALIDATE_HEADERS VARY_HEADERS
+
+// A per-user resource served by GET with ETags and the response cache
+struct resource_view {
+    enum resource resource;
+    const char *path; // For next-page links; NULL if not paged
+    int (*render)(struct app_context *ctx, int user_id, struct page *page, struct json_writer *out);
+    int error_status; // Replied with error if render fails
+    const char *error;
+};
+
+static int render_profile(struct app_context *ctx, int user_id, struct page *page, struct json_writer *out) {
+    return get_user_profile(ctx, user_id, out);
+}
+
+static const struct resource_view profile_view = {
+    RESOURCE_PROFILE, NULL, render_profile, 404, "{\"error\": \"User not found\"}\n",
+};
+static const struct resource_view cars_view = {
+    RESOURCE_CARS, "/cars", get_cars, 500, "{\"error\": \"Failed to fetch cars\"}\n",
+};
+static const struct resource_view notifications_view = {
+    RESOURCE_NOTIFICATIONS, "/notifications", get_notifications, 500,
+    "{\"error\": \"Failed to retrieve notifications\"}\n",
+};
+
+// Replies with user_id's resource (page of it, if paged), cheapest first:
+// 304 if hm's If-None-Match has the current ETag (hm may be NULL), the
+// cached rendering if it is current, or else a fresh rendering written
+// straight into nc's send buffer and then cached. The version is read
+// before anything is queried, so a change committing meanwhile can only
+// make the reply look older than it is.
+static void reply_resource(struct mg_connection *nc, struct mg_http_message *hm, struct app_context *ctx,
+                           int user_id, const struct resource_view *view, struct page *page) {
+    struct response_key key = {user_id, view->resource, page ? page->after : 0, page ? page->limit : 0};
+    unsigned long version = resource_version(user_id, view->resource);
+    enum content_encoding enc = compress_negotiate(hm);
+    char etag[64], headers[384], next[256] = "";
+    struct json_writer w;
+
+    resource_etag(user_id, view->resource, version, etag, sizeof(etag));
+    struct mg_str *inm = hm ? mg_http_get_header(hm, "If-None-Match") : NULL;
+    if (inm && (mg_strstr(*inm, mg_str(etag)) || mg_strcmp(*inm, mg_str("*")) == 0)) {
+        mg_printf(nc, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n" VARY_HEADERS REVALIDATE_HEADERS CORS_HEADERS
+                  EXPOSE_HEADERS "\r\n", etag);
+        nc->is_resp = 0; // Let Mongoose parse the next pipelined request
+        return;
+    }
+    if (response_cache_send(nc, &key, version, RESOURCE_HEADERS, etag, enc)) {
+        return;
+    }
+
+    snprintf(headers, sizeof(headers), RESOURCE_HEADERS "ETag: %s\r\n", etag);
+    size_t start = json_reply_begin(nc, 200, headers, &w);
+    int ok = view->render(ctx, user_id, page, &w);
+    if (ok && page) {
+        next_page_headers(next, sizeof(next), view->path, page);
+        if (next[0]) {
+            json_reply_header(nc, &w, next);
+        }
+    }
+    if (!ok || !json_reply_end(nc, start, &w)) {
+        json_reply_cancel(nc, start);
+        mg_http_reply(nc, view->error_status, JSON_HEADERS, "%s", view->error);
+        return;
+    }
+    const char *body = (const char *)nc->send.buf + w.body_start;
+    size_t body_len = nc->send.len - w.body_start;
+    response_cache_put(&key, version, next, body, body_len);
+
+    // Swap the plain reply for a compressed one when the client takes it
+    size_t len;
+    const void *z = enc != ENCODING_IDENTITY && compress_worthwhile(body_len) ?
+                    compress_body(enc, body, body_len, &len) : NULL;
+    if (z) {
+        response_cache_put_encoded(&key, version, enc, z, len);
+        json_reply_cancel(nc, start);
+        json_reply_body(nc, RESOURCE_HEADERS, etag, enc, next, strlen(next), z, len);
+    }
+}
+
+// Handles GET /profile
+void handle_get_profile(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    reply_resource(nc, hm, req->ctx, req->user_id, &profile_view, NULL);
+}
+
+// Finishes PUT /profile once the update has committed
+static void update_profile_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result) {
+        reply_resource(nc, NULL, ctx, job->user_id, &profile_view, NULL); // Renders and caches the new profile
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update profile\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles PUT /profile
+void handle_update_profile(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    json_t *root;
+    json_error_t error;
+
+    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+    if (!root) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        return;
+    }
+
+    const char *first_name = json_string_value(json_object_get(root, "first_name"));
+    const char *last_name = json_string_value(json_object_get(root, "last_name"));
+    const char *organization = json_string_value(json_object_get(root, "organization"));
+
+    if (!first_name || !last_name) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Missing required fields\"}\n");
+        json_decref(root);
+        return;
+    }
+
+    struct write_job *job = new_write_job(WRITE_UPDATE_PROFILE, req, root, update_profile_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update profile\"}\n");
+        json_decref(root);
+        return;
+    }
+    job->args[0] = first_name;
+    job->args[1] = last_name;
+    job->args[2] = organization ? organization : "";
+    submit_write(nc, job);
+}
+
+// Finishes DELETE /profile once the delete has committed
+static void delete_profile_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result) {
+        mg_http_reply(nc, 200, JSON_HEADERS,
+                      "{\"message\": \"Account deleted\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to delete account\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles DELETE /profile
+void handle_delete_profile(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct write_job *job = new_write_job(WRITE_DELETE_USER, req, NULL, delete_profile_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to delete account\"}\n");
+        return;
+    }
+    submit_write(nc, job);
+}
+
+// Finishes PUT /password once the new hash has committed
+static void password_written(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result) {
+        mg_http_reply(nc, 200, JSON_HEADERS,
+                      "{\"message\": \"Password updated\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update password\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Continues PUT /password once the new password is hashed: the hash is
+// written by the writer thread
+static void password_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct pwhash_job *job = (struct pwhash_job *)c;
+
+    if (nc && job->result) {
+        struct request req = {.ctx = ctx, .user_id = job->user_id};
+        struct write_job *write = new_write_job(WRITE_UPDATE_PASSWORD, &req, NULL, password_written);
+        if (write) {
+            snprintf(write->text, sizeof(write->text), "%s", job->hash);
+            submit_write(nc, write);
+        } else {
+            mg_http_reply(nc, 500, JSON_HEADERS,
+                          "{\"error\": \"Failed to update password\"}\n");
+        }
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update password\"}\n");
+    }
+
+    free_pwhash_job(job);
+}
+
+// Handles password update (PUT /password)
+void handle_update_password(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    json_t *root;
+    json_error_t error;
+
+    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+    if (!root) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        return;
+    }
+
+    const char *password = json_string_value(json_object_get(root, "password"));
+    if (!password) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Missing password\"}\n");
+        json_decref(root);
+        return;
+    }
+
+    struct pwhash_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update password\"}\n");
+        json_decref(root);
+        return;
+    }
+    job->op = PWHASH_HASH;
+    job->password = password;
+    job->user_id = req->user_id;
+    job->data = root;
+    job->base.fn = password_done;
+    if (!submit_pwhash(nc, job, req->ctx)) {
+        free_pwhash_job(job);
+    }
+}
+
+// Finishes PUT /email once the update has committed
+static void update_email_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result == 1) {
+        reply_resource(nc, NULL, ctx, job->user_id, &profile_view, NULL); // Renders and caches the new profile
+    } else if (nc && job->result == -1) {
+        mg_http_reply(nc, 409, JSON_HEADERS,
+                      "{\"error\": \"Email already in use\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update email\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles email update (PUT /email)
+void handle_update_email(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    json_t *root;
+    json_error_t error;
+
+    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+    if (!root) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        return;
+    }
+
+    const char *email = json_string_value(json_object_get(root, "email"));
+    if (!email) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Missing email\"}\n");
+        json_decref(root);
+        return;
+    }
+
+    struct write_job *job = new_write_job(WRITE_UPDATE_EMAIL, req, root, update_email_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update email\"}\n");
+        json_decref(root);
+        return;
+    }
+    job->args[0] = email;
+    submit_write(nc, job);
+}
+
+// Handles GET /cars
+void handle_get_cars(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct page page;
+    if (parse_page(nc, hm, &page)) {
+        reply_resource(nc, hm, req->ctx, req->user_id, &cars_view, &page);
+    }
+}
+
+// Finishes POST /cars once the car is committed
+static void add_car_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result == 1) {
+        struct json_writer w;
+        size_t start = json_reply_begin(nc, 201, JSON_HEADERS, &w);
+        jw_begin_object(&w);
+        jw_key(&w, "id");
+        jw_int(&w, job->rowid);
+        jw_key(&w, "car_name");
+        jw_string(&w, job->args[0]);
+        jw_key(&w, "year_of_manufacture");
+        jw_string(&w, job->args[1]);
+        jw_key(&w, "car_value");
+        jw_string(&w, job->args[2]);
+        jw_key(&w, "photo");
+        jw_string(&w, job->text);
+        jw_end_object(&w);
+        if (!json_reply_end(nc, start, &w)) {
+            mg_http_reply(nc, 500, JSON_HEADERS,
+                          "{\"error\": \"Failed to add car\"}\n");
+        }
+    } else if (nc && job->result == -1) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid photo\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to add car\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles POST /cars
+void handle_add_car(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    json_t *root;
+    json_error_t error;
+
+    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+    if (!root) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        return;
+    }
+
+    const char *car_name = json_string_value(json_object_get(root, "car_name"));
+    const char *year_of_manufacture = json_string_value(json_object_get(root, "year_of_manufacture"));
+    const char *car_value = json_string_value(json_object_get(root, "car_value"));
+    const char *photo = json_string_value(json_object_get(root, "photo"));
+
+    if (!car_name || !year_of_manufacture || !car_value) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Missing fields\"}\n");
+        json_decref(root);
+        return;
+    }
+
+    struct write_job *job = new_write_job(WRITE_ADD_CAR, req, root, add_car_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to add car\"}\n");
+        json_decref(root);
+        return;
+    }
+    job->args[0] = car_name;
+    job->args[1] = year_of_manufacture;
+    job->args[2] = car_value;
+    job->args[3] = photo; // The writer stores photo data; the row keeps its link
+    submit_write(nc, job);
+}
+
+// Largest POST /cars/batch, set by init_routes
+static int car_batch_max = 5000;
+
+// Splits a POST /cars/batch body into its values one at a time, so each
+// row is parsed on its own and a bad row does not reject the rest
+struct batch_scan {
+    const char *p, *end;
+    int array; // Body is a JSON array rather than NDJSON
+    int done;  // Closing ']' seen
+};
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+    return p;
+}
+
+// Finds the extent of the next value. Returns 1 with *start and *len set,
+// 0 at the end of the body, -1 if the body is cut short or malformed.
+static int next_batch_value(struct batch_scan *s, const char **start, size_t *len) {
+    const char *p = skip_space(s->p, s->end);
+    if (s->array && !s->done && p < s->end && *p == ']') {
+        s->done = 1; // Empty array
+        p++;
+    }
+    if (s->done || p == s->end) {
+        s->p = skip_space(p, s->end);
+        return s->p == s->end && s->array == s->done ? 0 : -1;
+    }
+
+    const char *q = p;
+    int depth = 0, in_string = 0;
+    for (; q < s->end; q++) {
+        char c = *q;
+        if (in_string) {
+            if (c == '\\') {
+                q++;
+            } else if (c == '"') {
+                in_string = 0;
+                if (depth == 0) {
+                    q++;
+                    break;
+                }
+            }
+        } else if (c == '"') {
+            in_string = 1;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) {
+                break;
+            }
+            if (--depth == 0) {
+                q++;
+                break;
+            }
+        } else if (depth == 0 && (c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+            break;
+        }
+    }
+    if (in_string || depth > 0 || q == p) {
+        return -1;
+    }
+    *start = p;
+    *len = (size_t)(q - p);
+
+    // Array elements are separated by ',' and closed by ']'
+    q = skip_space(q, s->end);
+    if (s->array) {
+        if (q < s->end && *q == ',') {
+            q++;
+        } else if (q < s->end && *q == ']') {
+            s->done = 1;
+            q++;
+        } else {
+            return -1;
+        }
+    }
+    s->p = q;
+    return 1;
+}
+
+// Checks one parsed row. Returns NULL if it can be inserted, else why not.
+// Its photo is stored by the writer, once every row has been checked.
+static const char *check_batch_row(json_t *row) {
+    if (!json_is_object(row)) {
+        return "Not an object";
+    }
+    if (!json_string_value(json_object_get(row, "car_name")) ||
+        !json_string_value(json_object_get(row, "year_of_manufacture")) ||
+        !json_string_value(json_object_get(row, "car_value"))) {
+        return "Missing fields";
+    }
+    return NULL;
+}
+
+// Replies with the id of each row (null if it was not inserted) and the
+// errors of the rows that were not, in request order
+static void reply_car_batch(struct mg_connection *nc, int status, const struct car_batch *batch,
+                            int total, json_t *errors) {
+    struct json_writer w;
+    size_t start = json_reply_begin(nc, status, JSON_HEADERS, &w);
+    int inserted = 0, r = 0;
+    size_t e = 0;
+
+    jw_begin_object(&w);
+    jw_key(&w, "ids");
+    jw_begin_array(&w);
+    for (int i = 0; i < total; i++) {
+        if (batch && r < batch->count && batch->rows[r].index == i && batch->rows[r].id > 0) {
+            jw_int(&w, batch->rows[r].id);
+            inserted++;
+        } else {
+            jw_raw(&w, "null", 4);
+        }
+        if (batch && r < batch->count && batch->rows[r].index == i) {
+            r++;
+        }
+    }
+    jw_end_array(&w);
+    jw_key(&w, "inserted");
+    jw_int(&w, inserted);
+    jw_key(&w, "errors");
+    jw_begin_array(&w);
+    r = 0;
+    for (int i = 0; i < total; i++) {
+        const char *error = NULL;
+        json_t *invalid = json_array_get(errors, e);
+        if (invalid && json_integer_value(json_object_get(invalid, "index")) == i) {
+            error = json_string_value(json_object_get(invalid, "error"));
+            e++;
+        } else if (batch && r < batch->count && batch->rows[r].index == i) {
+            if (batch->rows[r].id == -1) {
+                error = "Invalid photo";
+            } else if (batch->rows[r].id <= 0) {
+                error = "Failed to add car";
+            }
+            r++;
+        }
+        if (error) {
+            jw_begin_object(&w);
+            jw_key(&w, "index");
+            jw_int(&w, i);
+            jw_key(&w, "error");
+            jw_string(&w, error);
+            jw_end_object(&w);
+        }
+    }
+    jw_end_array(&w);
+    jw_end_object(&w);
+    if (!json_reply_end(nc, start, &w)) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to add cars\"}\n");
+    }
+}
+
+// Finishes POST /cars/batch once its rows are committed
+static void add_cars_batch_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+    struct car_batch *batch = job->owned;
+    int failed = 0;
+
+    for (int i = 0; i < batch->count; i++) {
+        failed += batch->rows[i].id == 0;
+    }
+    // Nothing inserted only because every photo was invalid is a bad request
+    if (nc && job->result && (job->count > 0 || !failed)) {
+        reply_car_batch(nc, job->count > 0 ? 201 : 400, batch, batch->total,
+                        json_object_get(job->data, "errors"));
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to add cars\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles POST /cars/batch: a JSON array of cars, or one car per line
+// (NDJSON). Valid rows are inserted together in one transaction; the reply
+// lists the id of each row and why any were rejected.
+void handle_add_cars_batch(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct batch_scan scan = {hm->body.buf, hm->body.buf + hm->body.len, 0, 0};
+    struct car_batch *batch = NULL;
+    int capacity = 0, total = 0, rc;
+    const char *start;
+    size_t len;
+
+    scan.p = skip_space(scan.p, scan.end);
+    if (scan.p < scan.end && *scan.p == '[') {
+        scan.array = 1;
+        scan.p++;
+    }
+
+    // data keeps the parsed rows alive for the job; the rows point into it
+    json_t *data = json_pack("{s:[],s:[]}", "rows", "errors");
+    if (!data) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to add cars\"}\n");
+        return;
+    }
+    json_t *rows = json_object_get(data, "rows");
+    json_t *errors = json_object_get(data, "errors");
+
+    while ((rc = next_batch_value(&scan, &start, &len)) > 0) {
+        if (++total > car_batch_max) {
+            mg_http_reply(nc, 413, JSON_HEADERS,
+                          "{\"error\": \"Too many cars, at most %d per batch\"}\n", car_batch_max);
+            goto done;
+        }
+
+        json_t *row = json_loadb(start, len, 0, NULL);
+        const char *error = row ? check_batch_row(row) : "Invalid JSON";
+        if (error) {
+            json_array_append_new(errors, json_pack("{s:i,s:s}", "index", total - 1, "error", error));
+            json_decref(row);
+            continue;
+        }
+        json_array_append_new(rows, row);
+
+        if (!batch || batch->count == capacity) {
+            int grown = capacity ? capacity * 2 : 64;
+            struct car_batch *bigger = realloc(batch, sizeof(*batch) + grown * sizeof(batch->rows[0]));
+            if (!bigger) {
+                mg_http_reply(nc, 500, JSON_HEADERS,
+                              "{\"error\": \"Failed to add cars\"}\n");
+                goto done;
+            }
+            if (!batch) {
+                bigger->count = 0;
+            }
+            batch = bigger;
+            capacity = grown;
+        }
+        struct car_batch_row *r = &batch->rows[batch->count++];
+        r->index = total - 1;
+        r->car_name = json_string_value(json_object_get(row, "car_name"));
+        r->year_of_manufacture = json_string_value(json_object_get(row, "year_of_manufacture"));
+        r->car_value = json_string_value(json_object_get(row, "car_value"));
+        r->photo = json_string_value(json_object_get(row, "photo"));
+        r->id = 0;
+    }
+
+    if (rc < 0) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        goto done;
+    }
+    if (total == 0) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"No cars\"}\n");
+        goto done;
+    }
+    if (!batch) {
+        reply_car_batch(nc, 400, NULL, total, errors); // Nothing to insert
+        goto done;
+    }
+
+    batch->total = total;
+    struct write_job *job = new_write_job(WRITE_ADD_CARS, req, data, add_cars_batch_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to add cars\"}\n");
+        goto done;
+    }
+    job->owned = batch;
+    submit_write(nc, job);
+    return;
+
+done:
+    free(batch);
+    json_decref(data);
+}
+
+// Finishes DELETE /cars/:id once the delete has committed
+static void delete_car_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result) {
+        mg_http_reply(nc, 200, JSON_HEADERS,
+                      "{\"message\": \"Car deleted\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 404, JSON_HEADERS,
+                      "{\"error\": \"Car not found or unauthorized\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles DELETE /cars/:id
+void handle_delete_car(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    long long car_id = req->params[0].num;
+    if (car_id <= 0 || car_id > INT_MAX) {
+        mg_http_reply(nc, 404, JSON_HEADERS,
+                      "{\"error\": \"Car not found or unauthorized\"}\n");
+        return;
+    }
+    struct write_job *job = new_write_job(WRITE_DELETE_CAR, req, NULL, delete_car_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to delete car\"}\n");
+        return;
+    }
+    job->target = (int)car_id;
+    submit_write(nc, job);
+}
+
+// Finishes PUT /cars/:id/photo once the new link has committed
+static void set_car_photo_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result) {
+        struct json_writer w;
+        size_t start = json_reply_begin(nc, 200, JSON_HEADERS, &w);
+        jw_begin_object(&w);
+        jw_key(&w, "id");
+        jw_int(&w, job->target);
+        jw_key(&w, "photo");
+        jw_string(&w, job->text);
+        jw_end_object(&w);
+        if (!json_reply_end(nc, start, &w)) {
+            mg_http_reply(nc, 500, JSON_HEADERS,
+                          "{\"error\": \"Failed to update car\"}\n");
+        }
+    } else if (nc) {
+        mg_http_reply(nc, 404, JSON_HEADERS,
+                      "{\"error\": \"Car not found or unauthorized\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Finishes PUT /cars/:id/photo once the photo is stored: the row is
+// updated by the writer thread, like every other write
+static void upload_car_photo_done(struct mg_connection *nc, const char *hash, int user_id, int car_id) {
+    struct request req = {.ctx = (struct app_context *)nc->fn_data, .user_id = user_id};
+
+    struct write_job *job = new_write_job(WRITE_SET_CAR_PHOTO, &req, NULL, set_car_photo_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update car\"}\n");
+        return;
+    }
+    job->target = car_id;
+    snprintf(job->text, sizeof(job->text), PHOTO_URL_PREFIX "%s", hash);
+    submit_write(nc, job);
+}
+
+// Handles PUT /cars/:id/photo. The body is the image (or its base64 with
+// ?encoding=base64) and is streamed to the photo store as it arrives.
+void handle_upload_car_photo(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    long long car_id = req->params[0].num;
+    if (car_id <= 0 || car_id > INT_MAX || !car_exists(req->ctx, req->user_id, (int)car_id)) {
+        mg_http_reply(nc, 404, JSON_HEADERS,
+                      "{\"error\": \"Car not found or unauthorized\"}\n");
+        return;
+    }
+    photo_upload_begin(nc, hm, req->user_id, (int)car_id, upload_car_photo_done);
+}
+
+// Handles GET /photos/:hash. Public: image tags cannot send a bearer token,
+// and a photo can only be fetched by knowing its content hash.
+void handle_get_photo(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    photo_serve(nc, hm, req->params[0].str);
+}
+
+// Finishes POST /notifications once the notification is committed. The
+// writer thread has already pushed it to the recipient's open streams.
+static void send_notification_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result) {
+        mg_http_reply(nc, 200, JSON_HEADERS,
+                      "{\"message\": \"Notification sent\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to send notification\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles POST /notifications
+void handle_send_notification(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    json_t *root;
+    json_error_t error;
+    root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+    if (!root) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid JSON\"}\n");
+        return;
+    }
+
+    const char *message = json_string_value(json_object_get(root, "message"));
+    json_t *receiver_id_json = json_object_get(root, "receiver_id");
+    if (!message || !json_is_integer(receiver_id_json)) {
+        json_decref(root);
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Missing or invalid message or receiver_id\"}\n");
+        return;
+    }
+
+    struct write_job *job = new_write_job(WRITE_SEND_NOTIFICATION, req, root, send_notification_done);
+    if (!job) {
+        json_decref(root);
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to send notification\"}\n");
+        return;
+    }
+    job->target = json_integer_value(receiver_id_json);
+    job->args[0] = message;
+    submit_write(nc, job);
+}
+
+// Handles GET /notifications
+void handle_get_notifications(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct page page;
+    if (parse_page(nc, hm, &page)) {
+        reply_resource(nc, hm, req->ctx, req->user_id, &notifications_view, &page);
+    }
+}
+
+// Notification ids accepted by one bulk mark-read request at most
+#define BULK_IDS_MAX 1000
+
+// Finishes the bulk notification writes once committed, replying with the
+// number of notifications changed under key
+static void bulk_notifications_done(struct mg_connection *nc, struct write_job *job, const char *key) {
+    if (nc && job->result) {
+        mg_http_reply(nc, 200, JSON_HEADERS, "{\"%s\": %lld}\n", key, job->count);
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update notifications\"}\n");
+    }
+    free_write_job(job);
+}
+
+static void mark_read_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    bulk_notifications_done(nc, (struct write_job *)c, "updated");
+}
+
+static void delete_read_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    bulk_notifications_done(nc, (struct write_job *)c, "deleted");
+}
+
+// Handles POST /notifications/mark_read: marks many notifications read in
+// one statement. The body picks which: {"ids": [1, 2, 3]}, {"up_to": 42}
+// (every one up to that id), or {"all": true} (also an empty body).
+void handle_mark_notifications_read(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    json_t *root = NULL, *ids = NULL, *up_to = NULL;
+    json_error_t error;
+
+    if (hm->body.len > 0) {
+        root = json_loadb(hm->body.buf, hm->body.len, 0, &error);
+        if (!json_is_object(root)) {
+            mg_http_reply(nc, 400, JSON_HEADERS,
+                          "{\"error\": \"Invalid JSON\"}\n");
+            json_decref(root);
+            return;
+        }
+        ids = json_object_get(root, "ids");
+        up_to = json_object_get(root, "up_to");
+        if (!ids && !up_to && !json_is_true(json_object_get(root, "all"))) {
+            mg_http_reply(nc, 400, JSON_HEADERS,
+                          "{\"error\": \"Expected ids, up_to or all\"}\n");
+            json_decref(root);
+            return;
+        }
+    }
+
+    int valid = 1;
+    if (ids) {
+        size_t i;
+        json_t *id;
+        valid = json_is_array(ids) && json_array_size(ids) <= BULK_IDS_MAX;
+        json_array_foreach(ids, i, id) {
+            valid = valid && json_is_integer(id) && json_integer_value(id) > 0;
+        }
+    } else if (up_to) {
+        valid = json_is_integer(up_to) && json_integer_value(up_to) > 0;
+    }
+    if (!valid) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"ids must be at most %d positive integers, up_to a positive integer\"}\n",
+                      BULK_IDS_MAX);
+        json_decref(root);
+        return;
+    }
+
+    struct write_job *job = new_write_job(ids ? WRITE_MARK_READ_IDS : WRITE_MARK_READ_UP_TO, req, NULL, mark_read_done);
+    if (job) {
+        job->up_to = up_to ? json_integer_value(up_to) : LLONG_MAX;
+        job->owned = ids ? json_dumps(ids, JSON_COMPACT) : NULL; // Read by SQLite's json_each
+    }
+    json_decref(root);
+    if (!job || (ids && !job->owned)) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update notifications\"}\n");
+        if (job) {
+            free_write_job(job);
+        }
+        return;
+    }
+    submit_write(nc, job);
+}
+
+// Handles DELETE /notifications/read: deletes every read notification
+void handle_delete_read_notifications(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    struct write_job *job = new_write_job(WRITE_DELETE_READ_NOTIFICATIONS, req, NULL, delete_read_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to update notifications\"}\n");
+        return;
+    }
+    submit_write(nc, job);
+}
+
+// Handles GET /notifications/unread_count
+void handle_get_unread_count(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    long long count = get_unread_count(req->ctx, req->user_id);
+    if (count < 0) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to count notifications\"}\n");
+        return;
+    }
+    mg_http_reply(nc, 200, JSON_HEADERS, "{\"unread\": %lld}\n", count);
+}
+
+// Handles POST /notifications/stream/ticket: a single-use ticket to open
+// one stream within SSE_TICKET_TTL_S, for clients that cannot send the
+// Authorization header there
+void handle_notification_stream_ticket(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    char ticket[SSE_TICKET_HEX + 1];
+
+    sse_ticket_issue(req->user_id, ticket);
+    mg_http_reply(nc, 200, JSON_HEADERS,
+                  "{\"ticket\": \"%s\", \"expires_in\": %d}\n", ticket, SSE_TICKET_TTL_S);
+}
+
+// Handles GET /notifications/stream: new notifications as Server-Sent
+// Events. EventSource cannot set headers, so instead of the token it may
+// pass a ticket from POST /notifications/stream/ticket as ?ticket=. A
+// reconnecting client resumes after its Last-Event-ID header (or
+// ?last_event_id=).
+void handle_notification_stream(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    char ticket[SSE_TICKET_HEX + 2], last[32];
+    int user_id;
+
+    if (!mg_http_get_header(hm, "Authorization") &&
+        mg_http_get_var(&hm->query, "ticket", ticket, sizeof(ticket)) > 0) {
+        user_id = sse_ticket_redeem(ticket);
+        if (user_id <= 0) {
+            mg_http_reply(nc, 401, JSON_HEADERS,
+                          "{\"error\": \"Invalid or expired ticket\"}\n");
+            return;
+        }
+    } else {
+        user_id = get_user_id_from_token(nc, hm, req->ctx);
+        if (user_id <= 0) {
+            return; // Response already sent in get_user_id_from_token
+        }
+    }
+
+    long long last_id = 0;
+    struct mg_str *last_event_id = mg_http_get_header(hm, "Last-Event-ID");
+    if (last_event_id && last_event_id->len < sizeof(last)) {
+        memcpy(last, last_event_id->buf, last_event_id->len);
+        last[last_event_id->len] = '\0';
+        last_id = strtoll(last, NULL, 10);
+    } else if (mg_http_get_var(&hm->query, "last_event_id", last, sizeof(last)) > 0) {
+        last_id = strtoll(last, NULL, 10);
+    }
+    sse_subscribe(nc, req->ctx, user_id, last_id > 0 ? last_id : 0);
+}
+
+// Finishes POST /notifications/:id/mark_read once the update has committed
+static void mark_notification_read_done(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct write_job *job = (struct write_job *)c;
+
+    if (nc && job->result) {
+        mg_http_reply(nc, 200, JSON_HEADERS,
+                      "{\"message\": \"Notification marked as read\"}\n");
+    } else if (nc) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to mark notification as read\"}\n");
+    }
+
+    free_write_job(job);
+}
+
+// Handles POST /notifications/:id/mark_read
+void handle_mark_notification_read(struct mg_connection *nc, struct mg_http_message *hm, struct request *req) {
+    long long notification_id = req->params[0].num;
+    if (notification_id <= 0 || notification_id > INT_MAX) {
+        mg_http_reply(nc, 400, JSON_HEADERS,
+                      "{\"error\": \"Invalid notification ID\"}\n");
+        return;
+    }
+    struct write_job *job = new_write_job(WRITE_MARK_NOTIFICATION_READ, req, NULL, mark_notification_read_done);
+    if (!job) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to mark notification as read\"}\n");
+        return;
+    }
+    job->target = (int)notification_id;
+    submit_write(nc, job);
+}
+
+// Every endpoint. OPTIONS, 404 and 405 are answered by the router.
+static const struct route routes[] = {
+    {ROUTE_POST, "/register", handle_register, 0},
+    {ROUTE_POST, "/login", handle_login, 0},
+    {ROUTE_GET, "/profile", handle_get_profile, ROUTE_AUTH},
+    {ROUTE_PUT, "/profile", handle_update_profile, ROUTE_AUTH},
+    {ROUTE_DELETE, "/profile", handle_delete_profile, ROUTE_AUTH},
+    {ROUTE_PUT, "/password", handle_update_password, ROUTE_AUTH},
+    {ROUTE_PUT, "/email", handle_update_email, ROUTE_AUTH},
+    {ROUTE_GET, "/cars", handle_get_cars, ROUTE_AUTH},
+    {ROUTE_POST, "/cars", handle_add_car, ROUTE_AUTH},
+    {ROUTE_POST, "/cars/batch", handle_add_cars_batch, ROUTE_AUTH},
+    {ROUTE_DELETE, "/cars/{int}", handle_delete_car, ROUTE_AUTH},
+    {ROUTE_PUT, "/cars/{int}/photo", handle_upload_car_photo, ROUTE_AUTH | ROUTE_STREAM},
+    {ROUTE_GET, "/photos/{str}", handle_get_photo, 0},
+    {ROUTE_GET, "/notifications", handle_get_notifications, ROUTE_AUTH},
+    {ROUTE_POST, "/notifications", handle_send_notification, ROUTE_AUTH},
+    {ROUTE_POST, "/notifications/mark_read", handle_mark_notifications_read, ROUTE_AUTH},
+    {ROUTE_DELETE, "/notifications/read", handle_delete_read_notifications, ROUTE_AUTH},
+    {ROUTE_GET, "/notifications/unread_count", handle_get_unread_count, ROUTE_AUTH},
+    {ROUTE_GET, "/notifications/stream", handle_notification_stream, 0}, // Authenticates itself
+    {ROUTE_POST, "/notifications/stream/ticket", handle_notification_stream_ticket, ROUTE_AUTH},
+    {ROUTE_POST, "/notifications/{int}/mark_read", handle_mark_notification_read, ROUTE_AUTH},
+    {ROUTE_GET, "/metrics", handle_metrics, 0},
+};
+
+// Compiles the route table; call once before any event loop starts
+int init_routes(int batch_max) {
+    int count = (int)(sizeof(routes) / sizeof(routes[0]));
+    car_batch_max = batch_max;
+    return router_init(routes, count) && metrics_init(routes, count);
+}
@@ -4,95 +4,378 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sqlite3.h>
 #include "mongoose.h"
 #include "app.h"
 
-// Declare the global app context
-struct app_context app_ctx;
+#define DB_PATH "drivehub.db"
+#define PHOTO_DIR "photos"
+#define LISTEN_HOST "127.0.0.1" // Both listening modes bind this IPv4 address
+#define LISTEN_PORT 5555
+#define MAX_WORKERS 64
 
-// Initialize the database schema
-static int init_database() {
-    if (!init_db(app_ctx.db)) {
-        fprintf(stderr, "Failed to initialize database\n");
-        return 0;
+// One event loop with its own Mongoose manager, listening socket, SQLite
+// connection and prepared statements. The context is what handlers get.
+struct reactor {
+    pthread_t thread;
+    struct mg_mgr mgr;
+    struct app_context ctx;
+};
+
+static struct reactor reactors[MAX_WORKERS];
+static int num_reactors;
+
+// Set from the command line (--db, --port)
+static const char *db_path = DB_PATH;
+static int listen_port = LISTEN_PORT;
+static char listen_url[64];
+
+// Set by the signal handler to stop the event loop
+static volatile sig_atomic_t s_signo;
+
+static void signal_handler(int signo) {
+    s_signo = signo;
+}
+
+// Hands a finished completion back to ctx's event loop. Safe to call from
+// any thread; wakes the loop so it does not wait out its poll timeout.
+void complete_on_loop(struct app_context *ctx, struct completion *c) {
+    pthread_mutex_lock(&ctx->done_lock);
+    c->next = NULL;
+    if (ctx->done_tail) {
+        ctx->done_tail->next = c;
+    } else {
+        ctx->done_head = c;
     }
-    return 1;
+    ctx->done_tail = c;
+    pthread_mutex_unlock(&ctx->done_lock);
+
+    mg_wakeup(ctx->mgr, c->conn_id, "", 0);
+}
+
+// Runs the completions queued for ctx's event loop. Must be called from the
+// loop thread, between polls.
+void drain_completions(struct app_context *ctx) {
+    pthread_mutex_lock(&ctx->done_lock);
+    struct completion *c = ctx->done_head;
+    ctx->done_head = ctx->done_tail = NULL;
+    pthread_mutex_unlock(&ctx->done_lock);
+
+    while (c) {
+        struct completion *next = c->next;
+        struct mg_connection *nc = NULL;
+        for (struct mg_connection *it = ctx->mgr->conns; it && c->conn_id; it = it->next) {
+            if (it->id == c->conn_id && !it->is_closing) {
+                nc = it;
+                break;
+            }
+        }
+        if (nc) {
+            nc->is_resp = 0; // Let Mongoose parse the next pipelined request,
+        }                    // unless fn queues more work for this one
+        size_t mark = nc ? nc->send.len : 0;
+        c->fn(nc, c, ctx);
+        if (nc) {
+            metrics_request_end(nc, mark); // nc is still open: fn does not close it
+        }
+        c = next;
+    }
+}
+
+// Reads a positive integer from the environment, or returns def
+static long env_long(const char *name, long def) {
+    const char *value = getenv(name);
+    long n = value ? strtol(value, NULL, 10) : 0;
+    return n > 0 ? n : def;
+}
+
+// Like env_long, but 0 is a setting of its own (usually "off")
+static long env_long_or_zero(const char *name, long def) {
+    const char *value = getenv(name);
+    long n = value ? strtol(value, NULL, 10) : -1;
+    return n >= 0 ? n : def;
 }
 
 // Event handler
 static void event_handler(struct mg_connection *nc, int ev, void *ev_data) {
     struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+    struct app_context *ctx = (struct app_context *)nc->fn_data;
+    size_t mark = nc->send.len; // A reply written from here on ends the request
 
-    if (ev == MG_EV_HTTP_MSG) {
-        if (mg_match(hm->uri, mg_str("/profile"), NULL)) {
-            handle_profile(nc, hm, &app_ctx);
-        } else if (mg_match(hm->uri, mg_str("/register"), NULL)) {
-            if (mg_match(hm->method, mg_str("POST"), NULL)) {
-                handle_register(nc, hm, &app_ctx);
-            } else if (mg_match(hm->method, mg_str("OPTIONS"), NULL)) {
-                handle_options(nc, hm, &app_ctx);
-            } else {
-                mg_http_reply(nc, 405, "Content-Type: text/plain\r\n", "Method Not Allowed\n");
-            }
-        } else if (mg_match(hm->uri, mg_str("/login"), NULL)) {
-            if (mg_match(hm->method, mg_str("POST"), NULL)) {
-                handle_login(nc, hm, &app_ctx);
-            } else if (mg_match(hm->method, mg_str("OPTIONS"), NULL)) {
-                handle_options(nc, hm, &app_ctx);
-            } else {
-                mg_http_reply(nc, 405, "Content-Type: text/plain\r\n", "Method Not Allowed\n");
-            }
-        } else if (mg_match(hm->uri, mg_str("/password"), NULL)) {
-            handle_password(nc, hm, &app_ctx);
-        } else if (mg_match(hm->uri, mg_str("/email"), NULL)) {
-            handle_email(nc, hm, &app_ctx);
-        } else if (mg_match(hm->uri, mg_str("/cars*"), NULL)) {
-            handle_cars(nc, hm, &app_ctx);
-        } else if (mg_match(hm->uri, mg_str("/notifications*"), NULL)) {
-            handle_notifications(nc, hm, &app_ctx);
-        } else {
-            mg_http_reply(nc, 404, "Content-Type: text/plain\r\n", "Not Found\n");
+    if (ev == MG_EV_HTTP_HDRS) {
+        router_dispatch_headers(nc, hm, ctx);
+        metrics_request_end(nc, mark);
+    } else if (ev == MG_EV_HTTP_MSG) {
+        router_dispatch(nc, hm, ctx);
+        metrics_request_end(nc, mark);
+    } else if (ev == MG_EV_READ) {
+        metrics_bytes(*(long *)ev_data, 0);
+        photo_upload_continue(nc);
+        metrics_request_end(nc, mark);
+        sse_read(nc);
+    } else if (ev == MG_EV_POLL) {
+        photo_transfer_continue(nc);
+        sse_poll(nc);
+    } else if (ev == MG_EV_WRITE) {
+        metrics_bytes(0, *(long *)ev_data);
+        photo_transfer_continue(nc);
+    } else if (ev == MG_EV_ACCEPT) {
+        metrics_connection(1);
+    } else if (ev == MG_EV_CLOSE) {
+        if (nc->is_accepted) {
+            metrics_connection(0);
         }
+        photo_transfer_close(nc);
+        sse_close(nc);
+    }
+}
+
+// Opens a listening socket on listen_port that every reactor can bind at
+// once; the kernel spreads incoming connections across them
+static int open_reuseport_socket(void) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)listen_port);
+    inet_pton(AF_INET, LISTEN_HOST, &addr.sin_addr);
+
+#ifndef SO_REUSEPORT
+    close(fd);
+    return -1;
+#else
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+// Swapping a listener's socket only works while Mongoose polls c->fd anew
+// on every iteration; with epoll the old socket stays registered instead
+#if MG_ENABLE_EPOLL
+#error "--workers swaps listening sockets, which needs Mongoose's poll()-based IO; build without MG_ENABLE_EPOLL"
+#endif
+
+// Sets up a reactor's HTTP listener. Mongoose cannot set SO_REUSEPORT, so
+// with several reactors each one lets Mongoose open a throwaway listener
+// (to get its HTTP protocol handler) and swaps our shared-port socket in.
+static struct mg_connection *listen_reactor(struct reactor *r, int shared) {
+    if (!shared) {
+        return mg_http_listen(&r->mgr, listen_url, event_handler, &r->ctx);
+    }
+
+    int fd = open_reuseport_socket();
+    if (fd < 0) {
+        log_error("Cannot listen on port %d with SO_REUSEPORT", listen_port);
+        return NULL;
+    }
+    struct mg_connection *nc = mg_http_listen(&r->mgr, "http://" LISTEN_HOST ":0", event_handler, &r->ctx);
+    if (!nc) {
+        close(fd);
+        return NULL;
+    }
+    close((int)(size_t)nc->fd);
+    nc->fd = (void *)(size_t)fd;
+    nc->loc.port = htons((uint16_t)listen_port); // Mongoose recorded the throwaway port
+    return nc;
+}
+
+// Prepares reactor r: database connection, statements, manager, listener
+static int init_reactor(struct reactor *r, const char *jwt_secret) {
+    r->ctx.jwt_secret = jwt_secret;
+    jwt_hs256_key_init(&r->ctx.jwt_key, jwt_secret);
+    pthread_mutex_init(&r->ctx.done_lock, NULL);
+    mg_mgr_init(&r->mgr);
+    r->ctx.mgr = &r->mgr;
+
+    if (!open_db(&r->ctx, db_path) || !prepare_statements(&r->ctx)) {
+        log_error("Failed to prepare database connection");
+        return 0;
+    }
+    if (!mg_wakeup_init(&r->mgr)) {
+        log_error("Failed to set up event loop wakeups");
+        return 0;
+    }
+    if (!listen_reactor(r, num_reactors > 1)) {
+        log_error("Error setting up listener!");
+        return 0;
+    }
+    return 1;
+}
+
+static void free_reactor(struct reactor *r) {
+    mg_mgr_free(&r->mgr);
+    if (r->ctx.db) {
+        close_db(&r->ctx);
     }
 }
 
+static void *run_reactor(void *arg) {
+    struct reactor *r = arg;
+    while (s_signo == 0) {
+        mg_mgr_poll(&r->mgr, 1000);  // Poll for events every 1000 milliseconds
+        drain_completions(&r->ctx);
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
-    struct mg_mgr mgr;
+    const char *jwt_secret = getenv("JWT_SECRET") ? getenv("JWT_SECRET") : "your-secure-jwt-secret-key-1234567890";
+    int initialized = 0, started = 0, status = 1, rebuild_counters = 0;
 
-    // Initialize app context
-    app_ctx.jwt_secret = getenv("JWT_SECRET") ? getenv("JWT_SECRET") : "your-secure-jwt-secret-key-1234567890";
-    if (sqlite3_open("drivehub.db", &app_ctx.db) != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(app_ctx.db));
+    num_reactors = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            num_reactors = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+            db_path = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            listen_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rebuild-counters") == 0) {
+            rebuild_counters = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--workers N] [--db PATH] [--port N] [--rebuild-counters]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (num_reactors < 1 || num_reactors > MAX_WORKERS) {
+        fprintf(stderr, "--workers must be between 1 and %d\n", MAX_WORKERS);
+        return 1;
+    }
+    if (listen_port < 1 || listen_port > 65535) {
+        fprintf(stderr, "--port must be between 1 and 65535\n");
         return 1;
     }
+    snprintf(listen_url, sizeof(listen_url), "http://" LISTEN_HOST ":%d", listen_port);
 
-    if (!init_database()) {
-        fprintf(stderr, "Failed to initialize database schema\n");
-        sqlite3_close(app_ctx.db);
+    // LOG_LEVEL is error, warn, info (the default) or debug; LOG_FORMAT=json
+    // writes JSON lines instead of key=value ones
+    int log_level = log_parse_level(getenv("LOG_LEVEL") ? getenv("LOG_LEVEL") : "info");
+    if (log_level < 0) {
+        fprintf(stderr, "LOG_LEVEL must be error, warn, info or debug\n");
         return 1;
     }
+    if (!log_start(log_level, getenv("LOG_FORMAT") && strcmp(getenv("LOG_FORMAT"), "json") == 0)) {
+        return 1;
+    }
+    atexit(log_stop); // Writes out what is still queued on every exit path
 
-    mg_mgr_init(&mgr);  // Initialize the manager
+    versions_init();
+    response_cache_init((size_t)env_long_or_zero("RESPONSE_CACHE_MB", 64) << 20);
+    compress_init((int)env_long_or_zero("COMPRESSION_LEVEL", 6), (size_t)env_long("COMPRESSION_MIN_BYTES", 1024));
+    if (!photo_store_init(PHOTO_DIR, (size_t)env_long("PHOTO_MAX_MB", 10) << 20)) {
+        return 1;
+    }
 
-    // Set up the HTTP listener for the server
-    struct mg_connection *nc = mg_http_listen(&mgr, "http://localhost:5555", event_handler, NULL);
-    if (!nc) {
-        fprintf(stderr, "Error setting up listener!\n");
-        sqlite3_close(app_ctx.db);
+    // Migrate the schema once, before any reactor prepares statements on it
+    struct app_context setup = {0};
+    if (!open_db(&setup, db_path) || !migrate_db(setup.db) ||
+        (rebuild_counters && !rebuild_unread_counts(setup.db)) || !email_index_load(setup.db)) {
+        log_error("Failed to initialize database schema");
+        sqlite3_close(setup.db);
         return 1;
     }
+    sqlite3_close(setup.db);
 
-    printf("Starting Mongoose web server on http://localhost:5555\n");
-    
-    // Main event loop
-    for (;;) {
-        mg_mgr_poll(&mgr, 1000);  // Poll for events every 1000 milliseconds
+    if (!init_routes((int)env_long("CARS_BATCH_MAX", 5000))) {
+        return 1;
     }
 
-    // Free Mongoose manager and close database
-    mg_mgr_free(&mgr);
-    close_db(app_ctx.db);
+    // /metrics is served only to scrapers sending METRICS_TOKEN
+    metrics_set_token(getenv("METRICS_TOKEN"));
 
-    return 0;
-}
\ No newline at end of file
+    // New password hashes make PWHASH_OPSLIMIT passes over
+    // PWHASH_MEMLIMIT_MB; PWHASH_TARGET_MS instead times this machine and
+    // picks limits that hash in about that long. Stored hashes move to the
+    // new limits as their users log in.
+    size_t pwhash_mem = (size_t)env_long("PWHASH_MEMLIMIT_MB", crypto_pwhash_MEMLIMIT_INTERACTIVE >> 20) << 20;
+    if (getenv("PWHASH_TARGET_MS")
+            ? !pwhash_calibrate((unsigned int)env_long("PWHASH_TARGET_MS", 250), pwhash_mem)
+            : !pwhash_set_limits((unsigned long long)env_long("PWHASH_OPSLIMIT", crypto_pwhash_OPSLIMIT_INTERACTIVE),
+                                 pwhash_mem)) {
+        return 1;
+    }
+
+    // Password hashing runs on its own threads; PWHASH_MEM_BUDGET_MB caps
+    // the memory that concurrent hashes may use between them
+    if (!pwhash_pool_start((int)env_long("PWHASH_THREADS", 4),
+                           (size_t)env_long("PWHASH_MEM_BUDGET_MB", 256) << 20)) {
+        return 1;
+    }
+
+    // Small writes are committed in batches by one writer thread;
+    // WRITE_FLUSH_US is how long a batch may wait to fill up
+    if (!write_queue_start(db_path, (int)env_long("WRITE_BATCH_MAX", 128),
+                           (int)env_long("WRITE_FLUSH_US", 1000))) {
+        pwhash_pool_stop();
+        return 1;
+    }
+
+    for (; initialized < num_reactors; initialized++) {
+        if (!init_reactor(&reactors[initialized], jwt_secret)) {
+            initialized++; // Partially set up; free it below
+            goto cleanup;
+        }
+    }
+
+    log_info("Starting Mongoose web server on %s with %d event loop(s)", listen_url, num_reactors);
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    // Event loops
+    for (; started < num_reactors; started++) {
+        if (pthread_create(&reactors[started].thread, NULL, run_reactor, &reactors[started]) != 0) {
+            log_error("Failed to start event loop thread");
+            s_signo = SIGTERM;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    status = started == num_reactors ? 0 : 1;
+
+    unsigned long token_hits, token_misses;
+    token_cache_stats(&token_hits, &token_misses);
+    log_info("Token cache: %lu hits, %lu misses", token_hits, token_misses);
+
+    struct response_cache_stats responses;
+    response_cache_stats(&responses);
+    log_info("Response cache: %lu hits, %lu misses, %lu evictions, %lu entries in %zu of %zu bytes",
+             responses.hits, responses.misses, responses.evictions, responses.entries, responses.bytes,
+             responses.max_bytes);
+
+cleanup:
+    // Stop the workers, free Mongoose managers and close databases
+    pwhash_pool_stop();
+    write_queue_stop();
+
+    struct write_stats writes;
+    write_queue_stats(&writes);
+    log_info("Writer: %lu commits, %lu failed", writes.commits, writes.failed_commits);
+    hist_print("Write batch size", &writes.batch_size);
+    hist_print("Write commit time (us)", &writes.commit_us);
+    hist_print("Write latency (us)", &writes.latency_us);
+    for (int i = 0; i < initialized; i++) {
+        free_reactor(&reactors[i]);
+    }
+
+    return status;
+}
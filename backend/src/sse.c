@@ -0,0 +1,309 @@
+//sse.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sodium.h>
+#include "mongoose.h"
+#include "app.h"
+
+// Subscriber hash buckets, a power of two
+#define SSE_BUCKETS 1024
+
+// Missed notifications replayed to a reconnecting client at most; past
+// this it is told to reload the list instead
+#define SSE_REPLAY_MAX 500
+
+// Comment sent on an idle stream, so proxies do not time it out
+#define SSE_PING_MS 15000
+
+// How long EventSource waits before reconnecting
+#define SSE_RETRY_MS 3000
+
+// Unsent output a subscriber may pile up before it is dropped; it resumes
+// from its last event id when it reconnects
+#define SSE_MAX_BUFFERED (1024 * 1024)
+
+// Stream tickets outstanding at most; the oldest is dropped to make room
+#define SSE_TICKETS 1024
+
+#define SSE_TICKET_BYTES 16
+
+// A connection streaming user_id's notifications. Once subscribed, the
+// connection has no HTTP handler left; its pfn_data points here.
+struct sse_sub {
+    int user_id;
+    struct app_context *ctx; // Loop owning the connection
+    unsigned long conn_id;
+    struct sse_sub *prev, *next; // Same bucket; guarded by subs.lock
+    long long last_id;       // Last event sent; loop thread only
+    uint64_t last_sent_ms;   // Loop thread only
+};
+
+// A new notification on its way to one subscriber's loop
+struct sse_event {
+    struct completion base; // Must be first
+    struct notification n;
+    char message[];         // n.message points here
+};
+
+// Subscribers by recipient, shared by every event loop
+static struct {
+    pthread_mutex_t lock;
+    struct sse_sub *buckets[SSE_BUCKETS];
+    unsigned long count;
+} subs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// A single-use pass to open one stream. EventSource cannot send an
+// Authorization header, and a bearer token in the URL would end up in
+// proxy logs and browser history; a ticket there is worth nothing once
+// used or SSE_TICKET_TTL_S old.
+struct sse_ticket {
+    unsigned char digest[crypto_generichash_BYTES]; // Of the ticket bytes
+    int user_id;      // 0 if the slot is free
+    uint64_t expires_ms;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct sse_ticket slots[SSE_TICKETS];
+} tickets = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct sse_sub *sse_of(struct mg_connection *nc) {
+    return nc->pfn == NULL ? (struct sse_sub *)nc->pfn_data : NULL;
+}
+
+static struct sse_sub **bucket_of(int user_id) {
+    return &subs.buckets[(unsigned int)user_id & (SSE_BUCKETS - 1)];
+}
+
+// Appends n to nc's stream as a "notification" event with its id, so that
+// EventSource reports it as Last-Event-ID on reconnect
+static void sse_write(struct mg_connection *nc, struct sse_sub *sub, const struct notification *n) {
+    struct json_writer w;
+
+    if (nc->send.len > SSE_MAX_BUFFERED) {
+        nc->is_closing = 1; // Too slow to keep up; it resumes on reconnect
+        return;
+    }
+    mg_printf(nc, "id: %lld\nevent: notification\ndata: ", n->id);
+    jw_init(&w, &nc->send);
+    jw_begin_object(&w);
+    jw_key(&w, "id");
+    jw_int(&w, n->id);
+    jw_key(&w, "sender_id");
+    jw_int(&w, n->sender_id);
+    jw_key(&w, "receiver_id");
+    jw_int(&w, n->receiver_id);
+    jw_key(&w, "message");
+    jw_string(&w, n->message);
+    jw_key(&w, "timestamp");
+    jw_int(&w, n->timestamp);
+    jw_key(&w, "is_read");
+    jw_int(&w, n->is_read);
+    jw_end_object(&w);
+    mg_printf(nc, "\n\n");
+    sub->last_id = n->id;
+    sub->last_sent_ms = mg_millis();
+}
+
+// Replay callback for get_notifications_since
+static void sse_replay_row(const struct notification *n, void *arg) {
+    struct mg_connection *nc = arg;
+    sse_write(nc, sse_of(nc), n);
+}
+
+// Turns the connection of GET /notifications/stream into an event stream
+// of user_id's new notifications. If last_id is set (Last-Event-ID of a
+// reconnect), the ones after it are replayed first. Returns 0 (having
+// replied) on failure.
+int sse_subscribe(struct mg_connection *nc, struct app_context *ctx, int user_id, long long last_id) {
+    struct sse_sub *sub = calloc(1, sizeof(*sub));
+    if (!sub) {
+        mg_http_reply(nc, 500, JSON_HEADERS,
+                      "{\"error\": \"Failed to open stream\"}\n");
+        return 0;
+    }
+    sub->user_id = user_id;
+    sub->ctx = ctx;
+    sub->conn_id = nc->id;
+    sub->last_id = last_id;
+    sub->last_sent_ms = mg_millis();
+
+    mg_printf(nc, "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: text/event-stream\r\n"
+                  "Cache-Control: no-cache\r\n"
+                  CORS_HEADERS
+                  "\r\n"
+                  "retry: %d\n\n", SSE_RETRY_MS);
+
+    // No more requests on this connection: detach the HTTP handler and
+    // stop it parsing anything already buffered
+    nc->is_resp = 1;
+    nc->pfn = NULL;
+    nc->pfn_data = sub;
+
+    // Subscribe before replaying, so nothing committed in between is
+    // missed; events replayed and then published are skipped by id
+    pthread_mutex_lock(&subs.lock);
+    struct sse_sub **bucket = bucket_of(user_id);
+    sub->next = *bucket;
+    if (*bucket) {
+        (*bucket)->prev = sub;
+    }
+    *bucket = sub;
+    subs.count++;
+    pthread_mutex_unlock(&subs.lock);
+
+    if (last_id > 0) {
+        int rows = get_notifications_since(ctx, user_id, last_id, SSE_REPLAY_MAX, sse_replay_row, nc);
+        if (rows < 0 || rows == SSE_REPLAY_MAX) {
+            mg_printf(nc, "event: reload\ndata: {}\n\n"); // Too far behind; refetch the list
+        }
+    }
+    return 1;
+}
+
+// Delivers a published notification on the subscriber's loop
+static void sse_deliver(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    struct sse_event *ev = (struct sse_event *)c;
+    struct sse_sub *sub = nc ? sse_of(nc) : NULL;
+
+    if (sub && ev->n.id > sub->last_id) {
+        sse_write(nc, sub, &ev->n);
+    }
+    free(ev);
+}
+
+// Fans a committed notification out to every stream open for its
+// recipient, on whichever loop owns each. Safe to call from any thread.
+void sse_publish(const struct notification *n) {
+    size_t len = strlen(n->message) + 1;
+
+    pthread_mutex_lock(&subs.lock);
+    for (struct sse_sub *sub = *bucket_of(n->receiver_id); sub; sub = sub->next) {
+        if (sub->user_id != n->receiver_id) {
+            continue;
+        }
+        struct sse_event *ev = malloc(sizeof(*ev) + len);
+        if (!ev) {
+            continue; // That client catches up when it reconnects
+        }
+        ev->n = *n;
+        memcpy(ev->message, n->message, len);
+        ev->n.message = ev->message;
+        ev->base.conn_id = sub->conn_id;
+        ev->base.fn = sse_deliver;
+        complete_on_loop(sub->ctx, &ev->base);
+    }
+    pthread_mutex_unlock(&subs.lock);
+}
+
+// Issues a ticket for user_id to open one stream within SSE_TICKET_TTL_S.
+// out (at least SSE_TICKET_HEX + 1 bytes) receives it in hex.
+void sse_ticket_issue(int user_id, char *out) {
+    unsigned char ticket[SSE_TICKET_BYTES];
+    uint64_t now = mg_millis();
+
+    randombytes_buf(ticket, sizeof(ticket));
+    sodium_bin2hex(out, SSE_TICKET_HEX + 1, ticket, sizeof(ticket));
+
+    pthread_mutex_lock(&tickets.lock);
+    struct sse_ticket *slot = &tickets.slots[0];
+    for (int i = 0; i < SSE_TICKETS; i++) {
+        struct sse_ticket *t = &tickets.slots[i];
+        if (t->user_id == 0 || t->expires_ms <= now) {
+            slot = t;
+            break;
+        }
+        if (t->expires_ms < slot->expires_ms) {
+            slot = t; // Oldest so far, in case every slot is taken
+        }
+    }
+    crypto_generichash(slot->digest, sizeof(slot->digest), ticket, sizeof(ticket), NULL, 0);
+    slot->user_id = user_id;
+    slot->expires_ms = now + SSE_TICKET_TTL_S * 1000;
+    pthread_mutex_unlock(&tickets.lock);
+    sodium_memzero(ticket, sizeof(ticket));
+}
+
+// Returns the user a ticket was issued to, or 0 if it is unknown, used or
+// expired. Either way the ticket cannot be used again.
+int sse_ticket_redeem(const char *hex) {
+    unsigned char ticket[SSE_TICKET_BYTES], digest[crypto_generichash_BYTES];
+    size_t len;
+    int user_id = 0;
+
+    if (strlen(hex) != SSE_TICKET_HEX ||
+        sodium_hex2bin(ticket, sizeof(ticket), hex, SSE_TICKET_HEX, NULL, &len, NULL) != 0 ||
+        len != sizeof(ticket)) {
+        return 0;
+    }
+    crypto_generichash(digest, sizeof(digest), ticket, sizeof(ticket), NULL, 0);
+
+    uint64_t now = mg_millis();
+    pthread_mutex_lock(&tickets.lock);
+    for (int i = 0; i < SSE_TICKETS; i++) {
+        struct sse_ticket *t = &tickets.slots[i];
+        if (t->user_id != 0 && sodium_memcmp(t->digest, digest, sizeof(digest)) == 0) {
+            user_id = t->expires_ms > now ? t->user_id : 0;
+            t->user_id = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tickets.lock);
+    return user_id;
+}
+
+// Discards anything a subscriber sends. Call on MG_EV_READ.
+void sse_read(struct mg_connection *nc) {
+    if (sse_of(nc)) {
+        mg_iobuf_del(&nc->recv, 0, nc->recv.len);
+    }
+}
+
+// Keeps idle streams alive. Call on MG_EV_POLL.
+void sse_poll(struct mg_connection *nc) {
+    struct sse_sub *sub = sse_of(nc);
+    uint64_t now = mg_millis();
+    if (sub && now - sub->last_sent_ms >= SSE_PING_MS) {
+        mg_printf(nc, ": ping\n\n");
+        sub->last_sent_ms = now;
+    }
+}
+
+// Unsubscribes a closing stream. Call on MG_EV_CLOSE.
+void sse_close(struct mg_connection *nc) {
+    struct sse_sub *sub = sse_of(nc);
+    if (!sub) {
+        return;
+    }
+
+    pthread_mutex_lock(&subs.lock);
+    if (sub->prev) {
+        sub->prev->next = sub->next;
+    } else {
+        *bucket_of(sub->user_id) = sub->next;
+    }
+    if (sub->next) {
+        sub->next->prev = sub->prev;
+    }
+    subs.count--;
+    pthread_mutex_unlock(&subs.lock);
+
+    nc->pfn_data = NULL;
+    free(sub);
+}
+
+// Number of open streams
+unsigned long sse_subscribers(void) {
+    pthread_mutex_lock(&subs.lock);
+    unsigned long count = subs.count;
+    pthread_mutex_unlock(&subs.lock);
+    return count;
+}
@@ -0,0 +1,174 @@
+//token_cache.c
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sodium.h>
+#include "app.h"
+
+// Number of cached tokens; the cache never allocates beyond this table
+#define TOKEN_CACHE_SIZE 4096
+
+// Hash buckets, a power of two
+#define TOKEN_CACHE_BUCKETS 8192
+
+#define TOKEN_DIGEST_BYTES 32
+
+// Entries are linked by index + 1 so that 0 means "none" and the table
+// needs no initialization beyond being zeroed.
+struct token_entry {
+    unsigned char digest[TOKEN_DIGEST_BYTES]; // BLAKE2b of the token string
+    int user_id;   // 0 if the slot is unused
+    long exp;      // Token expiry (unix time)
+    int hnext;     // Next entry in the same bucket
+    int prev, next; // LRU list, most recently used first
+};
+
+// Verified tokens, keyed by digest, shared by every event loop
+static struct {
+    pthread_mutex_t lock;
+    struct token_entry entries[TOKEN_CACHE_SIZE];
+    int buckets[TOKEN_CACHE_BUCKETS];
+    int lru_head, lru_tail;
+    int free_head; // Removed entries, linked through hnext
+    int used;      // Slots handed out so far, in order
+    unsigned long hits, misses;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define ENTRY(i) (&cache.entries[(i) - 1])
+
+static int bucket_of(const unsigned char *digest) {
+    unsigned int h;
+    memcpy(&h, digest, sizeof(h));
+    return h & (TOKEN_CACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(int i) {
+    struct token_entry *e = ENTRY(i);
+    if (e->prev) {
+        ENTRY(e->prev)->next = e->next;
+    } else {
+        cache.lru_head = e->next;
+    }
+    if (e->next) {
+        ENTRY(e->next)->prev = e->prev;
+    } else {
+        cache.lru_tail = e->prev;
+    }
+    e->prev = e->next = 0;
+}
+
+static void lru_push_front(int i) {
+    struct token_entry *e = ENTRY(i);
+    e->prev = 0;
+    e->next = cache.lru_head;
+    if (cache.lru_head) {
+        ENTRY(cache.lru_head)->prev = i;
+    } else {
+        cache.lru_tail = i;
+    }
+    cache.lru_head = i;
+}
+
+// Unlinks entry i from its bucket and the LRU list and frees its slot
+static void remove_entry(int i) {
+    struct token_entry *e = ENTRY(i);
+    int *link = &cache.buckets[bucket_of(e->digest)];
+    while (*link && *link != i) {
+        link = &ENTRY(*link)->hnext;
+    }
+    if (*link) {
+        *link = e->hnext;
+    }
+    lru_unlink(i);
+    e->user_id = 0;
+    e->hnext = cache.free_head;
+    cache.free_head = i;
+}
+
+static int find_entry(const unsigned char *digest) {
+    int i = cache.buckets[bucket_of(digest)];
+    while (i && sodium_memcmp(ENTRY(i)->digest, digest, TOKEN_DIGEST_BYTES) != 0) {
+        i = ENTRY(i)->hnext;
+    }
+    return i;
+}
+
+static void token_digest(const char *token, unsigned char *digest) {
+    crypto_generichash(digest, TOKEN_DIGEST_BYTES, (const unsigned char *)token, strlen(token), NULL, 0);
+}
+
+// Returns the user_id of a previously verified, unexpired token, or 0
+int token_cache_lookup(const char *token, long now) {
+    unsigned char digest[TOKEN_DIGEST_BYTES];
+    int user_id = 0;
+
+    token_digest(token, digest);
+    pthread_mutex_lock(&cache.lock);
+    int i = find_entry(digest);
+    if (i && ENTRY(i)->exp < now) {
+        remove_entry(i); // Expired; the caller re-verifies and gets a rejection
+        i = 0;
+    }
+    if (i) {
+        user_id = ENTRY(i)->user_id;
+        lru_unlink(i);
+        lru_push_front(i);
+        cache.hits++;
+    } else {
+        cache.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return user_id;
+}
+
+// Remembers a token verify_token has accepted, evicting the least recently
+// used entry when the table is full
+void token_cache_insert(const char *token, int user_id, long exp) {
+    unsigned char digest[TOKEN_DIGEST_BYTES];
+
+    token_digest(token, digest);
+    pthread_mutex_lock(&cache.lock);
+    int i = find_entry(digest);
+    if (i) {
+        remove_entry(i);
+    }
+    if (!cache.free_head && cache.used == TOKEN_CACHE_SIZE) {
+        remove_entry(cache.lru_tail);
+    }
+    if (cache.free_head) {
+        i = cache.free_head;
+        cache.free_head = ENTRY(i)->hnext;
+    } else {
+        i = ++cache.used;
+    }
+
+    struct token_entry *e = ENTRY(i);
+    memcpy(e->digest, digest, TOKEN_DIGEST_BYTES);
+    e->user_id = user_id;
+    e->exp = exp;
+    int b = bucket_of(digest);
+    e->hnext = cache.buckets[b];
+    cache.buckets[b] = i;
+    lru_push_front(i);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Drops every cached token of user_id
+void token_cache_invalidate_user(int user_id) {
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 1; i <= cache.used; i++) {
+        if (ENTRY(i)->user_id == user_id) {
+            remove_entry(i);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void token_cache_stats(unsigned long *hits, unsigned long *misses) {
+    pthread_mutex_lock(&cache.lock);
+    *hits = cache.hits;
+    *misses = cache.misses;
+    pthread_mutex_unlock(&cache.lock);
+}
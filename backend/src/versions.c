@@ -0,0 +1,45 @@
+//versions.c
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sodium.h>
+#include "app.h"
+
+// Counters per resource, a power of two. Users share a counter when their
+// ids hash alike; a change then also invalidates the other user's ETags,
+// which costs a full reply but never serves stale data.
+#define VERSION_SLOTS 65536
+
+// How many times each user's resources have changed since startup. Bumped
+// once a change has committed and read before a GET queries, so a reply is
+// never tagged with a version newer than the data in it.
+static struct {
+    atomic_ulong counters[RESOURCE_COUNT][VERSION_SLOTS];
+    unsigned int epoch; // Differs between runs, as the counters restart at 0
+} versions;
+
+static unsigned int slot_of(int user_id) {
+    unsigned int h = (unsigned int)user_id * 2654435761u; // Knuth's multiplicative hash
+    return (h ^ (h >> 16)) & (VERSION_SLOTS - 1);
+}
+
+void versions_init(void) {
+    versions.epoch = randombytes_random();
+}
+
+unsigned long resource_version(int user_id, enum resource r) {
+    return atomic_load_explicit(&versions.counters[r][slot_of(user_id)], memory_order_acquire);
+}
+
+// Call once the change to user_id's resource r is committed. Cached
+// renderings of it are dropped too; they would no longer be served anyway.
+void resource_changed(int user_id, enum resource r) {
+    atomic_fetch_add_explicit(&versions.counters[r][slot_of(user_id)], 1, memory_order_release);
+    response_cache_invalidate(user_id, r);
+}
+
+// Writes the quoted ETag of version of user_id's resource r. The user id
+// is part of it, so a browser shared by two accounts never matches the
+// other account's copy.
+void resource_etag(int user_id, enum resource r, unsigned long version, char *etag, size_t size) {
+    snprintf(etag, size, "\"%08x-%d-%d-%lu\"", versions.epoch, (int)r, user_id, version);
+}
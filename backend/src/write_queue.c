@@ -0,0 +1,415 @@
+//write_queue.c
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "app.h"
+
+// Jobs allowed to wait for the writer before submitters are turned away
+#define WRITE_QUEUE_MAX 4096
+
+// Largest batch, whatever the configuration asks for
+#define WRITE_BATCH_LIMIT 1024
+
+// One thread owning its own database connection. Handlers queue writes and
+// the thread commits them in batches, one transaction (and one WAL fsync)
+// per batch instead of per request. A batch closes when it holds batch_max
+// jobs or flush_us after its first job was queued, whichever comes first.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct completion *head, *tail; // Pending jobs, linked through base.next
+    int queued;
+    int running;
+    int started;
+    int batch_max;
+    int flush_us;
+    pthread_t thread;
+    struct app_context ctx;         // The writer's connection and statements
+    struct write_stats stats;       // Guarded by lock
+} writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Runs one job's statement inside the open transaction
+static void run_job(struct write_job *job) {
+    struct app_context *ctx = &writer.ctx;
+
+    job->rowid = 0;
+    switch (job->op) {
+    case WRITE_REGISTER_USER:
+        job->result = register_user(ctx, job->args[0], job->args[1], job->args[2], job->args[3], job->text);
+        if (job->result == 1) {
+            job->rowid = sqlite3_last_insert_rowid(ctx->db);
+        }
+        break;
+    case WRITE_DELETE_USER:
+        job->result = delete_user(ctx, job->user_id);
+        break;
+    case WRITE_ADD_CAR:
+        if (job->result == -1) {
+            break; // Its photo could not be stored
+        }
+        job->result = add_car(ctx, job->user_id, job->args[0], job->args[1], job->args[2], job->text);
+        if (job->result) {
+            job->rowid = sqlite3_last_insert_rowid(ctx->db);
+        }
+        break;
+    case WRITE_DELETE_CAR:
+        job->result = delete_car(ctx, job->user_id, job->target);
+        break;
+    case WRITE_SET_CAR_PHOTO:
+        job->result = set_car_photo(ctx, job->user_id, job->target, job->text);
+        break;
+    case WRITE_SEND_NOTIFICATION:
+        job->timestamp = (long long)time(NULL);
+        job->result = send_notification(ctx, job->user_id, job->target, job->args[0], job->timestamp);
+        if (job->result) {
+            job->rowid = sqlite3_last_insert_rowid(ctx->db);
+        }
+        break;
+    case WRITE_MARK_NOTIFICATION_READ:
+        job->result = mark_notification_read(ctx, job->user_id, job->target);
+        break;
+    case WRITE_UPDATE_PROFILE:
+        job->result = update_user_profile(ctx, job->user_id, job->args[0], job->args[1], job->args[2]);
+        break;
+    case WRITE_UPDATE_EMAIL:
+        job->result = update_user_email(ctx, job->user_id, job->args[0]);
+        break;
+    case WRITE_UPDATE_PASSWORD:
+        job->result = update_user_password(ctx, job->user_id, job->text);
+        break;
+    case WRITE_REHASH_PASSWORD:
+        job->result = rehash_user_password(ctx, job->user_id, job->owned, job->text);
+        break;
+    case WRITE_MARK_READ_UP_TO:
+        job->count = mark_notifications_read_up_to(ctx, job->user_id, job->up_to);
+        job->result = job->count >= 0;
+        break;
+    case WRITE_MARK_READ_IDS:
+        job->count = mark_notifications_read_ids(ctx, job->user_id, job->owned);
+        job->result = job->count >= 0;
+        break;
+    case WRITE_ADD_CARS: {
+        // One cached statement for every row, all in this transaction
+        struct car_batch *batch = job->owned;
+        job->count = 0;
+        for (int i = 0; i < batch->count; i++) {
+            struct car_batch_row *row = &batch->rows[i];
+            if (row->id == -1) {
+                continue; // Its photo could not be stored
+            }
+            row->id = add_car(ctx, job->user_id, row->car_name, row->year_of_manufacture, row->car_value, row->photo)
+                          ? sqlite3_last_insert_rowid(ctx->db) : 0;
+            job->count += row->id > 0;
+        }
+        job->result = 1;
+        break;
+    }
+    case WRITE_DELETE_READ_NOTIFICATIONS:
+        job->count = delete_read_notifications(ctx, job->user_id);
+        job->result = job->count >= 0;
+        break;
+    default:
+        job->result = 0;
+        break;
+    }
+}
+
+_Static_assert(sizeof(((struct car_batch_row *)0)->photo_link) >= sizeof(PHOTO_URL_PREFIX) + PHOTO_HASH_HEX,
+               "car_batch_row.photo_link must hold a link to a stored photo");
+
+// Stores the photo of one row of a batch import. Only rows that passed
+// every check reach the writer, so no photo is stored for a rejected row.
+static void store_row_photo(struct car_batch_row *row) {
+    char url[512];
+    const char *photo = row->photo ? row->photo : "";
+
+    if (!photo_store_inline(photo, url, sizeof(url))) {
+        row->id = -1;
+        return;
+    }
+    row->id = 0;
+    size_t len = strlen(url);
+    if (strcmp(url, photo) != 0 && len < sizeof(row->photo_link)) {
+        memcpy(row->photo_link, url, len + 1);
+        photo = row->photo_link;
+    }
+    row->photo = photo; // Links are kept as they are
+}
+
+// Moves the inline photos of a batch's new cars to the photo store. This
+// runs before the transaction opens: decoding and fsyncing a photo holds up
+// neither the event loops nor the write lock. A car whose photo cannot be
+// stored gets result (or row id) -1 and is not inserted.
+static void store_photos(struct completion *jobs) {
+    for (struct completion *c = jobs; c; c = c->next) {
+        struct write_job *job = (struct write_job *)c;
+        if (job->op == WRITE_ADD_CAR) {
+            const char *photo = job->args[3] ? job->args[3] : "";
+            job->result = photo_store_inline(photo, job->text, sizeof(job->text)) ? 0 : -1;
+        } else if (job->op == WRITE_ADD_CARS) {
+            struct car_batch *batch = job->owned;
+            for (int i = 0; i < batch->count; i++) {
+                store_row_photo(&batch->rows[i]);
+            }
+        }
+    }
+}
+
+// Commits jobs (a list of n) in one transaction. A failing statement only
+// fails its own job: SQLite undoes that statement and the transaction goes
+// on. If SQLite rolls the whole transaction back instead (I/O error, full
+// disk), or COMMIT fails, every job in it fails.
+static int commit_batch(struct completion *jobs) {
+    sqlite3 *db = writer.ctx.db;
+    struct completion *first = jobs; // Start of the open transaction
+
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        log_error("Write batch failed to begin: %s", sqlite3_errmsg(db));
+        for (struct completion *c = jobs; c; c = c->next) {
+            ((struct write_job *)c)->result = 0;
+        }
+        return 0;
+    }
+    for (struct completion *c = jobs; c; c = c->next) {
+        run_job((struct write_job *)c);
+        if (sqlite3_get_autocommit(db)) {
+            log_error("Write batch rolled back: %s", sqlite3_errmsg(db));
+            for (struct completion *f = first; f != c->next; f = f->next) {
+                ((struct write_job *)f)->result = 0;
+            }
+            if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+                for (struct completion *f = c->next; f; f = f->next) {
+                    ((struct write_job *)f)->result = 0;
+                }
+                return 0;
+            }
+            first = c->next;
+        }
+    }
+    if (sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        log_error("Write batch failed to commit: %s", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        for (struct completion *c = first; c; c = c->next) {
+            ((struct write_job *)c)->result = 0;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// Waits for the next batch and unlinks it from the queue. Returns the
+// number of jobs taken, 0 once stopped with nothing left to write.
+static int take_batch(struct completion **batch) {
+    pthread_mutex_lock(&writer.lock);
+    while (writer.running && !writer.head) {
+        pthread_cond_wait(&writer.cond, &writer.lock);
+    }
+
+    // Let the batch fill until the flush window of its first job closes
+    if (writer.head && writer.flush_us > 0) {
+        unsigned long long deadline = ((struct write_job *)writer.head)->queued_us + writer.flush_us;
+        struct timespec ts = {(time_t)(deadline / 1000000), (long)(deadline % 1000000) * 1000};
+        while (writer.running && writer.queued < writer.batch_max &&
+               pthread_cond_timedwait(&writer.cond, &writer.lock, &ts) != ETIMEDOUT) {
+        }
+    }
+
+    int n = 0;
+    struct completion *last = NULL;
+    *batch = writer.head;
+    for (struct completion *c = writer.head; c && n < writer.batch_max; c = c->next) {
+        last = c;
+        n++;
+    }
+    if (last) {
+        writer.head = last->next;
+        if (!writer.head) {
+            writer.tail = NULL;
+        }
+        last->next = NULL;
+        writer.queued -= n;
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return n;
+}
+
+// Bumps the versions of what a committed job changed. This runs after the
+// commit, not next to the statement: a GET that read the new version before
+// the commit would tag the old rows with it.
+static void bump_versions(struct write_job *job) {
+    switch (job->op) {
+    case WRITE_DELETE_USER:
+        for (int r = 0; r < RESOURCE_COUNT; r++) {
+            resource_changed(job->user_id, (enum resource)r);
+        }
+        break;
+    case WRITE_ADD_CAR:
+    case WRITE_ADD_CARS:
+    case WRITE_DELETE_CAR:
+    case WRITE_SET_CAR_PHOTO:
+        resource_changed(job->user_id, RESOURCE_CARS);
+        break;
+    case WRITE_SEND_NOTIFICATION:
+        resource_changed(job->target, RESOURCE_NOTIFICATIONS); // The receiver's list
+        break;
+    case WRITE_MARK_NOTIFICATION_READ:
+    case WRITE_MARK_READ_UP_TO:
+    case WRITE_MARK_READ_IDS:
+    case WRITE_DELETE_READ_NOTIFICATIONS:
+        resource_changed(job->user_id, RESOURCE_NOTIFICATIONS);
+        break;
+    case WRITE_UPDATE_PROFILE:
+    case WRITE_UPDATE_EMAIL:
+        resource_changed(job->user_id, RESOURCE_PROFILE);
+        break;
+    default:
+        break;
+    }
+}
+
+// Pushes a committed notification to its recipient's open streams. Only
+// this thread inserts notifications, so publishing here, batch after batch,
+// queues them to every subscriber's loop in id order; a loop runs its
+// completions in the order they were queued.
+static void publish(struct write_job *job) {
+    if (job->op == WRITE_SEND_NOTIFICATION) {
+        struct notification n = {
+            .id = job->rowid,
+            .sender_id = job->user_id,
+            .receiver_id = job->target,
+            .message = job->args[0],
+            .timestamp = job->timestamp,
+        };
+        sse_publish(&n);
+    }
+}
+
+static void *write_worker(void *arg) {
+    struct completion *batch;
+    int n;
+
+    // Jobs still queued when stopped are written before the thread exits
+    while ((n = take_batch(&batch)) > 0) {
+        store_photos(batch);
+        unsigned long long start = now_us();
+        int ok = commit_batch(batch);
+        unsigned long long end = now_us();
+
+        pthread_mutex_lock(&writer.lock);
+        if (ok) {
+            writer.stats.commits++;
+        } else {
+            writer.stats.failed_commits++;
+        }
+        hist_record(&writer.stats.batch_size, (unsigned long long)n);
+        hist_record(&writer.stats.commit_us, end - start);
+        for (struct completion *c = batch; c; c = c->next) {
+            hist_record(&writer.stats.latency_us, end - ((struct write_job *)c)->queued_us);
+        }
+        pthread_mutex_unlock(&writer.lock);
+
+        while (batch) {
+            struct completion *next = batch->next;
+            struct write_job *job = (struct write_job *)batch;
+            if (job->result) {
+                bump_versions(job);
+                publish(job);
+            }
+            complete_on_loop(job->ctx, &job->base);
+            batch = next;
+        }
+    }
+    return NULL;
+}
+
+// Opens the writer's connection to db_path and starts its thread
+int write_queue_start(const char *db_path, int batch_max, int flush_us) {
+    pthread_condattr_t attr;
+
+    if (!open_db(&writer.ctx, db_path) || !prepare_statements(&writer.ctx)) {
+        log_error("Failed to prepare the writer's database connection");
+        if (writer.ctx.db) {
+            close_db(&writer.ctx);
+        }
+        return 0;
+    }
+
+    writer.batch_max = batch_max < 1 ? 1 : batch_max > WRITE_BATCH_LIMIT ? WRITE_BATCH_LIMIT : batch_max;
+    writer.flush_us = flush_us < 0 ? 0 : flush_us;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // now_us deadlines
+    pthread_cond_init(&writer.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    writer.running = 1;
+    if (pthread_create(&writer.thread, NULL, write_worker, NULL) != 0) {
+        log_error("Failed to start the writer thread");
+        writer.running = 0;
+        close_db(&writer.ctx);
+        return 0;
+    }
+    writer.started = 1;
+    log_info("Writer: batches of up to %d writes, %d us flush window", writer.batch_max, writer.flush_us);
+    return 1;
+}
+
+// Writes out what is queued, then stops the thread and closes its
+// connection. Call once the event loops have stopped.
+void write_queue_stop(void) {
+    if (!writer.started) {
+        return;
+    }
+    pthread_mutex_lock(&writer.lock);
+    writer.running = 0;
+    pthread_cond_broadcast(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+
+    pthread_join(writer.thread, NULL);
+    writer.started = 0;
+    close_db(&writer.ctx);
+}
+
+// Queues a write; its completion runs on job->ctx's event loop once the
+// batch holding it has committed. Returns 0 if the writer is stopped or its
+// queue is full.
+int write_submit(struct write_job *job) {
+    pthread_mutex_lock(&writer.lock);
+    if (!writer.running || writer.queued >= WRITE_QUEUE_MAX) {
+        pthread_mutex_unlock(&writer.lock);
+        return 0;
+    }
+    job->queued_us = now_us();
+    job->base.next = NULL;
+    if (writer.tail) {
+        writer.tail->next = &job->base;
+    } else {
+        writer.head = &job->base;
+    }
+    writer.tail = &job->base;
+    writer.queued++;
+
+    // Wake the writer for a first job, and to close a full batch early
+    if (writer.queued == 1 || writer.queued == writer.batch_max) {
+        pthread_cond_signal(&writer.cond);
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return 1;
+}
+
+// Copies the writer's counters and histograms
+void write_queue_stats(struct write_stats *out) {
+    pthread_mutex_lock(&writer.lock);
+    *out = writer.stats;
+    pthread_mutex_unlock(&writer.lock);
+}
@@ -0,0 +1,90 @@
+//email_index_test.c
+// Checks the email index: a taken email is never reported free, however
+// users come and go, and at the sizing it is built for (16 counters per
+// user) few free emails are reported maybe taken, each of them then
+// cleared by the UNIQUE index.
+// Usage: tests/email_index_test
+#include <stdio.h>
+#include <string.h>
+#include <sodium.h>
+#include "harness.h"
+
+// Fills the index's smallest table, 2^20 counters, to its design load
+#define USERS 65536
+#define FREE_EMAILS 100000
+
+static struct app_context loop;
+
+static void email_of(int i, char *email, size_t size) {
+    snprintf(email, size, "user%d@example.com", i);
+}
+
+// Every email of the first n users may be taken
+static int all_maybe_taken(int n) {
+    char email[64];
+    for (int i = 0; i < n; i++) {
+        email_of(i, email, sizeof(email));
+        if (!email_index_maybe_taken(email)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    char path[64], email[64];
+
+    if (sodium_init() < 0 || !test_db_open(&loop, path, sizeof(path))) {
+        fprintf(stderr, "Cannot open the test database\n");
+        return 1;
+    }
+    check(email_index_maybe_taken("anyone@example.com"), "before loading, every email may be taken");
+
+    // Users 0 to USERS - 1 exist at startup, user i with id i + 1
+    check(sqlite3_exec(loop.db,
+                       "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i < 65535) "
+                       "INSERT INTO users (first_name, last_name, email, organization, password) "
+                       "SELECT 'Test', 'User', 'user' || i || '@example.com', 'DriveHub', 'x' FROM n;",
+                       NULL, NULL, NULL) == SQLITE_OK &&
+          email_index_load(loop.db), "index loaded from the users table");
+    check(all_maybe_taken(USERS), "every stored email may be taken");
+
+    int maybe = 0, confirmed = 0;
+    for (int i = 0; i < FREE_EMAILS; i++) {
+        snprintf(email, sizeof(email), "free%d@example.org", i);
+        if (email_index_maybe_taken(email)) {
+            maybe++;
+            confirmed += email_taken(&loop, email);
+        }
+    }
+    printf("     %d of %d free emails were a maybe\n", maybe, FREE_EMAILS);
+    check(maybe < FREE_EMAILS / 200, "under 1 in 200 free emails is a maybe");
+    check(confirmed == 0, "and the UNIQUE index clears every one");
+
+    // Registering, changing and deleting keep it current
+    int user_id = test_add_user(&loop, "new@example.com");
+    check(email_index_maybe_taken("new@example.com") && email_taken(&loop, "new@example.com"),
+          "a registered email is taken");
+    check(update_user_email(&loop, user_id, "changed@example.com") == 1 &&
+          email_index_maybe_taken("changed@example.com") && !email_taken(&loop, "new@example.com"),
+          "a changed email is taken, the old one free");
+    check(delete_user(&loop, user_id) && !email_taken(&loop, "changed@example.com"), "a deleted one is free");
+
+    // Removing half the users, whose counters the others share, leaves no
+    // stored email reported free
+    for (int i = 0; i < USERS; i += 2) {
+        email_of(i, email, sizeof(email));
+        email_index_remove(email);
+    }
+    check(sqlite3_exec(loop.db, "DELETE FROM users WHERE id % 2 = 1 AND id <= 65536;", NULL, NULL, NULL) == SQLITE_OK,
+          "half the users deleted");
+    int kept = 1;
+    for (int i = 1; i < USERS; i += 2) {
+        email_of(i, email, sizeof(email));
+        kept &= email_index_maybe_taken(email);
+    }
+    check(kept, "the rest may still be taken");
+
+    test_db_close(&loop, path);
+    return test_result();
+}
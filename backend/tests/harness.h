@@ -0,0 +1,34 @@
+//harness.h
+// Shared by the unit tests: checks, scratch databases and the completion
+// queue that server.c provides in the server
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "mongoose.h"
+#include "app.h"
+
+// Records a check; what says what was expected
+void check(int ok, const char *what);
+
+// Prints PASSED or FAILED; returns the exit status for main
+int test_result(void);
+
+// Makes ctx stand for an event loop, with an empty completion queue
+void test_loop_init(struct app_context *ctx);
+
+// Opens a migrated database in a scratch file for ctx (a loop, as with
+// test_loop_init), its path copied to path. Returns 0 on failure.
+int test_db_open(struct app_context *ctx, char *path, size_t size);
+void test_db_close(struct app_context *ctx, const char *path);
+
+// Registers a user with email; returns the new id, or 0
+int test_add_user(struct app_context *ctx, const char *email);
+
+// Waits until n completions are queued on ctx
+void test_wait_completions(struct app_context *ctx, int n);
+
+// Runs the completions queued on ctx in order, as the loop would: with nc
+// if they wait for it (nc->id), else with no connection. Returns how many.
+int test_run_completions(struct app_context *ctx, struct mg_connection *nc);
+
+#endif
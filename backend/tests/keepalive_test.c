@@ -0,0 +1,343 @@
+//keepalive_test.c
+// Checks that every kind of reply leaves a keep-alive connection usable:
+// after each one the next request on the same connection must be answered.
+// Starts the server on a scratch database, like bench/loadgen.
+// Usage: tests/keepalive_test [--server ./backend] [--port 5598]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PASSWORD "keepalive-password-1"
+#define REPLY_TIMEOUT_S 5 // A stalled connection fails the test instead of hanging it
+
+static struct {
+    const char *server;
+    int port;
+} opt = {"./backend", 5598};
+
+static pid_t server_pid;
+static char scratch[64];
+static int failures;
+
+// One reply, read whole
+struct reply {
+    int status;
+    char head[4096];
+    char body[65536];
+    size_t body_len;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    struct timeval timeout = {REPLY_TIMEOUT_S, 0};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)opt.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Reads exactly len bytes. Returns 0 on EOF, error or timeout.
+static int read_exact(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Writes one request (extra: further header lines, each ending in CRLF)
+// without waiting for the reply, so requests can be pipelined
+static int send_request(int fd, const char *method, const char *path, const char *token, const char *extra,
+                        const char *body) {
+    char head[2048];
+    size_t body_len = body ? strlen(body) : 0;
+    int n = snprintf(head, sizeof(head),
+                     "%s %s HTTP/1.1\r\nHost: localhost\r\n%s%s%s%sContent-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n\r\n",
+                     method, path, token ? "Authorization: Bearer " : "", token ? token : "", token ? "\r\n" : "",
+                     extra ? extra : "", body_len);
+    return write_all(fd, head, (size_t)n) && (!body_len || write_all(fd, body, body_len));
+}
+
+// Reads the next reply on fd, a byte at a time up to the end of its
+// headers so nothing of a pipelined reply after it is consumed. Returns
+// 0 if the connection closed or stalled.
+static int read_reply(int fd, struct reply *r) {
+    size_t len = 0, length = 0;
+
+    while (len < 4 || memcmp(r->head + len - 4, "\r\n\r\n", 4) != 0) {
+        if (len + 1 >= sizeof(r->head) || !read_exact(fd, r->head + len, 1)) {
+            return 0;
+        }
+        len++;
+    }
+    r->head[len] = '\0';
+    r->status = atoi(r->head + 9);
+    for (char *line = strstr(r->head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            length = strtoul(line + 17, NULL, 10);
+        }
+    }
+    if (length >= sizeof(r->body) || !read_exact(fd, r->body, length)) {
+        return 0;
+    }
+    r->body[length] = '\0';
+    r->body_len = length;
+    return 1;
+}
+
+static int request(int fd, const char *method, const char *path, const char *token, const char *extra,
+                   const char *body, struct reply *r) {
+    return send_request(fd, method, path, token, extra, body) && read_reply(fd, r);
+}
+
+// Records a check; what names the request it is about
+static void check(int ok, const char *what) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    failures += !ok;
+}
+
+// Copies the value of header name (e.g. "ETag") of a reply into out
+static int header_value(const struct reply *r, const char *name, char *out, size_t size) {
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(r->head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, name_len) == 0 && line[2 + name_len] == ':') {
+            const char *start = line + 3 + name_len;
+            start += strspn(start, " ");
+            size_t len = strcspn(start, "\r");
+            if (len >= size) {
+                return 0;
+            }
+            memcpy(out, start, len);
+            out[len] = '\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Copies the string value of "key" in a flat JSON body into out
+static int json_string_field(const char *body, const char *key, char *out, size_t size) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+    const char *start = strstr(body, pattern);
+    if (!start) {
+        snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+        start = strstr(body, pattern);
+    }
+    if (!start) {
+        return 0;
+    }
+    start += strlen(pattern);
+    const char *end = strchr(start, '"');
+    if (!end || (size_t)(end - start) >= size) {
+        return 0;
+    }
+    memcpy(out, start, (size_t)(end - start));
+    out[end - start] = '\0';
+    return 1;
+}
+
+// Reads the integer value of "key" in a flat JSON body
+static long long json_int_field(const char *body, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *start = strstr(body, pattern);
+    return start ? strtoll(start + strlen(pattern), NULL, 10) : 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+// Runs the server on a scratch database in a scratch directory and waits
+// until it accepts connections
+static int start_server(void) {
+    char server[4096], port[16];
+
+    if (!realpath(opt.server, server)) {
+        fprintf(stderr, "Cannot find server %s (run make first)\n", opt.server);
+        return 0;
+    }
+    snprintf(scratch, sizeof(scratch), "/tmp/drivehub-test-XXXXXX");
+    if (!mkdtemp(scratch)) {
+        perror("mkdtemp");
+        return 0;
+    }
+    snprintf(port, sizeof(port), "%d", opt.port);
+
+    server_pid = fork();
+    if (server_pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (server_pid == 0) {
+        int log;
+        if (chdir(scratch) != 0 || (log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            _exit(127);
+        }
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        execl(server, server, "--db", "test.db", "--port", port, (char *)NULL);
+        _exit(127);
+    }
+
+    for (double deadline = now_sec() + 10; now_sec() < deadline; usleep(20000)) {
+        int fd = connect_server();
+        if (fd >= 0) {
+            close(fd);
+            return 1;
+        }
+        if (waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+            fprintf(stderr, "Server exited during startup; see %s/server.log\n", scratch);
+            server_pid = 0;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Server did not start listening on port %d\n", opt.port);
+    return 0;
+}
+
+static void stop_server(void) {
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+    }
+    if (scratch[0]) {
+        if (failures) {
+            fprintf(stderr, "Scratch directory kept: %s\n", scratch);
+        } else {
+            nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+}
+
+// Every request below goes over one connection, so a reply that leaves
+// the connection stalled fails the check after it
+static void run(int fd) {
+    struct reply r;
+    char token[512];
+
+    check(request(fd, "POST", "/register", NULL, NULL,
+                  "{\"first_name\": \"Keep\", \"last_name\": \"Alive\", \"email\": \"keepalive@example.com\", "
+                  "\"organization\": \"Test\", \"password\": \"" PASSWORD "\"}", &r) && r.status == 201,
+          "POST /register");
+    check(request(fd, "POST", "/login", NULL, NULL,
+                  "{\"email\": \"keepalive@example.com\", \"password\": \"" PASSWORD "\"}", &r) && r.status == 200 &&
+          json_string_field(r.body, "token", token, sizeof(token)),
+          "POST /login");
+
+    // Replies rendered by the JSON writer
+    check(request(fd, "GET", "/profile", token, NULL, NULL, &r) && r.status == 200, "GET /profile");
+    check(request(fd, "GET", "/profile", token, NULL, NULL, &r) && r.status == 200, "GET /profile from the cache");
+    check(request(fd, "GET", "/profile", token, "Accept-Encoding: gzip\r\n", NULL, &r) && r.status == 200,
+          "GET /profile with Accept-Encoding");
+    char etag[192], inm[256];
+    check(request(fd, "GET", "/cars", token, NULL, NULL, &r) && r.status == 200 &&
+          header_value(&r, "ETag", etag, sizeof(etag)),
+          "GET /cars");
+    snprintf(inm, sizeof(inm), "If-None-Match: %s\r\n", etag);
+    check(request(fd, "GET", "/cars", token, inm, NULL, &r) && r.status == 304, "GET /cars revalidated");
+    check(request(fd, "GET", "/notifications", token, NULL, NULL, &r) && r.status == 200, "GET /notifications");
+    check(request(fd, "POST", "/cars", token, NULL,
+                  "{\"car_name\": \"Probox\", \"year_of_manufacture\": \"2015\", \"car_value\": \"800000\"}", &r) &&
+          r.status == 201, "POST /cars");
+    long long car_id = json_int_field(r.body, "id");
+    check(request(fd, "POST", "/cars/batch", token, NULL, "[{\"car_name\": \"\"}]", &r) && r.status == 400 &&
+          strncmp(r.head, "HTTP/1.1 400 Bad Request\r\n", 26) == 0,
+          "POST /cars/batch with no valid row");
+
+    // Photo upload, then the file and its revalidation
+    char path[128], photo[128];
+    snprintf(path, sizeof(path), "/cars/%lld/photo", car_id);
+    check(request(fd, "PUT", path, token, NULL, "not really a jpeg", &r) && r.status == 200 &&
+          json_string_field(r.body, "photo", photo, sizeof(photo)),
+          "PUT /cars/:id/photo");
+    check(request(fd, "GET", photo, NULL, NULL, NULL, &r) && r.status == 200 && r.body_len == 17, "GET /photos/:hash");
+    snprintf(inm, sizeof(inm), "If-None-Match: \"%s\"\r\n", photo + strlen("/photos/"));
+    check(request(fd, "GET", photo, NULL, inm, NULL, &r) && r.status == 304, "GET /photos/:hash revalidated");
+    check(request(fd, "GET", "/notifications/unread_count", token, NULL, NULL, &r) && r.status == 200,
+          "GET /notifications/unread_count after them");
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            opt.server = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            opt.port = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--server ./backend] [--port 5598]\n", argv[0]);
+            return 2;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (!start_server()) {
+        stop_server();
+        return 1;
+    }
+
+    int fd = connect_server();
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to the server\n");
+        stop_server();
+        return 1;
+    }
+    run(fd);
+    close(fd);
+    stop_server();
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
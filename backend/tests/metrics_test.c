@@ -0,0 +1,51 @@
+//metrics_test.c
+// Checks that GET /metrics is served only to scrapers sending
+// METRICS_TOKEN: off without one, refused with a missing or wrong token.
+// Usage: tests/metrics_test
+#include <stdio.h>
+#include <string.h>
+#include <sodium.h>
+#include "harness.h"
+
+#define TOKEN "scrape-token"
+
+// Scrapes /metrics with authorization as the Authorization header (none if
+// NULL); returns the reply's status code
+static int scrape(const char *authorization) {
+    struct mg_connection nc;
+    struct mg_http_message hm;
+    int status = 0;
+
+    memset(&nc, 0, sizeof(nc));
+    memset(&hm, 0, sizeof(hm));
+    if (authorization) {
+        hm.headers[0].name = mg_str("Authorization");
+        hm.headers[0].value = mg_str(authorization);
+    }
+    handle_metrics(&nc, &hm, NULL);
+    if (nc.send.len < 12 || sscanf((const char *)nc.send.buf, "HTTP/1.1 %d", &status) != 1) {
+        status = 0;
+    }
+    mg_iobuf_free(&nc.send);
+    return status;
+}
+
+int main(void) {
+    if (sodium_init() < 0) {
+        fprintf(stderr, "Cannot initialise libsodium\n");
+        return 1;
+    }
+
+    metrics_set_token(NULL);
+    check(scrape("Bearer " TOKEN) == 404, "without METRICS_TOKEN the endpoint is off");
+    metrics_set_token("");
+    check(scrape("Bearer ") == 404, "an empty METRICS_TOKEN leaves it off");
+
+    metrics_set_token(TOKEN);
+    check(scrape(NULL) == 401, "a scrape without a token is refused");
+    check(scrape("Basic " TOKEN) == 401, "as is one with another scheme");
+    check(scrape("Bearer wrong-token") == 401, "or the wrong token");
+    check(scrape("Bearer " TOKEN "x") == 401 && scrape("Bearer scrape") == 401, "or a prefix or extension of it");
+    check(scrape("Bearer " TOKEN) == 200, "the token gets the metrics");
+    return test_result();
+}
@@ -0,0 +1,128 @@
+//notifications_test.c
+// Checks the bulk notification writes: each reports how many rows it
+// changed, touches only its user's notifications, and gives that user's
+// list a new version. Checks that the unread counts the triggers keep agree
+// with the notifications through every kind of write.
+// Usage: tests/notifications_test
+#include <stdio.h>
+#include <string.h>
+#include "harness.h"
+
+static struct app_context loop;
+
+static void written(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+}
+
+// Runs one write on the writer thread, as the handlers do; returns the
+// rows it changed, or -1 if it failed
+static long long run(enum write_op op, int user_id, long long up_to, const char *ids) {
+    struct write_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.base.fn = written;
+    job.op = op;
+    job.ctx = &loop;
+    job.user_id = user_id;
+    job.up_to = up_to;
+    job.owned = (void *)ids;
+    if (!write_submit(&job)) {
+        return -1;
+    }
+    test_wait_completions(&loop, 1);
+    test_run_completions(&loop, NULL);
+    return job.result ? job.count : -1;
+}
+
+// Sends n notifications to receiver, their ids written to ids
+static void send_n(int sender, int receiver, int n, long long *ids) {
+    for (int i = 0; i < n; i++) {
+        send_notification(&loop, sender, receiver, "Hello", i);
+        ids[i] = sqlite3_last_insert_rowid(loop.db);
+    }
+}
+
+// The trigger-kept count of user_id is want, and what a scan counts
+static int unread_is(int user_id, long long want) {
+    sqlite3_stmt *stmt;
+    long long scanned = -1;
+
+    if (sqlite3_prepare_v2(loop.db, "SELECT COUNT(*) FROM notifications WHERE receiver_id = ? AND is_read = 0;",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, user_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        scanned = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return get_unread_count(&loop, user_id) == want && scanned == want;
+}
+
+int main(void) {
+    char path[64], json[128];
+    long long mine[9], theirs[3];
+
+    if (!test_db_open(&loop, path, sizeof(path)) || !write_queue_start(path, 8, 0)) {
+        fprintf(stderr, "Cannot set up the test database\n");
+        return 1;
+    }
+    int owner = test_add_user(&loop, "owner@example.com");
+    int other = test_add_user(&loop, "other@example.com");
+    send_n(other, owner, 6, mine);
+    send_n(owner, other, 3, theirs); // Newer than some of owner's
+
+    unsigned long version = resource_version(owner, RESOURCE_NOTIFICATIONS);
+    check(run(WRITE_MARK_READ_UP_TO, owner, mine[2], NULL) == 3, "read up to an id marks that many");
+    check(resource_version(owner, RESOURCE_NOTIFICATIONS) > version, "and changes the list's version");
+    check(run(WRITE_MARK_READ_UP_TO, owner, mine[2], NULL) == 0, "again, nothing is left to mark");
+    check(run(WRITE_MARK_READ_UP_TO, owner, theirs[2], NULL) == 3, "ids past the user's own mark only theirs");
+    check(run(WRITE_MARK_READ_UP_TO, other, theirs[1], NULL) == 2, "the other user's stay unread");
+
+    send_n(other, owner, 3, mine + 6);
+    snprintf(json, sizeof(json), "[%lld, %lld, %lld, %lld, 999999]", mine[6], mine[8], mine[6], theirs[2]);
+    check(run(WRITE_MARK_READ_IDS, owner, 0, json) == 2,
+          "read by ids counts each of the user's once, skipping others' and unknown ids");
+    check(run(WRITE_MARK_READ_IDS, owner, 0, "[]") == 0, "an empty list marks none");
+
+    version = resource_version(owner, RESOURCE_NOTIFICATIONS);
+    check(run(WRITE_DELETE_READ_NOTIFICATIONS, owner, 0, NULL) == 8, "deleting read ones removes 8 of 9");
+    check(resource_version(owner, RESOURCE_NOTIFICATIONS) > version, "and changes the list's version");
+    check(run(WRITE_DELETE_READ_NOTIFICATIONS, owner, 0, NULL) == 0, "again, none are left");
+    check(run(WRITE_MARK_READ_UP_TO, owner, mine[8], NULL) == 1, "the unread one is kept");
+    check(run(WRITE_DELETE_READ_NOTIFICATIONS, other, 0, NULL) == 2, "the other user's read ones are their own");
+
+    // Unread counts, through single, bulk and repeated writes
+    int reader = test_add_user(&loop, "reader@example.com");
+    long long ids[5];
+    check(unread_is(reader, 0), "a new user has nothing unread");
+    send_n(owner, reader, 5, ids);
+    check(unread_is(reader, 5), "each notification received counts");
+    check(unread_is(owner, 0), "sending one does not");
+    mark_notification_read(&loop, reader, (int)ids[0]);
+    mark_notification_read(&loop, reader, (int)ids[0]);
+    check(unread_is(reader, 4), "reading one counts once, however often");
+    mark_notification_read(&loop, owner, (int)ids[1]);
+    check(unread_is(reader, 4), "another user cannot read it");
+    check(run(WRITE_MARK_READ_UP_TO, reader, ids[2], NULL) == 2 && unread_is(reader, 2), "read up to an id");
+    snprintf(json, sizeof(json), "[%lld, %lld]", ids[3], ids[0]);
+    check(run(WRITE_MARK_READ_IDS, reader, 0, json) == 1 && unread_is(reader, 1), "read by ids");
+    check(run(WRITE_DELETE_READ_NOTIFICATIONS, reader, 0, NULL) == 4 && unread_is(reader, 1),
+          "deleting read ones leaves the count");
+
+    // No handler marks one unread or deletes an unread one, but the
+    // triggers keep the count through either
+    char sql[128];
+    mark_notification_read(&loop, reader, (int)ids[4]);
+    snprintf(sql, sizeof(sql), "UPDATE notifications SET is_read = 0 WHERE id = %lld;", ids[4]);
+    check(sqlite3_exec(loop.db, sql, NULL, NULL, NULL) == SQLITE_OK && unread_is(reader, 1),
+          "marking one unread again counts it");
+    snprintf(sql, sizeof(sql), "DELETE FROM notifications WHERE id = %lld;", ids[4]);
+    check(sqlite3_exec(loop.db, sql, NULL, NULL, NULL) == SQLITE_OK && unread_is(reader, 0),
+          "deleting an unread one uncounts it");
+    check(rebuild_unread_counts(loop.db) && unread_is(reader, 0) && unread_is(owner, 0) && unread_is(other, 1),
+          "a rebuild from the table agrees");
+
+    write_queue_stop();
+    test_db_close(&loop, path);
+    return test_result();
+}
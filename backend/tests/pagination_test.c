@@ -0,0 +1,126 @@
+//pagination_test.c
+// Checks keyset pagination of cars and notifications: pages come newest
+// first, end exactly at the last row, hold only the user's own rows, and
+// stay put when rows are added while a client walks them.
+// Usage: tests/pagination_test
+#include <stdio.h>
+#include <string.h>
+#include <jansson.h>
+#include "harness.h"
+
+#define CARS 25
+#define PAGE 10
+
+static struct app_context loop;
+
+typedef int (*list_fn)(struct app_context *ctx, int user_id, struct page *page, struct json_writer *out);
+
+// Fetches one page into ids (at most PAGE); returns how many rows it
+// held, or -1 on failure
+static int fetch(list_fn list, int user_id, struct page *page, long long *ids) {
+    struct mg_iobuf io = {NULL, 0, 0, 256};
+    struct json_writer w;
+    int n = -1;
+
+    jw_init(&w, &io);
+    if (list(&loop, user_id, page, &w)) {
+        json_t *rows = json_loadb((const char *)io.buf, io.len, 0, NULL);
+        n = json_is_array(rows) && json_array_size(rows) <= PAGE ? (int)json_array_size(rows) : -1;
+        for (int i = 0; i < n; i++) {
+            ids[i] = json_integer_value(json_object_get(json_array_get(rows, (size_t)i), "id"));
+        }
+        json_decref(rows);
+    }
+    mg_iobuf_free(&io);
+    return n;
+}
+
+// Walks every page of a list with PAGE rows each; collects the ids in
+// order and the size of each page. Returns the number of pages, -1 on
+// failure.
+static int walk(list_fn list, int user_id, long long *ids, int *count, int *sizes, int max_pages) {
+    struct page page = {0, PAGE, 0};
+    int pages = 0;
+
+    *count = 0;
+    do {
+        int n = pages < max_pages ? fetch(list, user_id, &page, ids + *count) : -1;
+        if (n < 0) {
+            return -1;
+        }
+        sizes[pages++] = n;
+        *count += n;
+        page.after = page.next;
+    } while (page.next != 0);
+    return pages;
+}
+
+// Ids strictly descending, and each one of want (want_count of them)
+static int newest_first(const long long *ids, int count, const long long *want, int want_count) {
+    for (int i = 0; i < count; i++) {
+        int found = 0;
+        for (int j = 0; j < want_count; j++) {
+            found |= ids[i] == want[j];
+        }
+        if (!found || (i > 0 && ids[i] >= ids[i - 1])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    char path[64];
+    long long cars[CARS], notes[CARS], ids[CARS * 2];
+    int sizes[8], count;
+
+    if (!test_db_open(&loop, path, sizeof(path))) {
+        fprintf(stderr, "Cannot open the test database\n");
+        return 1;
+    }
+    int owner = test_add_user(&loop, "owner@example.com");
+    int other = test_add_user(&loop, "other@example.com");
+
+    // The other user's rows are interleaved with the owner's
+    for (int i = 0; i < CARS; i++) {
+        add_car(&loop, other, "Other", "2020", "1", "");
+        add_car(&loop, owner, "Car", "2020", "1", "");
+        cars[i] = sqlite3_last_insert_rowid(loop.db);
+        send_notification(&loop, owner, other, "Not for owner", i);
+        send_notification(&loop, other, owner, "For owner", i);
+        notes[i] = sqlite3_last_insert_rowid(loop.db);
+    }
+
+    int pages = walk(get_cars, owner, ids, &count, sizes, 8);
+    check(pages == 3 && sizes[0] == PAGE && sizes[1] == PAGE && sizes[2] == CARS - 2 * PAGE,
+          "25 cars come in pages of 10, 10 and 5");
+    check(count == CARS && newest_first(ids, count, cars, CARS), "every car of the owner once, newest first");
+
+    pages = walk(get_notifications, owner, ids, &count, sizes, 8);
+    check(pages == 3 && count == CARS && newest_first(ids, count, notes, CARS),
+          "notifications page the same way, the receiver's only");
+
+    // A list of exactly two pages ends without an empty third one
+    struct page page = {0, PAGE, 0};
+    check(fetch(get_cars, owner, &page, ids) == PAGE && page.next == ids[PAGE - 1], "next is the last id shown");
+    page.after = cars[PAGE * 2 - 1] + 1; // The 20 oldest cars are left
+    check(fetch(get_cars, owner, &page, ids) == PAGE && page.next != 0, "a full page before the end has a next");
+    page.after = page.next;
+    check(fetch(get_cars, owner, &page, ids) == PAGE && page.next == 0, "the last full page has none");
+
+    // A car added between pages does not shift the following one
+    page = (struct page){0, PAGE, 0};
+    fetch(get_cars, owner, &page, ids);
+    long long first_page_last = ids[PAGE - 1];
+    add_car(&loop, owner, "Newer", "2021", "1", "");
+    page.after = page.next;
+    check(fetch(get_cars, owner, &page, ids) == PAGE && ids[0] < first_page_last && ids[0] == cars[CARS - PAGE - 1],
+          "a new car does not move the next page");
+
+    page = (struct page){0, PAGE, 0};
+    check(fetch(get_cars, test_add_user(&loop, "empty@example.com"), &page, ids) == 0 && page.next == 0,
+          "a user without cars gets one empty page");
+
+    test_db_close(&loop, path);
+    return test_result();
+}
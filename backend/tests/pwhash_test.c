@@ -0,0 +1,93 @@
+//pwhash_test.c
+// Checks that the password hashing pool keeps concurrent hashes within
+// PWHASH_MEM_BUDGET_MB when stored hashes were made with more memory than
+// new ones get, as after lowering PWHASH_MEMLIMIT_MB.
+// Usage: tests/pwhash_test
+#include <stdio.h>
+#include <string.h>
+#include <sodium.h>
+#include "harness.h"
+
+#define PASSWORD "pwhash-test-password"
+#define JOBS 8
+#define NEW_MEMLIMIT (16u << 20)
+
+static struct app_context loop;
+
+// The jobs live in main; nothing to free
+static void verified(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+}
+
+// Submits n verifications of password against hash and waits for them
+static int verify_all(struct pwhash_job *jobs, int n, const char *hash) {
+    for (int i = 0; i < n; i++) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].base.fn = verified;
+        jobs[i].op = PWHASH_VERIFY;
+        jobs[i].ctx = &loop;
+        jobs[i].password = PASSWORD;
+        snprintf(jobs[i].hash, sizeof(jobs[i].hash), "%s", hash);
+        if (!pwhash_submit(&jobs[i])) {
+            return 0;
+        }
+    }
+    test_wait_completions(&loop, n);
+    return test_run_completions(&loop, NULL) == n;
+}
+
+static int all_verified(const struct pwhash_job *jobs, int n, int rehash) {
+    for (int i = 0; i < n; i++) {
+        if (jobs[i].result != 1 || jobs[i].rehash != rehash) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    char legacy[crypto_pwhash_STRBYTES], current[crypto_pwhash_STRBYTES];
+    struct pwhash_job jobs[JOBS];
+    struct pwhash_stats stats;
+
+    if (sodium_init() < 0) {
+        fprintf(stderr, "Cannot initialise libsodium\n");
+        return 1;
+    }
+    test_loop_init(&loop);
+
+    // A hash stored under the old default (libsodium's interactive limits),
+    // then the limits lowered to a quarter of its memory
+    hash_password(PASSWORD, legacy);
+    if (!legacy[0] || !pwhash_set_limits(crypto_pwhash_opslimit_min(), NEW_MEMLIMIT)) {
+        fprintf(stderr, "Cannot set up the hashes\n");
+        return 1;
+    }
+    hash_password(PASSWORD, current);
+
+    // The budget covers 8 new hashes but only 2 legacy ones
+    size_t budget = 2 * (size_t)crypto_pwhash_MEMLIMIT_INTERACTIVE;
+    check(pwhash_pool_start(JOBS, budget), "pool starts");
+    pwhash_stats(&stats);
+    check(stats.threads == JOBS, "8 threads: the budget fits 8 hashes at the new memlimit");
+
+    check(verify_all(jobs, JOBS, legacy) && all_verified(jobs, JOBS, 1), "legacy hashes verify and need a rehash");
+    pwhash_stats(&stats);
+    check(stats.mem_peak <= budget, "legacy verifications stay within the budget");
+    check(stats.mem_peak > 0 && stats.mem_in_use == 0, "their memory is released");
+
+    check(verify_all(jobs, JOBS, current) && all_verified(jobs, JOBS, 0), "current hashes verify without a rehash");
+    pwhash_stats(&stats);
+    check(stats.mem_peak <= budget, "current verifications stay within the budget");
+    pwhash_pool_stop();
+
+    // A budget below the legacy memlimit: those hashes fail, never run
+    budget = 2 * NEW_MEMLIMIT;
+    check(pwhash_pool_start(JOBS, budget), "pool starts on a smaller budget");
+    check(verify_all(jobs, 1, legacy) && jobs[0].result == 0, "a hash larger than the budget is refused");
+    check(verify_all(jobs, JOBS, current) && all_verified(jobs, JOBS, 0), "current hashes still verify");
+    pwhash_stats(&stats);
+    check(stats.mem_peak <= budget, "and stay within the budget");
+    pwhash_pool_stop();
+
+    return test_result();
+}
@@ -0,0 +1,206 @@
+//sse_test.c
+// Checks the notification stream: notifications sent from several loops
+// reach a subscriber once each, in id order, as stored; a reconnecting
+// client gets what it missed after its Last-Event-ID, or is told to reload
+// when too far behind; stream tickets open one stream only.
+// Usage: tests/sse_test
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "harness.h"
+
+#define SENT 20
+#define SENDER_LOOPS 2
+#define REPLAY_MAX 500 // SSE_REPLAY_MAX
+
+// One event as the subscriber received it
+struct event {
+    long long id, timestamp;
+};
+
+static struct app_context db_loop;              // The subscriber's loop
+static struct app_context loops[SENDER_LOOPS];  // Loops the senders are on
+
+static void sent(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+    free(c);
+}
+
+// Queues a notification from sender on loop, as POST /notifications does
+static int send_from(struct app_context *loop, int sender, int receiver, const char *message) {
+    struct write_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        return 0;
+    }
+    job->base.fn = sent;
+    job->op = WRITE_SEND_NOTIFICATION;
+    job->ctx = loop;
+    job->user_id = sender;
+    job->target = receiver;
+    job->args[0] = message;
+    if (!write_submit(job)) {
+        free(job);
+        return 0;
+    }
+    return 1;
+}
+
+// Parses the events written to a stream; returns how many, at most max
+static int parse_events(const struct mg_iobuf *io, struct event *events, int max) {
+    const char *p = (const char *)io->buf, *end = p + io->len;
+    int n = 0;
+
+    while (n < max && (p = memmem(p, (size_t)(end - p), "\nid: ", 5)) != NULL) {
+        events[n].id = strtoll(p + 5, NULL, 10);
+        const char *ts = memmem(p, (size_t)(end - p), "\"timestamp\":", 12);
+        events[n].timestamp = ts ? strtoll(ts + 12, NULL, 10) : -1;
+        n++;
+        p += 5;
+    }
+    return n;
+}
+
+static struct event stored[REPLAY_MAX * 2];
+static int stored_count;
+
+static void collect_row(const struct notification *n, void *arg) {
+    stored[stored_count].id = n->id;
+    stored[stored_count].timestamp = n->timestamp;
+    stored_count++;
+}
+
+// Opens a stream for user_id as a client reconnecting with Last-Event-ID
+// last_id; returns the events replayed to it, at most max, and whether it
+// was told to reload
+static int reconnect(int user_id, long long last_id, struct event *events, int max, int *reload) {
+    struct mg_connection nc;
+
+    memset(&nc, 0, sizeof(nc));
+    nc.id = 2;
+    int n = sse_subscribe(&nc, &db_loop, user_id, last_id) ? parse_events(&nc.send, events, max) : -1;
+    *reload = memmem(nc.send.buf, nc.send.len, "event: reload\n", 14) != NULL;
+    sse_close(&nc);
+    mg_iobuf_free(&nc.send);
+    return n;
+}
+
+// events are the n rows of stored after index from, in order
+static int replays_from(const struct event *events, int n, int from) {
+    if (n != stored_count - from - 1) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (events[i].id != stored[from + 1 + i].id) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    char path[64], messages[SENT][32];
+    struct mg_connection stream;
+    struct event events[SENT * 2];
+
+    if (!test_db_open(&db_loop, path, sizeof(path))) {
+        fprintf(stderr, "Cannot open the test database\n");
+        return 1;
+    }
+    int senders[SENDER_LOOPS] = {test_add_user(&db_loop, "sender1@example.com"),
+                                 test_add_user(&db_loop, "sender2@example.com")};
+    int receiver = test_add_user(&db_loop, "receiver@example.com");
+    for (int i = 0; i < SENDER_LOOPS; i++) {
+        test_loop_init(&loops[i]);
+    }
+    if (!write_queue_start(path, 4, 1000)) {
+        fprintf(stderr, "Cannot start the writer\n");
+        return 1;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    stream.id = 1;
+    check(sse_subscribe(&stream, &db_loop, receiver, 0), "subscribe");
+
+    // Senders on different loops take turns, in batches of 4
+    int submitted = 0;
+    for (int i = 0; i < SENT; i++) {
+        snprintf(messages[i], sizeof(messages[i]), "Message %d", i);
+        submitted += send_from(&loops[i % SENDER_LOOPS], senders[i % SENDER_LOOPS], receiver, messages[i]);
+    }
+    check(submitted == SENT, "notifications queued");
+
+    // Events are queued to the subscriber before their senders hear back
+    for (int i = 0; i < SENDER_LOOPS; i++) {
+        test_wait_completions(&loops[i], SENT / SENDER_LOOPS);
+        test_run_completions(&loops[i], NULL);
+    }
+    check(test_run_completions(&db_loop, &stream) == SENT, "one event per notification");
+
+    int n = parse_events(&stream.send, events, SENT * 2);
+    int ordered = n == SENT;
+    for (int i = 1; i < n; i++) {
+        ordered &= events[i].id > events[i - 1].id;
+    }
+    check(ordered, "events arrive in id order");
+
+    get_notifications_since(&db_loop, receiver, 0, SENT * 2, collect_row, NULL);
+    int same = stored_count == n;
+    for (int i = 0; same && i < n; i++) {
+        same = stored[i].id == events[i].id && stored[i].timestamp == events[i].timestamp;
+    }
+    check(same, "events carry the stored ids and timestamps");
+
+    sse_close(&stream);
+    mg_iobuf_free(&stream.send);
+
+    // A reconnecting client gets only what came after its last event, and
+    // none of the notifications it sent itself
+    static struct event replayed[REPLAY_MAX * 2];
+    int reload;
+    send_notification(&db_loop, receiver, senders[0], "Not for receiver", 0);
+    n = reconnect(receiver, stored[SENT / 2 - 1].id, replayed, REPLAY_MAX * 2, &reload);
+    check(replays_from(replayed, n, SENT / 2 - 1) && !reload, "reconnecting replays the missed events in order");
+    n = reconnect(receiver, stored[SENT - 1].id, replayed, REPLAY_MAX * 2, &reload);
+    check(n == 0 && !reload, "a client that missed nothing gets nothing");
+
+    // Events replayed are not delivered again when published after
+    memset(&stream, 0, sizeof(stream));
+    stream.id = 1;
+    sse_subscribe(&stream, &db_loop, receiver, stored[SENT - 2].id);
+    struct notification again = {
+        .id = stored[SENT - 1].id,
+        .sender_id = senders[0],
+        .receiver_id = receiver,
+        .message = "Message",
+        .timestamp = stored[SENT - 1].timestamp,
+    };
+    sse_publish(&again);
+    test_run_completions(&db_loop, &stream);
+    check(parse_events(&stream.send, replayed, 4) == 1, "a replayed event published again is skipped");
+    sse_close(&stream);
+    mg_iobuf_free(&stream.send);
+
+    // Too far behind: the newest are replayed up to the cap, then reload
+    for (int i = 0; i < REPLAY_MAX; i++) {
+        send_notification(&db_loop, senders[0], receiver, "Backlog", 0);
+    }
+    stored_count = 0;
+    get_notifications_since(&db_loop, receiver, 0, REPLAY_MAX * 2, collect_row, NULL);
+    n = reconnect(receiver, stored[0].id, replayed, REPLAY_MAX * 2, &reload);
+    check(n == REPLAY_MAX && replayed[0].id == stored[1].id && reload,
+          "a client too far behind gets the first 500 missed and a reload event");
+
+    char ticket[SSE_TICKET_HEX + 1], other[SSE_TICKET_HEX + 1];
+    sse_ticket_issue(receiver, ticket);
+    sse_ticket_issue(senders[0], other);
+    check(strlen(ticket) == SSE_TICKET_HEX && strcmp(ticket, other) != 0, "tickets are random hex");
+    check(sse_ticket_redeem(ticket) == receiver, "a ticket opens a stream for its user");
+    check(sse_ticket_redeem(ticket) == 0, "but only once");
+    check(sse_ticket_redeem(other) == senders[0], "tickets are independent");
+    ticket[0] = ticket[0] == '0' ? '1' : '0';
+    check(sse_ticket_redeem(ticket) == 0 && sse_ticket_redeem("") == 0 && sse_ticket_redeem("zz") == 0,
+          "unknown and malformed tickets are refused");
+    write_queue_stop();
+    test_db_close(&db_loop, path);
+    return test_result();
+}
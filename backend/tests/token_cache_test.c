@@ -0,0 +1,84 @@
+//token_cache_test.c
+// Checks the verified-token cache: a verified token is served from it
+// until it expires, is evicted least recently used first, and a user's
+// tokens are dropped when the password changes or the account is deleted.
+// Usage: tests/token_cache_test
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sodium.h>
+#include "harness.h"
+
+#define SECRET "token-cache-test-secret"
+#define TABLE 4096 // TOKEN_CACHE_SIZE
+
+static struct app_context loop;
+
+// Signs a token for user_id; iat tells tokens of one user apart
+static void sign(int user_id, long iat, char *token) {
+    long now = (long)time(NULL);
+    if (!jwt_hs256_sign(&loop.jwt_key, user_id, now - iat, now + 3600, token, 512)) {
+        token[0] = '\0';
+    }
+}
+
+// Verifies token and says whether the cache answered
+static int verify_cached(const char *token, int *user_id) {
+    unsigned long hits, misses, hits_after;
+    token_cache_stats(&hits, &misses);
+    *user_id = verify_token(&loop, token);
+    token_cache_stats(&hits_after, &misses);
+    return hits_after > hits;
+}
+
+int main(void) {
+    char path[64], first[512], second[512], theirs[512], key[32];
+    int user_id;
+
+    if (sodium_init() < 0 || !test_db_open(&loop, path, sizeof(path))) {
+        fprintf(stderr, "Cannot open the test database\n");
+        return 1;
+    }
+    loop.jwt_secret = SECRET;
+    jwt_hs256_key_init(&loop.jwt_key, SECRET);
+    int owner = test_add_user(&loop, "owner@example.com");
+    int other = test_add_user(&loop, "other@example.com");
+    sign(owner, 1, first);
+    sign(owner, 2, second);
+    sign(other, 1, theirs);
+
+    check(!verify_cached(first, &user_id) && user_id == owner, "a new token is verified");
+    check(verify_cached(first, &user_id) && user_id == owner, "then served from the cache");
+    verify_token(&loop, second);
+    verify_token(&loop, theirs);
+
+    // A password change drops every token of that user, and only theirs
+    check(update_user_password(&loop, owner, "$argon2id$new-hash"), "password changed");
+    check(token_cache_lookup(first, (long)time(NULL)) == 0 && token_cache_lookup(second, (long)time(NULL)) == 0,
+          "the user's tokens leave the cache");
+    check(token_cache_lookup(theirs, (long)time(NULL)) == other, "another user's stay");
+    check(!verify_cached(first, &user_id) && user_id == owner, "a dropped token is verified again");
+
+    check(delete_user(&loop, other), "account deleted");
+    check(token_cache_lookup(theirs, (long)time(NULL)) == 0, "its tokens leave the cache");
+    check(token_cache_lookup(first, (long)time(NULL)) == owner, "other users' stay");
+
+    // Expired entries are not served, and are dropped
+    token_cache_insert("expired-token", owner, (long)time(NULL) - 1);
+    check(token_cache_lookup("expired-token", (long)time(NULL)) == 0, "an expired token misses");
+
+    // A full table evicts the least recently used token
+    for (int i = 0; i < TABLE; i++) {
+        snprintf(key, sizeof(key), "filler-%d", i);
+        token_cache_insert(key, 1000 + i, (long)time(NULL) + 3600);
+        if (i == TABLE / 2) {
+            token_cache_lookup(first, (long)time(NULL)); // Recently used again
+        }
+    }
+    check(token_cache_lookup(first, (long)time(NULL)) == owner, "a recently used token survives a full table");
+    check(token_cache_lookup("filler-0", (long)time(NULL)) == 0, "the least recently used is evicted");
+    check(token_cache_lookup("filler-4095", (long)time(NULL)) == 1000 + TABLE - 1, "the newest is kept");
+
+    test_db_close(&loop, path);
+    return test_result();
+}
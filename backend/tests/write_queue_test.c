@@ -0,0 +1,141 @@
+//write_queue_test.c
+// Checks writes on the writer thread: registration commits the user or
+// reports the taken email, deleting an account removes it and bumps every
+// version of its resources, and the photo data of new cars, one at a time
+// or imported in a batch, is stored by the writer, the cars keeping links.
+// Usage: tests/write_queue_test
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sodium.h>
+#include "harness.h"
+
+#define HASH "$argon2id$v=19$m=65536,t=2,p=1$c2FsdA$aGFzaA"
+
+// "photo" in base64, and its SHA-256
+#define PHOTO_DATA "data:image/jpeg;base64,cGhvdG8="
+#define PHOTO_SHA256 "55c64d0fcd6f9d5f7c828093857e3fdfda68478bb4e9bd24d481ef391c7804e8"
+
+static struct app_context loop;
+
+// The jobs live on the stack of their test; nothing to free
+static void written(struct mg_connection *nc, struct completion *c, struct app_context *ctx) {
+}
+
+static void init_job(struct write_job *job, enum write_op op, int user_id) {
+    memset(job, 0, sizeof(*job));
+    job->base.fn = written;
+    job->op = op;
+    job->ctx = &loop;
+    job->user_id = user_id;
+}
+
+static void init_add_car(struct write_job *job, int user_id, const char *photo) {
+    init_job(job, WRITE_ADD_CAR, user_id);
+    job->args[0] = "Car";
+    job->args[1] = "2020";
+    job->args[2] = "10000";
+    job->args[3] = photo;
+}
+
+static void init_register(struct write_job *job, const char *email) {
+    init_job(job, WRITE_REGISTER_USER, 0);
+    job->args[0] = "Test";
+    job->args[1] = "User";
+    job->args[2] = email;
+    job->args[3] = "DriveHub";
+    snprintf(job->text, sizeof(job->text), "%s", HASH);
+}
+
+// Queues n jobs at once, so they can share a batch, and waits for them
+static int run_jobs(struct write_job *jobs, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!write_submit(&jobs[i])) {
+            return 0;
+        }
+    }
+    test_wait_completions(&loop, n);
+    return test_run_completions(&loop, NULL) == n;
+}
+
+int main(void) {
+    char path[64], photos[64], stored[160], hash[crypto_pwhash_STRBYTES];
+    struct write_job jobs[2];
+
+    snprintf(photos, sizeof(photos), "/tmp/drivehub-test-photos-%d", (int)getpid());
+    if (!test_db_open(&loop, path, sizeof(path)) || !photo_store_init(photos, 1 << 20) ||
+        !write_queue_start(path, 8, 1000)) {
+        fprintf(stderr, "Cannot set up the test database\n");
+        return 1;
+    }
+
+    init_register(&jobs[0], "first@example.com");
+    check(run_jobs(jobs, 1) && jobs[0].result == 1 && jobs[0].rowid > 0, "register commits the user");
+    int user_id = (int)jobs[0].rowid;
+    check(get_password_hash(&loop, "first@example.com", hash) == user_id && strcmp(hash, HASH) == 0,
+          "with its password hash");
+
+    init_register(&jobs[0], "first@example.com");
+    check(run_jobs(jobs, 1) && jobs[0].result == -1, "a taken email is reported as -1");
+
+    // One of two registrations in the same batch wins; the batch goes on
+    init_register(&jobs[0], "race@example.com");
+    init_register(&jobs[1], "race@example.com");
+    check(run_jobs(jobs, 2) && jobs[0].result + jobs[1].result == 0, "one of two racing registrations wins");
+
+    // Photo data is stored before the car is inserted; a bad photo fails
+    // its own car only
+    struct stat st;
+    init_add_car(&jobs[0], user_id, PHOTO_DATA);
+    init_add_car(&jobs[1], user_id, "data:image/jpeg;base64,!!!!");
+    check(run_jobs(jobs, 2) && jobs[0].result == 1 && jobs[0].rowid > 0, "a car with photo data is added");
+    check(strcmp(jobs[0].text, PHOTO_URL_PREFIX PHOTO_SHA256) == 0, "it keeps the photo's link");
+    snprintf(stored, sizeof(stored), "%s/%s", photos, PHOTO_SHA256);
+    check(stat(stored, &st) == 0 && st.st_size == 5, "the photo is in the store");
+    check(jobs[1].result == -1 && jobs[1].rowid == 0, "a car with invalid photo data is refused");
+    init_add_car(&jobs[0], user_id, "https://example.com/car.jpg");
+    check(run_jobs(jobs, 1) && jobs[0].result == 1 && strcmp(jobs[0].text, "https://example.com/car.jpg") == 0,
+          "a photo link is kept as it is");
+
+    // In a batch import only the row with a bad photo fails
+    struct car_batch *batch = calloc(1, sizeof(*batch) + 3 * sizeof(batch->rows[0]));
+    const char *batch_photos[3] = {PHOTO_DATA, "data:image/jpeg;base64,!!!!", NULL};
+    batch->total = batch->count = 3;
+    for (int i = 0; i < 3; i++) {
+        batch->rows[i].index = i;
+        batch->rows[i].car_name = "Car";
+        batch->rows[i].year_of_manufacture = "2021";
+        batch->rows[i].car_value = "20000";
+        batch->rows[i].photo = batch_photos[i];
+    }
+    init_job(&jobs[0], WRITE_ADD_CARS, user_id);
+    jobs[0].owned = batch;
+    check(run_jobs(jobs, 1) && jobs[0].result == 1 && jobs[0].count == 2, "a batch inserts its valid rows");
+    check(batch->rows[0].id > 0 && strcmp(batch->rows[0].photo, PHOTO_URL_PREFIX PHOTO_SHA256) == 0,
+          "a row's photo data is stored and linked");
+    check(batch->rows[1].id == -1, "a row with invalid photo data is refused");
+    check(batch->rows[2].id > 0 && strcmp(batch->rows[2].photo, "") == 0, "a row without a photo gets none");
+    free(batch);
+
+    unsigned long versions[RESOURCE_COUNT];
+    for (int r = 0; r < RESOURCE_COUNT; r++) {
+        versions[r] = resource_version(user_id, (enum resource)r);
+    }
+    init_job(&jobs[0], WRITE_DELETE_USER, user_id);
+    check(run_jobs(jobs, 1) && jobs[0].result == 1, "delete commits");
+    check(get_password_hash(&loop, "first@example.com", hash) == 0, "the user is gone");
+    int bumped = 1;
+    for (int r = 0; r < RESOURCE_COUNT; r++) {
+        bumped &= resource_version(user_id, (enum resource)r) > versions[r];
+    }
+    check(bumped, "every resource of the user has a new version");
+    check(!email_taken(&loop, "first@example.com"), "its email is free again");
+
+    write_queue_stop();
+    test_db_close(&loop, path);
+    unlink(stored);
+    rmdir(photos);
+    return test_result();
+}